@@ -0,0 +1,340 @@
+// (c) Ed French 2021
+
+/*
+  The Altanx state engine: pairing, syncing, buzzing and the display.
+
+  Nothing in here touches the hardware directly, it all goes through the
+  altanx_hal passed in at construction. See src/altanx.cpp for the
+  signalling methodology.
+*/
+
+#ifndef ALTANX_H
+#define ALTANX_H
+
+#include <stdint.h>
+#include "hal.h"
+#include "time_sync.h"
+#include "motor_scheduler.h"
+#include "display_renderer.h"
+#include "button_engine.h"
+#include "rx_queue.h"
+#include "link_quality.h"
+#include "wire_protocol.h"
+#include "state_store.h"
+#include "trace.h"
+#include "battery.h"
+#include "energy.h"
+#include "group.h"
+#include "wake_cache.h"
+#include "retry.h"
+#include "rendezvous.h"
+#include "fsm.h"
+#include "bench.h"
+#include "ulp_stim.h"
+
+#define SAVE_PEER_INFO
+
+#define BUZZ_PERIOD_MS 2000 // Complete period including on and off, shared out between the slots (group.h)
+
+#define PWM_LEVEL 128 // WAVEFORM_SQUARE's duty
+#ifndef BUZZ_WAVEFORM
+#define BUZZ_WAVEFORM WAVEFORM_SOFT // See waveform.h
+#endif
+
+#define SHORT_BUTTON_THRESHOLD 3000
+#define VERY_LONG_BUTTON_THRESHOLD 12000
+
+#define LOOP_DELAY_MS 20 // Make much longer when debugging as it's easier to follow serial messages
+#define IDLE_WAIT_MS 10000 // Longest sleep between loops when there is nothing to poll
+
+#define WIFI_CHANNEL 0
+
+#define COLOUR_BLACK 0x0000
+#define COLOUR_RED 0xF800
+#define COLOUR_WHITE 0xFFFF
+
+// The last completed press, for update_state()
+struct button_state
+{
+  bool pressed;
+  uint16_t press_length_ms;
+  button_events kind;
+};
+
+// Handshakes, see retry.h. The leader's pair and sync requests go out on
+// the rendezvous beat so a follower listening in windows catches them,
+// see rendezvous.h
+#define PAIR_DEADLINE_MS 60000 // Either side gives up pairing and switches off
+#define SYNC_DEADLINE_MS 60000 // Leader gives up syncing
+#define FOLLOWER_SYNC_DEADLINE_MS 120000 // Outlasts the leader's
+#define SYNC_PARTIAL_MS 12000 // Leader goes on with the followers it has after this
+#define SYNC_QUIET_MS 1000 // Leader only asks again once a follower's been quiet this long
+#define SYNC_DONE_TRIES 5 // Follower gives up waiting for the leader to ack after this
+#define RESYNC_DONE_WAIT_MS (SYNC_DONE_TRIES*SYNC_REPLY_TIMEOUT_MS+RESYNC_GUARD_MS) // Leader, after the follower's last request
+
+// A received frame, see wire_protocol.h for what goes over the air
+typedef struct received_msg {
+  wire_message message; // Decoded
+  uint8_t mac_addr[6];
+  bool new_ready=false;
+  unsigned long rx_time=0;
+  int64_t rx_time_us=0; // Taken in the receive callback, so as close to the air as we can get
+} received_msg;
+
+enum pairing_states
+{
+  BLANK_WAITING_TO_START_PAIRING=0,
+  PAIRING=1,
+  PAIRED_NOT_SYNCED=2,
+  SYNCING=3,
+  PAIRED_SYNCED=4,
+  DUMMY=5
+};
+#define PAIRING_STATE_COUNT (DUMMY+1)
+
+// What update_state() hands the transition table, see fsm.h
+enum pairing_events
+{
+  EVENT_POLL=0, // Every pass
+  EVENT_RECEIVED=1, // last_received has a frame
+  EVENT_SHORT_PRESS=2, // Front button
+  EVENT_LONG_PRESS=3,
+  EVENT_VERY_LONG_PRESS=4,
+  EVENT_PAIRED=5, // Raised once the pairing handshake is done
+  EVENT_SYNCED=6, // And the sync handshake
+  EVENT_TIMED_OUT=7, // Pairing or syncing ran past its deadline
+  PAIRING_EVENT_COUNT=8
+};
+
+extern const char *state_names[];
+extern const char *event_names[];
+
+typedef struct t_sync_state
+{
+  enum pairing_states pairing_state;
+  uint8_t partner[6]; // Follower: its leader
+  bool is_leader;
+  bool is_synced;
+  bool buzz_enabled;
+  bool led_enabled;
+  uint32_t time_offset;
+  uint32_t state_change_time;
+  peer_table group; // Leader: its followers
+  uint8_t slot; // Our buzz window, see group.h
+  uint8_t slots;
+} t_sync_state;
+
+// What the leader knows of each follower this boot, alongside its peer table
+struct group_member
+{
+  bool synced;
+  int64_t window_us; // Next resync window, leader clock. 0 if not synced
+  int64_t proposed_us; // The window after, from its sync done
+  bool due; // Expected in the window that's open
+  bool heard;
+  bool done; // Sync done this window
+  bool asked; // Time request in the round being collected
+  int64_t request_t1; // Its clock
+  int64_t request_t2; // Ours
+  uint32_t asked_ms; // Last time request while syncing, 0 before the first
+};
+
+// What a ULP sleep (ulp_stim.h) keeps after the wake cache, so the boot
+// it wakes to carries on synced. Only ever read back by the same build
+#define ULP_SNAPSHOT_VERSION 1
+struct ulp_snapshot
+{
+  uint8_t version;
+  uint8_t slot;
+  uint8_t slots;
+  uint32_t session_id;
+  int64_t time_offset_us;
+  int64_t leader_epoch_us;
+  int64_t resync_window_us;
+  int64_t resync_interval_us;
+  uint32_t resyncs;
+  uint32_t resync_misses;
+  group_member members[GROUP_MAX_FOLLOWERS];
+  drift_estimator drift;
+  uint16_t crc; // wire_crc16() of the lot with this 0
+};
+
+void buff_print_mac(char * buffer,const uint8_t * mac_addr);
+
+class altanx_device : public radio_listener
+{
+  public:
+    altanx_device(altanx_hal & hal,bool is_leader_def);
+
+    void begin(); // Was setup()
+    void loop_once(); // Was loop()
+
+    // radio_listener, called from the WiFi task on the device
+    void on_recv(const uint8_t * mac_addr,const uint8_t * data,int len,int8_t rssi);
+    void on_sent(const uint8_t * mac_addr,bool success);
+
+    altanx_hal & hal;
+    bool is_leader_def;
+
+    t_sync_state main_state;
+    // old_state stores the previous state so the display can be selectively updated
+    // it is initialised to be different in every regard so it can all be drawn the first time
+    t_sync_state old_state;
+
+    rx_queue radio_rx; // Filled by on_recv(), drained by update_state()
+    received_msg last_received; // The message update_state() is handling
+    wire_message message={}; // Outgoing, send_message() fills in the header
+    uint32_t session_id=0; // Leader's pick, the follower adopts it when paired
+    uint8_t pair_expected=GROUP_FOLLOWERS; // Leader stops pairing once this many have answered
+    uint32_t pair_first_ms=0; // Leader: when the first follower answered, 0 until then
+    uint16_t tx_seq=0;
+    uint32_t wire_errors=0; // Frames that didn't decode
+
+    button_engine buttons;
+    button_state side_button={false,0,BUTTON_SHORT_PRESS};
+    button_state front_button={false,0,BUTTON_SHORT_PRESS};
+
+    // Where update_state() goes next, see fsm.h
+    pairing_events raised=PAIRING_EVENT_COUNT; // By the action running, PAIRING_EVENT_COUNT for none
+    fsm_timing transition_timing[PAIRING_STATE_COUNT*PAIRING_EVENT_COUNT];
+
+    // Pairing or syncing, whichever is going on
+    retry_timer handshake;
+    retry_stats pair_stats;
+    retry_stats sync_stats;
+    rendezvous listen_windows; // Follower, until it hears the leader
+
+    // Phase epoch in this device's own micros(). The leader picks it, the
+    // follower works out the same instant on its own clock
+    int64_t time_offset_us=0;
+
+    // Round trip sync, leader side
+    group_member members[GROUP_MAX_FOLLOWERS];
+    int64_t round_started_us=0; // First time request of the round, 0 when none is waiting
+    uint32_t rounds=0; // Group replies sent
+
+    // Round trip sync, follower side
+    time_sync_estimator sync_estimator;
+    int64_t time_request_t1=-1; // -1 when there isn't a request outstanding
+    uint32_t time_request_sent_ms=0;
+    int64_t leader_epoch_us=0;
+    bool sync_done_pending=false;
+    bool sync_done_acked=false;
+    uint8_t sync_done_tries=0;
+    uint32_t sync_done_sent_ms=0;
+
+    // Resync bursts once synced. Windows are in the leader's clock, the
+    // follower works out where they fall on its own with drift
+    drift_estimator drift;
+    int64_t resync_window_us=0; // Start of the next window, 0 when none is planned
+    int64_t resync_interval_us=0; // Follower: gap to propose for the window after next
+    int64_t resync_proposal_us=0; // Follower: window after this one, sent with sync done
+    bool resync_active=false; // Radio is on for a window
+    int64_t resync_last_heard_us=0; // Leader: from any follower this window
+    uint32_t resyncs=0;
+    uint32_t resync_misses=0;
+
+    motor_scheduler motor; // Owns the motor pin once synced
+    display_renderer renderer; // Status screen, only redraws what changed
+    state_store store; // What survives a power off
+    wake_cache wake; // And a copy for a quick wake from deep sleep
+    trace_recorder trace; // Inputs and outputs for replay, 't' on serial dumps it
+    battery_monitor battery;
+    energy_meter energy; // Where the battery went, 'e' on serial shows it
+    link_quality link; // Delivery and transmit power, 'l' on serial shows it
+
+    bool buzzing=false;
+    bool radio_on=false;
+    bool fast_wake=false; // This boot came from the wake cache
+    int64_t first_buzz_us=-1; // micros() of the first buzz since boot
+
+    // ULP sleeps between resync windows, see ulp_stim.h
+    bool ulp_resumed=false; // This boot carried on from one
+    bool ulp_unavailable=false; // The board can't, from begin() or a ulp_sleep() that said no
+    bool display_awake=false; // Dark through a ULP sleep and the boot after, until a press or a message
+    bool waking_press=false; // The press that woke it is still down, letting go only lights the screen
+    uint32_t lit_ms=0; // Last thing worth keeping the screen up for ULP_AWAKE_MS
+
+    void delay_with_yield(uint32_t ms);
+    void change_pairing_state(pairing_states new_state,const char * marker);
+    void update_display(t_sync_state main_state,bool force_update=false);
+    void show_message(uint8_t seconds,const char * message);
+    void switch_off_wifi(uint32_t linger_ms=1000);
+    void save_state(const void * extra=NULL,size_t extra_len=0); // extra goes after the wake cache
+
+    // Transition table actions, these take last_received
+    void leader_pairing_rx();
+    void leader_syncing_rx();
+    void follower_pairing_rx();
+    void follower_syncing_rx();
+    void leader_resync_rx();
+    void follower_resync_rx();
+
+    void shutdown();
+    void display_init(bool splash=true);
+    void update_alerts();
+    void update_battery();
+    void report_energy();
+    void report_retries();
+    void report_transitions();
+    void run_benchmarks(); // 'b' on serial, see bench.h
+    void start_handshake(bool pairing);
+    void finish_handshake(retry_stats & stats,bool success);
+    const char * button_hint(const button_event & event);
+    void esp_now_startup(bool broadcast=false);
+
+    void pairing_init();
+    void leader_pairing_init();
+    void follower_pairing_init();
+    void syncing_init();
+    void leader_syncing_init();
+    void follower_syncing_init();
+    void leader_send_pair_request();
+    void leader_send_sync_request();
+    void leader_send_time_reply(received_msg rx);
+    void leader_finish_pairing();
+    void leader_pairing_poll();
+    void leader_syncing_poll();
+    void leader_finish_sync();
+    void leader_round_rx(received_msg rx,int8_t member);
+    void leader_round_update();
+    void leader_send_round();
+    bool leader_all_synced();
+    bool leader_any_synced();
+    bool follower_reply_t2(const received_msg & rx,int64_t & t2);
+    void follower_start_exchange();
+    void follower_send_time_request();
+    void follower_send_sync_done();
+    void follower_finish_pairing();
+    void follower_finish_sync();
+    void follower_syncing_poll();
+    void follower_synced_poll();
+    void leader_resync_update();
+    void follower_resync_update();
+    void follower_finish_resync();
+    void follower_rendezvous_update();
+    void follower_track_epoch();
+    uint32_t ms_until_resync();
+    void start_pairing();
+    void start_syncing();
+    void give_up_pairing();
+    void give_up_syncing();
+    void switch_off();
+    void factory_reset();
+    void repair();
+    void dummy_state();
+    void record_boot(bool loaded,int32_t skew_ppb);
+    int64_t ulp_wake_us();
+    bool ulp_sleep_due();
+    void ulp_sleep();
+    bool ulp_resume();
+
+    bool send_message(const uint8_t * mac_addr,wire_types type);
+    bool next_received();
+    void dispatch(pairing_events event);
+    void raise(pairing_events event);
+    void update_state();
+    void update_buttons();
+};
+
+#endif
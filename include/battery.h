@@ -0,0 +1,90 @@
+// (c) Ed French 2021
+
+/*
+          Battery monitor
+          ===============
+
+  rough_spec.txt wants the device to stop and stay in deep sleep once the
+  cell gets down to about 2.9 V, and to say when it's low or charging.
+
+  The loop calls poll() every pass and a sample is taken every
+  BATTERY_SAMPLE_MS, more often once the battery is low as the voltage
+  falls quickly near the end. Each sample is BATTERY_OVERSAMPLE ADC reads
+  averaged by the hal. None of it happens in a timer callback so the motor
+  timer is never held up, and a sample due while the motor is on waits
+  for the off half of the buzz so the motor's pull on the cell doesn't
+  read as a flatter battery. Samples go through a first order IIR filter
+  (weight 1/2^BATTERY_FILTER_SHIFT) to take out ADC noise.
+
+  The filtered voltage goes through the discharge curve (battery_percent())
+  for what's left, and that times BATTERY_FULL_MINUTES for the treatment
+  time left. Above BATTERY_USB_MV the board is on USB and the cell is
+  charging, the curve means nothing then.
+
+  The simulator drains its battery model through the same curve, see
+  src/native.
+
+*/
+
+#ifndef ALTANX_BATTERY_H
+#define ALTANX_BATTERY_H
+
+#include <stdint.h>
+#include "hal.h"
+
+class trace_recorder;
+
+#define BATTERY_SAMPLE_MS 30000
+#define BATTERY_SAMPLE_LOW_MS 5000
+#define BATTERY_DEFER_MS 100 // Try again this soon if the motor was on
+#define BATTERY_FILTER_SHIFT 2
+#define BATTERY_FIRST_SAMPLES 4 // Averaged at boot, there's no history to filter against
+
+#define BATTERY_LOW_MV 3700 // About 30 minutes left
+#define BATTERY_HYSTERESIS_MV 30 // Low stays low until this far back above
+#define BATTERY_CUTOFF_MV 2900 // rough_spec.txt, stop and stay asleep
+#define BATTERY_RESUME_MV 3400 // Won't start up again below this unless on USB
+#define BATTERY_USB_MV 4400 // Only USB gets it this high
+#define BATTERY_FULL_MINUTES 240 // rough_spec.txt, 4 hours of treatment on a new battery
+
+class battery_monitor
+{
+  public:
+    battery_monitor(altanx_hal & hal) : hal(hal) {}
+
+    void begin(); // One sample straight away, so boot can check it
+    // Samples if one is due and the motor's off. True if what would be
+    // shown (percent, low, charging) changed
+    bool poll(bool motor_on);
+    uint32_t ms_until_sample();
+
+    bool known() { return mv>0; } // Some boards can't measure it
+    bool flat() { return known() && !charging && mv<BATTERY_CUTOFF_MV; }
+    bool too_flat_to_start() { return known() && !charging && mv<BATTERY_RESUME_MV; }
+
+    altanx_hal & hal;
+
+    uint32_t mv=0; // Filtered, 0 until the first sample or if unknown
+    uint8_t percent=0;
+    uint16_t minutes_left=0;
+    bool low=false;
+    bool charging=false;
+    uint32_t samples=0;
+    uint32_t deferred=0; // Samples put off because the motor was on
+
+    trace_recorder * trace=NULL; // Gets the readings if set
+
+  private:
+    int64_t next_sample_us=0;
+    uint32_t filtered_x16=0; // mV*16, keeps the filter's fractions
+
+    uint32_t read();
+    void take_sample(uint32_t sample);
+};
+
+// The discharge curve, both ways. Permille so the simulator's model
+// drains smoothly
+uint32_t battery_curve_mv(uint16_t permille);
+uint8_t battery_percent(uint32_t mv);
+
+#endif
@@ -0,0 +1,67 @@
+// (c) Ed French 2021
+
+/*
+          Benchmarks
+          ==========
+
+  'b' on serial times the hot paths with the CPU's cycle counter, on the
+  device or in the host simulator (sim --bench):
+
+      wire_encode      a time reply into a frame
+      wire_decode      a full group reply back out, CRC and all
+      motor_next_step  finding where the motor timer goes next
+      fsm_poll         a pass of the state engine (fsm.h) in the state it's
+                       in, left out if that pass would change state
+      display_frame    the whole status screen redrawn, the SPI included
+                       on the device
+
+  then what it's measured while running:
+
+      motor_edge_late  how late the motor timer fired against its edge, in
+                       us, over every edge since boot
+      RETRY lines      how long the handshakes took, see retry.h
+
+  One line each, made for diffing two builds or scraping into a sheet:
+
+      BENCH <name> unit=<unit> n= min= mean= max= [mean_ns=]
+
+  Anything before "BENCH " on a line is left out, as for the trace, so a
+  serial capture or the simulator's output can be used as it is. Cycles
+  come with mean_ns at the clock they ran at. In the simulator they're
+  the host's in ns, as its own clock is virtual, so compare them between
+  builds, not with the device's.
+
+  The loop stops while they run, a second or so with the display. The
+  motor keeps going off its timer.
+
+*/
+
+#ifndef ALTANX_BENCH_H
+#define ALTANX_BENCH_H
+
+#include <stdint.h>
+#include "hal.h"
+
+#define BENCH_RUNS 1000
+#define BENCH_FRAMES 10 // display_frame, each one a full screen over SPI
+
+struct bench_stat
+{
+  bench_stat(const char * name,const char * unit) : name(name),unit(unit) {}
+
+  void record(uint32_t value);
+  void report(altanx_hal & hal); // One BENCH line over the log output
+
+  const char * name;
+  const char * unit; // "cycles" for the ones timed here
+  uint32_t count=0;
+  uint32_t min=UINT32_MAX;
+  uint32_t max=0;
+  uint64_t total=0;
+};
+
+// The ones that need nothing from the state engine
+void bench_wire(altanx_hal & hal,uint32_t runs);
+void bench_motor(altanx_hal & hal,uint32_t runs);
+
+#endif
@@ -0,0 +1,37 @@
+// (c) Ed French 2021
+
+// Pin definitions for the supported boards, selected in platformio.ini
+
+#ifndef ALTANX_BOARD_H
+#define ALTANX_BOARD_H
+
+#ifdef BOARD_TYPE_TDISPLAY
+  #define PIN_VIBRATION 27
+  #define PIN_FRONT_BUTTON 35
+  #define WAKE_UP_PIN_DEFN GPIO_NUM_35
+  #define PIN_BACKLIGHT 4
+  #define PIN_BATTERY 34 // Through a 100k/100k divider
+  #define PIN_ADC_ENABLE 14 // Switches the divider in
+  #define BATTERY_DIVIDER 2
+#endif
+#ifdef BOARD_TYPE_M5STICKC
+  #define PIN_VIBRATION 26
+  #define PIN_FRONT_BUTTON 37
+  #define PIN_SIDE_BUTTON 39
+  #define WAKE_UP_PIN_DEFN GPIO_NUM_35
+#endif
+
+#define VIBE_STOPPED LOW
+#define VIBRATING HIGH
+
+#define PRESSED false
+
+#define PIN_LED 10
+
+#define PWM_CHANNEL 0
+#define PWM_FREQ 4000
+#define PWM_RESOLUTION 8
+
+#define BATTERY_OVERSAMPLE 16 // ADC reads averaged for one battery sample
+
+#endif
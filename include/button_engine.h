@@ -0,0 +1,87 @@
+// (c) Ed French 2021
+
+/*
+          Button engine
+          =============
+
+  Turns the raw, bouncy edges the HAL timestamps in its GPIO interrupt into
+  press events, without ever blocking loop():
+
+    BUTTON_DOWN                 as soon as a press starts
+    BUTTON_HELD_LONG            still held past SHORT_BUTTON_THRESHOLD
+    BUTTON_HELD_VERY_LONG       still held past VERY_LONG_BUTTON_THRESHOLD
+    BUTTON_SHORT/LONG/VERY_LONG_PRESS   on release, with the length
+
+  The HELD events are there so the display can say what letting go will do
+  while the button is still down.
+
+  Debouncing works on the edge timestamps: the first edge flips the state
+  straight away and anything within BUTTON_DEBOUNCE_MS of it is bounce. If
+  the pin disagrees with the state once the edges have gone quiet (a bounce
+  swallowed the real edge) poll() puts it right.
+
+*/
+
+#ifndef ALTANX_BUTTON_ENGINE_H
+#define ALTANX_BUTTON_ENGINE_H
+
+#include <stdint.h>
+#include "hal.h"
+
+#define BUTTON_DEBOUNCE_MS 30
+#define BUTTON_EVENT_QUEUE 8 // Power of 2
+
+class trace_recorder;
+
+enum button_events
+{
+  BUTTON_DOWN=0,
+  BUTTON_HELD_LONG,
+  BUTTON_HELD_VERY_LONG,
+  BUTTON_SHORT_PRESS,
+  BUTTON_LONG_PRESS,
+  BUTTON_VERY_LONG_PRESS
+};
+
+struct button_event
+{
+  hal_button button;
+  button_events kind;
+  uint32_t length_ms; // Held so far, or the whole press on release
+};
+
+class button_engine
+{
+  public:
+    button_engine(altanx_hal & hal);
+
+    void poll(); // From loop(), drains the HAL's edges and checks held times
+    bool next(button_event & event); // Oldest first, false when there are none
+    bool any_down();
+
+    altanx_hal & hal;
+
+    uint32_t bounces=0;
+    uint32_t dropped_events=0;
+
+    trace_recorder * trace=NULL; // Gets the raw edges if set
+
+  private:
+    struct button_track
+    {
+      bool down;
+      int64_t down_us;
+      int64_t last_edge_us;
+      uint8_t held_sent; // How many HELD events this press has had, 0..2
+    };
+    button_track buttons[HAL_BUTTON_COUNT];
+
+    button_event events[BUTTON_EVENT_QUEUE];
+    uint8_t event_head=0;
+    uint8_t event_tail=0;
+
+    void push(hal_button button,button_events kind,uint32_t length_ms);
+    void change(hal_button button,bool down,int64_t at_us);
+};
+
+#endif
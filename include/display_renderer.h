@@ -0,0 +1,97 @@
+// (c) Ed French 2021
+
+/*
+          Status screen renderer
+          ======================
+
+  Retained mode: the screen is a fixed set of text lines, and each frame
+  only the lines whose fields changed since the last frame (main_state
+  against old_state, plus the radio and buzz flags) are pushed. Each line
+  is drawn off-screen first (a TFT_eSprite on the T-Display) so a redraw
+  is one SPI burst with no black flash.
+
+  invalidate() after anything else has drawn on the screen and the next
+  frame clears it and draws every line.
+
+  Messages (toast()) go in a small queue and never hold anything up: the
+  one at the front covers the whole screen from the next frame until its
+  time is up, then the next one, then the status lines come back. The
+  loop has to come round to take a message down, ms_until_change() says
+  when.
+
+*/
+
+#ifndef ALTANX_DISPLAY_RENDERER_H
+#define ALTANX_DISPLAY_RENDERER_H
+
+#include <stdint.h>
+#include "hal.h"
+
+#define DISPLAY_TEXT_SIZE 2
+#define DISPLAY_LINE_HEIGHT (8*DISPLAY_TEXT_SIZE)
+
+#define TOAST_QUEUE 4 // Messages waiting or showing, a full queue drops the oldest waiting
+#define TOAST_LINES 3 // Split on '\n'
+#define TOAST_LINE_CHARS 20 // Longer lines are left off
+
+enum display_lines
+{
+  LINE_ROLE=0,
+  LINE_SYNC,
+  LINE_PAIR_STATE,
+  LINE_PARTNER,
+  LINE_STATE_NAME,
+  LINE_RADIO,
+  LINE_BUZZ,
+  LINE_HINT, // What letting go of the button will do
+  DISPLAY_LINE_COUNT
+};
+
+struct t_sync_state;
+
+struct toast
+{
+  const char * text; // Must stay valid, in practice a literal
+  uint32_t duration_ms;
+};
+
+class display_renderer
+{
+  public:
+    display_renderer(altanx_hal & hal) : hal(hal) {}
+
+    void invalidate() { valid=false; }
+    void set_hint(const char * text) { hint=text; } // Must stay valid, "" for none
+    void set_battery(bool known,uint8_t percent,uint16_t minutes_left,bool charging); // On the role line
+    void toast(uint32_t duration_ms,const char * text); // Returns straight away
+    bool toast_showing() { return toast_count>0; }
+    uint32_t ms_until_change(); // Until the message up now comes down, UINT32_MAX if none
+    // Returns the bytes pushed to the display for this frame
+    uint32_t render(const t_sync_state & state,const t_sync_state & old_state,bool radio_on,bool buzzing,bool force);
+
+    altanx_hal & hal;
+
+    uint32_t last_frame_bytes=0;
+    uint32_t total_bytes=0;
+    uint32_t frames=0; // Frames that pushed anything
+
+  private:
+    bool valid=false;
+    bool drawn_radio_on=false;
+    bool drawn_buzzing=false;
+    const char * hint="";
+    const char * drawn_hint="";
+    char battery[12]="";
+    char drawn_battery[12]="";
+
+    struct toast toasts[TOAST_QUEUE];
+    uint8_t toast_first=0;
+    uint8_t toast_count=0;
+    bool toast_drawn=false; // Front one is on the screen
+    uint32_t toast_expires_ms=0;
+
+    uint32_t draw_line(uint8_t line,const char * text);
+    uint32_t draw_toast(const char * text);
+};
+
+#endif
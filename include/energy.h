@@ -0,0 +1,100 @@
+// (c) Ed French 2021
+
+/*
+          Energy accounting
+          =================
+
+  Where the battery goes. Each subsystem has a level, 0 for off up to 255
+  for flat out, and the meter adds up level x time for each:
+
+      cpu        awake rather than light sleeping in a wait
+      radio      between esp_now_startup() and switch_off_wifi()
+      motor      running, at the waveform's mean duty over the buzz period
+      backlight  from display_init() to shutdown
+      base       always, the regulator and whatever the board leaks
+
+  Charge is that times the subsystem's current at full level, the
+  ENERGY_*_UA figures below, which can be set from the build flags once
+  someone has measured a board. Only the loop calls set(), so there's no
+  locking.
+
+  Sending 'e' over serial prints the breakdown and puts a summary on the
+  screen. From the average current so far it says how long a full battery
+  (ENERGY_BATTERY_MAH) and what's left of this one would last, to set
+  against the 150 minute treatment target. The screen only has room for
+  what's left. The simulator prints the same estimate for a treatment
+  run, see src/native.
+
+*/
+
+#ifndef ALTANX_ENERGY_H
+#define ALTANX_ENERGY_H
+
+#include <stdint.h>
+#include "hal.h"
+
+#ifndef ENERGY_BASE_UA
+#define ENERGY_BASE_UA 5000 // Regulator, USB serial chip, display controller, light sleeping CPU
+#endif
+#ifndef ENERGY_CPU_UA
+#define ENERGY_CPU_UA 30000 // 80 MHz
+#endif
+#ifndef ENERGY_RADIO_UA
+#define ENERGY_RADIO_UA 80000
+#endif
+#ifndef ENERGY_MOTOR_UA
+#define ENERGY_MOTOR_UA 120000 // At full duty
+#endif
+#ifndef ENERGY_BACKLIGHT_UA
+#define ENERGY_BACKLIGHT_UA 40000
+#endif
+#ifndef ENERGY_BATTERY_MAH
+#define ENERGY_BATTERY_MAH 270
+#endif
+
+#define ENERGY_TARGET_MINUTES 150 // Treatment time per charge we're working towards
+#define ENERGY_FULL 255
+#define ENERGY_SUMMARY_CHARS 96
+
+enum energy_subsystems
+{
+  ENERGY_BASE=0,
+  ENERGY_CPU,
+  ENERGY_RADIO,
+  ENERGY_MOTOR,
+  ENERGY_BACKLIGHT,
+  ENERGY_SUBSYSTEM_COUNT
+};
+
+class energy_meter
+{
+  public:
+    energy_meter(altanx_hal & hal) : hal(hal) {}
+
+    void begin(); // Starts counting, everything but the cpu off
+    void set(energy_subsystems subsystem,uint8_t level);
+
+    uint32_t used_uah(energy_subsystems subsystem); // Since boot
+    uint32_t used_uah();
+    uint32_t on_permille(energy_subsystems subsystem); // Of the time since boot, at full level
+    uint32_t average_ua();
+    uint32_t minutes_from(uint32_t mah); // At the average current so far
+
+    void report(uint8_t battery_percent); // Over the log output
+    const char * summary(uint8_t battery_percent); // For a toast, valid until the next call
+
+    altanx_hal & hal;
+
+  private:
+    uint8_t levels[ENERGY_SUBSYSTEM_COUNT]={0};
+    uint64_t level_us[ENERGY_SUBSYSTEM_COUNT]={0}; // Level x time, so 255 per us at full
+    int64_t since_us[ENERGY_SUBSYSTEM_COUNT]={0};
+    int64_t started_us=0;
+    char summary_text[ENERGY_SUMMARY_CHARS];
+
+    void catch_up(int64_t now);
+};
+
+const char * energy_subsystem_name(energy_subsystems subsystem);
+
+#endif
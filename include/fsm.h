@@ -0,0 +1,97 @@
+// (c) Ed French 2021
+
+/*
+          Transition tables
+          =================
+
+  The pairing states (altanx.h) are driven from a table with one entry
+  for every state and event, in order, so finding the entry for the state
+  we're in and the event that's come is an index:
+
+      entry i    state i/events, event i%events
+
+  Each entry says which state to go to, the same one for an event that
+  doesn't move it, what to log against the change, and what the leader
+  and the follower do about it, either of which can be NULL. The state
+  changes before the action runs, so an action sees where it's going.
+  Actions that find the handshake done raise the next event rather than
+  change state themselves.
+
+  Checked when it compiles:
+
+      fsm_complete()    every state has an entry for every event, in order
+      fsm_reachable()   the states the table can get to from a mask of
+                        starting ones
+      fsm_dead_ends()   states no event ever leaves
+
+  Each entry keeps how often it ran and how long its action took in an
+  fsm_timing, 'f' on serial prints them.
+
+*/
+
+#ifndef ALTANX_FSM_H
+#define ALTANX_FSM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+template<class T>
+struct fsm_transition
+{
+  uint8_t from;
+  uint8_t event;
+  uint8_t to;
+  void (T::*leader)();
+  void (T::*follower)();
+  const char * marker; // Logged with a change of state
+};
+
+template<class T>
+constexpr bool fsm_in_order(const fsm_transition<T> * table,size_t count,size_t states,size_t events,size_t i=0)
+{
+  return i>=count || (table[i].from==i/events && table[i].event==i%events && table[i].to<states && \
+                      fsm_in_order(table,count,states,events,i+1));
+}
+
+template<class T>
+constexpr bool fsm_complete(const fsm_transition<T> * table,size_t count,size_t states,size_t events)
+{
+  return count==states*events && fsm_in_order(table,count,states,events);
+}
+
+// States one event on from any in mask, and mask itself
+template<class T>
+constexpr uint32_t fsm_step(const fsm_transition<T> * table,size_t count,uint32_t mask,size_t i=0)
+{
+  return i>=count?mask: \
+         fsm_step(table,count,((mask>>table[i].from)&1)?mask|(1UL<<table[i].to):mask,i+1);
+}
+
+template<class T>
+constexpr uint32_t fsm_reachable(const fsm_transition<T> * table,size_t count,uint32_t mask,size_t states)
+{
+  return states?fsm_reachable(table,count,fsm_step(table,count,mask),states-1):mask;
+}
+
+template<class T>
+constexpr bool fsm_leaves(const fsm_transition<T> * table,size_t count,size_t state,size_t i=0)
+{
+  return i<count && ((table[i].from==state && table[i].to!=state) || fsm_leaves(table,count,state,i+1));
+}
+
+template<class T>
+constexpr uint32_t fsm_dead_ends(const fsm_transition<T> * table,size_t count,size_t states)
+{
+  return states?fsm_dead_ends(table,count,states-1)|(fsm_leaves(table,count,states-1)?0:1UL<<(states-1)):0;
+}
+
+struct fsm_timing
+{
+  uint32_t count;
+  uint32_t total_us;
+  uint32_t max_us;
+
+  void record(int64_t us);
+};
+
+#endif
@@ -0,0 +1,73 @@
+// (c) Ed French 2021
+
+/*
+          Groups
+          ======
+
+  One leader can pair with up to GROUP_MAX_FOLLOWERS followers. The
+  leader keeps them in a peer table, in the order they paired, and that
+  order is their phase slot: the leader has slot 0 and follower i has
+  slot i+1. The buzz period is cut into one window per slot, each ending
+  BUZZ_GAP_MS early so neighbours never overlap, which for a pair is the
+  original 0-900 ms leader and 1000-1900 ms follower.
+
+  Only the leader's table is saved (state_store.h). A follower is told its
+  slot and the size of the group in every time reply, so it always has
+  them before it buzzes.
+
+  Pairing: once the first follower answers, the leader keeps asking for
+  GROUP_PAIR_WINDOW_MS more so the others can join, or stops as soon as
+  it has GROUP_FOLLOWERS of them. For a pair nothing waits.
+
+  Syncing: every follower asks for the time as before, but the leader
+  answers everyone who asked in a round with one group reply (see
+  wire_protocol.h), sent once the round's followers have all asked or
+  GROUP_ROUND_MS after the first one did. The leader sends the same
+  number of frames whether it has one follower or three, and the
+  followers that asked together get their answers together. A pair still
+  uses the plain time reply so a pair with older firmware works.
+
+  Resync windows all sit on one grid, RESYNC_MIN_INTERVAL_MS apart from
+  the leader's epoch. In a group each follower also rounds its gap down to
+  a power of two steps and picks the next window on a multiple of it, so a
+  follower with a long gap always comes back in a window one with a
+  shorter gap is using, and the leader answers them in the same rounds.
+
+*/
+
+#ifndef ALTANX_GROUP_H
+#define ALTANX_GROUP_H
+
+#include <stdint.h>
+
+#define GROUP_MAX_FOLLOWERS 3 // A group reply for them all has to fit an rx_frame
+#ifndef GROUP_FOLLOWERS
+#define GROUP_FOLLOWERS 1 // Leader stops pairing once this many have answered
+#endif
+#define GROUP_PAIR_WINDOW_MS 5000 // Or once it's been this long since the first
+#define GROUP_ROUND_MS 30 // Longest the first time request of a round waits for the rest. More than a
+                          // loop pass, followers start asking on whichever pass they wake on
+
+#define BUZZ_GAP_MS 100 // Between one slot's buzz and the next
+
+// The leader's followers, what it saves
+struct peer_table
+{
+  uint8_t count;
+  uint8_t macs[GROUP_MAX_FOLLOWERS][6]; // Follower i buzzes in slot i+1
+
+  void clear();
+  int8_t find(const uint8_t * mac); // Index, -1 if not in the table
+  int8_t add(const uint8_t * mac); // Index, already there or new. -1 if full
+  uint8_t slots() { return count+1; }
+};
+
+// Where slot's buzz window falls in the buzz period, from its start
+void buzz_window(uint8_t slot,uint8_t slots,int64_t & start_us,int64_t & end_us);
+
+// First point on the leader's resync grid at or after leader_us
+int64_t resync_grid_after(int64_t leader_us,int64_t epoch_us);
+// A group follower's next window after window_us for a gap of up to interval_us
+int64_t group_resync_after(int64_t window_us,int64_t interval_us,int64_t epoch_us);
+
+#endif
@@ -0,0 +1,198 @@
+// (c) Ed French 2021
+
+/*
+          Hardware abstraction layer
+          ==========================
+
+  Everything the state engine needs from the outside world goes through
+  altanx_hal. The firmware uses esp32_hal (src/esp32), the host build uses
+  sim_hal (src/native) which runs against a virtual clock and a simulated
+  radio so whole pair/sync/treatment sessions can be run on a PC.
+
+  Keep this thin: if a call only makes sense on one board it belongs in
+  that board's HAL, not here.
+
+*/
+
+#ifndef ALTANX_HAL_H
+#define ALTANX_HAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "log_ring.h"
+
+// Screen size after rotation, both boards are used landscape
+#define DISPLAY_WIDTH 240
+#define DISPLAY_HEIGHT 135
+
+enum hal_button
+{
+  BUTTON_FRONT=0,
+  BUTTON_SIDE=1,
+  HAL_BUTTON_COUNT
+};
+
+// One raw button edge, timestamped (micros()) in the GPIO interrupt.
+// Includes any contact bounce, button_engine sorts that out
+struct hal_button_edge
+{
+  hal_button button;
+  bool pressed;
+  int64_t at_us;
+};
+
+// Why this boot, see wake_cause()
+enum hal_wakes
+{
+  WAKE_POWER_ON=0, // Or a reset, or a deep sleep with no ULP
+  WAKE_BUTTON=1, // Out of a ULP sleep
+  WAKE_TIMER=2 // Likewise, or the ULP ran out of windows
+};
+
+struct ulp_schedule;
+
+// One-shot timers, each owned by one subsystem
+enum hal_timer
+{
+  TIMER_MOTOR=0,
+  HAL_TIMER_COUNT
+};
+
+// Timer callbacks run on the device in a task of their own, at the top
+// priority on the core the loop, the radio and the display aren't on, so
+// they carry on whatever those are doing. One at a time, never two at
+// once. Keep them short and don't touch the display
+class timer_listener
+{
+  public:
+    virtual ~timer_listener() {}
+    virtual void on_timer(hal_timer timer)=0;
+};
+
+// Implemented by whoever wants to hear from the radio (the state engine).
+// On the ESP32 these are called from the WiFi task, not from loop()
+class radio_listener
+{
+  public:
+    virtual ~radio_listener() {}
+    virtual void on_recv(const uint8_t * mac_addr,const uint8_t * data,int len,int8_t rssi)=0; // rssi in dBm, 0 if not known
+    virtual void on_sent(const uint8_t * mac_addr,bool success)=0;
+};
+
+class altanx_hal
+{
+  public:
+    virtual ~altanx_hal() {}
+
+    bool log_enabled=true;
+
+    // Time
+    virtual uint32_t millis()=0;
+    virtual int64_t micros()=0; // esp_timer_get_time() on the device
+    virtual void delay_ms(uint32_t ms)=0; // Must let other tasks run
+    // For timing code only (bench.h), never for deciding anything. Wraps
+    virtual uint32_t cpu_cycles()=0;
+    virtual uint32_t cpu_mhz()=0; // What cpu_cycles() counts at just now
+    // Sleep until something happens or timeout_ms passes. Radio callbacks,
+    // timer callbacks and button edges all end the wait early. The device
+    // light sleeps in here when nothing else needs the CPU
+    virtual void wait_event(uint32_t timeout_ms)=0;
+
+    // Fire listener->on_timer() once at at_us (micros() time). Re-arming
+    // replaces any pending expiry
+    virtual void timer_arm(hal_timer timer,int64_t at_us,timer_listener * listener)=0;
+    virtual void timer_cancel(hal_timer timer)=0;
+    // listener->on_timer() as soon as it can, where the timers run. Any
+    // expiry stays armed, so on_timer() has to work out which it was
+    virtual void timer_post(hal_timer timer,timer_listener * listener)=0;
+
+    // Outputs
+    virtual void motor_write(uint8_t duty)=0; // 0 is off
+    // From the current duty to duty over ramp_ms, in hardware. Returns at
+    // once, a motor_write() or another fade takes over from it
+    virtual void motor_fade(uint8_t duty,uint32_t ramp_ms)=0;
+    virtual void led_write(bool level)=0;
+
+    // Inputs
+    virtual bool button_pressed(hal_button button)=0;
+    virtual bool button_next_edge(hal_button_edge & edge)=0; // Oldest first, false when there are none
+
+    // Radio (ESP-NOW)
+    virtual void radio_set_listener(radio_listener * listener)=0;
+    virtual bool radio_start()=0;
+    virtual void radio_stop()=0;
+    virtual bool radio_add_peer(const uint8_t * mac_addr)=0;
+    virtual bool radio_send(const uint8_t * mac_addr,const uint8_t * data,size_t len)=0;
+    // In quarter dBm, see link_quality.h. radio_start() goes back to full
+    virtual void radio_set_tx_power(uint8_t quarter_dbm)=0;
+
+    virtual uint32_t random32()=0; // Hardware RNG on the device
+
+    // Persistent storage
+    virtual bool store_has(const char * key)=0;
+    virtual size_t store_read(const char * key,void * buffer,size_t len)=0;
+    virtual void store_write(const char * key,const void * buffer,size_t len)=0;
+    // RTC memory, kept through deep sleep but lost at power off or a reset.
+    // rtc_read() gives 0 when nothing was left there before a sleep
+    virtual size_t rtc_read(void * buffer,size_t len)=0;
+    virtual void rtc_write(const void * buffer,size_t len)=0;
+
+    // Display (text size 1 is 6x8 pixels per character)
+    virtual void display_init()=0;
+    virtual void display_fill(uint16_t colour)=0;
+    virtual void display_rect(int16_t x,int16_t y,int16_t w,int16_t h,uint16_t colour)=0;
+    virtual void display_text(int16_t x,int16_t y,uint8_t size,uint16_t colour,const char * text)=0;
+    // Replace a full width band with one line of text, drawn off-screen and
+    // pushed in one go. Returns the bytes sent to the panel
+    virtual uint32_t display_line(int16_t y,int16_t h,uint8_t size,uint16_t colour,uint16_t background,const char * text)=0;
+    virtual void display_sleep()=0;
+
+    // Power
+    virtual void deep_sleep()=0; // Does not return on the device
+    // Deep sleep with the ULP playing the schedule on the motor pin, see
+    // ulp_stim.h, until wake_us or a button. False, with nothing changed,
+    // if the board can't. Otherwise it stops the timers, sleeps the display
+    // and doesn't return on the device: the boot after has micros()
+    // carrying on from here, and the ULP keeps the pin until the first
+    // motor_write() or motor_fade()
+    virtual bool ulp_sleep(const ulp_schedule & schedule)=0;
+    virtual bool ulp_available()=0; // Whether it's worth asking, for begin()
+    virtual hal_wakes wake_cause()=0;
+    virtual uint32_t battery_mv()=0; // Averaged over a few reads, 0 if the board can't measure it
+
+    // Logging, see log_ring.h. Use the LOG_* macros rather than log()
+    virtual void log_write(int64_t at_us,const char * text)=0; // One formatted record
+    virtual int serial_read()=0; // Next character typed, -1 if none
+
+    log_ring log_records;
+    uint32_t log_dropped_reported=0;
+
+    template<typename... T> void log(uint8_t level,const char * format,T... args)
+    {
+      if (!log_enabled) return;
+      int64_t packed[]={0,log_arg(args)...}; // Leading 0 so there's always an element
+      log_records.push(micros(),level,format,packed+1,sizeof...(T));
+    }
+
+    // Formats and writes out everything queued. Only ever from one task
+    void log_drain()
+    {
+      log_record record;
+      char line[LOG_LINE_CHARS];
+      while (log_records.pop(record))
+      {
+        log_format(record,line,sizeof(line));
+        log_write(record.at_us,line);
+      }
+      uint32_t dropped=log_records.dropped.load(std::memory_order_relaxed);
+      if (dropped!=log_dropped_reported)
+      {
+        snprintf(line,sizeof(line),"(%u log records dropped)\n",(unsigned)(dropped-log_dropped_reported));
+        log_dropped_reported=dropped;
+        log_write(micros(),line);
+      }
+    }
+};
+
+#endif
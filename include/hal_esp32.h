@@ -0,0 +1,98 @@
+// (c) Ed French 2021
+
+// altanx_hal for the ESP32 boards (T-Display, M5StickC)
+//
+// The two cores are split so nothing can hold up a motor edge:
+//
+//   core 0  the WiFi task (23) and esp_timer's (22), as the IDF has them,
+//           then the state engine (main.cpp) with the radio callbacks,
+//           display and buttons, and the log task below everything
+//   core 1  the timer task, timer_listener callbacks only, at the top
+//
+// An esp_timer expiry only notifies the timer task, so all the motor
+// work is done on core 1. Where the IDF can dispatch from the timer
+// interrupt it does, otherwise it's from esp_timer's task on core 0,
+// which the WiFi task can hold up. Arduino-ESP32's IDF can't.
+//
+// Built with ENABLE_HW_TIMER_EDGES a motor edge is a hardware timer's
+// interrupt on core 1 instead. Waits longer than ESP32_TIMER_LEAD_US
+// start on an esp_timer, as only that survives light sleep, so an edge
+// is only late if the WiFi task holds that up for longer than the lead.
+// It's off until motor_edge_late (bench.h) has been compared on a board,
+// under WiFi and with light sleep, against the esp_timer build.
+//
+// The loop and the timers only meet through lock-free rings (rx_queue.h,
+// motor_scheduler.h, log_ring.h) and task notifications.
+
+#ifndef ALTANX_HAL_ESP32_H
+#define ALTANX_HAL_ESP32_H
+
+#include "hal.h"
+
+#define ESP32_PROTOCOL_CORE 0
+#define ESP32_PROTOCOL_PRIORITY 1 // As Arduino's loop()
+#define ESP32_PROTOCOL_STACK 8192 // As Arduino's loop()
+#define ESP32_TIMER_CORE 1
+#define ESP32_TIMER_PRIORITY 24 // configMAX_PRIORITIES-1
+#define ESP32_TIMER_STACK 3072
+// ENABLE_HW_TIMER_EDGES only
+#define ESP32_TIMER_FIRST 0 // Hardware timers from here, one per hal_timer
+#define ESP32_TIMER_DIVIDER 80 // Off the 80 MHz APB clock, us
+#define ESP32_TIMER_LEAD_US 5000 // Light sleep wake and the WiFi task's worst, before an edge
+#define ESP32_TIMER_POSTED 8 // Timer task notification bits from here: timer_post()
+#define ESP32_TIMER_NEAR 16 // And from here: a long wait's esp_timer is up
+
+class esp32_hal : public altanx_hal
+{
+  public:
+    void begin(); // Pins, PWM, serial and preferences
+
+    uint32_t millis();
+    int64_t micros();
+    uint32_t cpu_cycles();
+    uint32_t cpu_mhz();
+    void delay_ms(uint32_t ms);
+    void wait_event(uint32_t timeout_ms);
+    void timer_arm(hal_timer timer,int64_t at_us,timer_listener * listener);
+    void timer_cancel(hal_timer timer);
+    void timer_post(hal_timer timer,timer_listener * listener);
+
+    void motor_write(uint8_t duty);
+    void motor_fade(uint8_t duty,uint32_t ramp_ms);
+    void led_write(bool level);
+
+    bool button_pressed(hal_button button);
+    bool button_next_edge(hal_button_edge & edge);
+
+    void radio_set_listener(radio_listener * listener);
+    bool radio_start();
+    void radio_stop();
+    bool radio_add_peer(const uint8_t * mac_addr);
+    bool radio_send(const uint8_t * mac_addr,const uint8_t * data,size_t len);
+    void radio_set_tx_power(uint8_t quarter_dbm);
+    uint32_t random32();
+
+    bool store_has(const char * key);
+    size_t store_read(const char * key,void * buffer,size_t len);
+    void store_write(const char * key,const void * buffer,size_t len);
+    size_t rtc_read(void * buffer,size_t len);
+    void rtc_write(const void * buffer,size_t len);
+
+    void display_init();
+    void display_fill(uint16_t colour);
+    void display_rect(int16_t x,int16_t y,int16_t w,int16_t h,uint16_t colour);
+    void display_text(int16_t x,int16_t y,uint8_t size,uint16_t colour,const char * text);
+    uint32_t display_line(int16_t y,int16_t h,uint8_t size,uint16_t colour,uint16_t background,const char * text);
+    void display_sleep();
+
+    void deep_sleep();
+    bool ulp_sleep(const ulp_schedule & schedule); // Needs ENABLE_ULP_STIM
+    bool ulp_available();
+    hal_wakes wake_cause();
+    uint32_t battery_mv();
+
+    void log_write(int64_t at_us,const char * text);
+    int serial_read();
+};
+
+#endif
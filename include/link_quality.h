@@ -0,0 +1,143 @@
+// (c) Ed French 2021
+
+/*
+          Link quality
+          ============
+
+  How well the radio is getting through to each peer, and a loop that
+  keeps the transmit power as low as still gets through. The devices sit
+  on wrists under a metre apart, so full power is wasted on nearly every
+  frame. For each peer, broadcast included, since boot:
+
+      sent, delivered   frames the radio took, and the ones acked. A
+                        broadcast is never acked so it only counts sent
+      rssi              mean, min and max of the frames from it, in dBm,
+                        where the radio says (rx_frame)
+      latency           radio_send() to its send callback, a histogram in
+                        powers of 2 up from LINK_LATENCY_FIRST_US
+
+  The power is in the radio's quarter dBm, from LINK_POWER_MAX down to
+  LINK_POWER_MIN:
+
+      down   a LINK_POWER_STEP after LINK_DOWN_AFTER unicasts in a row are
+             acked, unless the last frame from that peer came in under
+             LINK_RSSI_FLOOR_DBM. It runs the same loop, so a weak frame in
+             says ours are going out weak too
+      up     LINK_UP_STEPS at once for a unicast that isn't acked by a
+             peer heard from in the last LINK_SILENT_MS. The radio has
+             already retried it, so it's been lost several times over. The
+             level it failed at is a floor for LINK_FLOOR_HOLD_MS so it
+             doesn't go straight back down to it. A peer we've not heard
+             from is more likely off or asleep than out of reach
+      up     a step every LINK_SILENT_MS the radio's sending and hearing
+             nothing at all, as broadcasts don't say if they got there
+
+  It starts at full power, so the first pairing or sync after boot does
+  too. The radio goes back to full power each time it starts, the caller
+  puts power back after radio_start().
+
+  Send results come in on the WiFi task: delivered() only queues them on
+  a ring with one writer and one reader, as rx_queue does, and poll()
+  takes them in the loop. Everything else is the loop's.
+
+  'l' on serial prints a LINK line for each peer, then the power.
+
+*/
+
+#ifndef ALTANX_LINK_QUALITY_H
+#define ALTANX_LINK_QUALITY_H
+
+#include <stdint.h>
+#include <atomic>
+#include "hal.h"
+#include "group.h"
+
+#define LINK_POWER_MAX 84 // 21 dBm, the top of esp_wifi_set_max_tx_power()
+#define LINK_POWER_MIN 8 // 2 dBm, the bottom
+#define LINK_POWER_STEP 8 // 2 dB
+#define LINK_UP_STEPS 3
+#define LINK_DOWN_AFTER 8
+#define LINK_FLOOR_HOLD_MS 60000
+#define LINK_SILENT_MS 2000
+#define LINK_RSSI_FLOOR_DBM -80 // Still 10 dB or more above where frames start going missing
+
+#define LINK_PEERS (GROUP_MAX_FOLLOWERS+1) // A leader's followers and broadcast
+#define LINK_LATENCY_FIRST_US 256
+#define LINK_LATENCY_BUCKETS 8 // Under 256 us, under 512 us ... 16 ms and over
+#define LINK_RESULTS 8 // Power of 2
+#define LINK_IN_FLIGHT 8 // Sends waiting for their callback
+
+struct link_peer
+{
+  uint8_t mac[6];
+  uint32_t sent;
+  uint32_t delivered;
+  uint32_t failed;
+  uint32_t heard_ms; // 0 before the first frame from it
+  int8_t rssi_last; // 0 before the first
+  int8_t rssi_min;
+  int8_t rssi_max;
+  int32_t rssi_total;
+  uint32_t rssi_count;
+  uint32_t latency[LINK_LATENCY_BUCKETS];
+};
+
+class link_quality
+{
+  public:
+    link_quality(altanx_hal & hal) : hal(hal) {}
+
+    // Loop only
+    void sending(const uint8_t * mac_addr); // The radio took a frame for it
+    void heard(const uint8_t * mac_addr,int8_t rssi); // rssi 0 if not known
+    void radio_started(); // Any callbacks still owed went with the radio
+    bool poll(); // Takes the send results, true if the power changed
+    void report();
+
+    // WiFi task only
+    void delivered(const uint8_t * mac_addr,bool success);
+
+    altanx_hal & hal;
+
+    uint8_t power=LINK_POWER_MAX;
+    uint32_t raised=0;
+    uint32_t lowered=0;
+    uint32_t untracked=0; // Frames for peers past LINK_PEERS
+    uint32_t unmatched=0; // Send results with no send waiting for them
+
+  private:
+    struct result
+    {
+      uint8_t mac[6];
+      bool success;
+      int64_t at_us;
+    };
+    result results[LINK_RESULTS];
+    std::atomic<uint32_t> head{0}; // Next slot to write, delivered() only
+    std::atomic<uint32_t> tail{0}; // Next slot to read, poll() only
+    std::atomic<uint32_t> lost_results{0}; // Ring was full
+
+    link_peer peers[LINK_PEERS]={};
+    uint8_t peer_count=0;
+
+    struct send
+    {
+      uint8_t mac[6];
+      int64_t at_us;
+    };
+    send in_flight[LINK_IN_FLIGHT];
+    uint8_t in_flight_first=0;
+    uint8_t in_flight_count=0;
+
+    uint8_t run=0; // Unicasts acked in a row at this power
+    uint8_t floor=LINK_POWER_MIN; // Lowest it may go, for now
+    uint32_t floor_set_ms=0;
+    uint32_t last_heard_ms=0;
+    uint32_t last_sent_ms=0;
+
+    link_peer * peer(const uint8_t * mac_addr);
+    void take(const result & sent);
+    void raise(uint8_t steps);
+};
+
+#endif
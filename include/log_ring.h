@@ -0,0 +1,104 @@
+// (c) Ed French 2021
+
+/*
+          Deferred logging
+          ================
+
+  Formatting and printing a log line at 115200 baud costs far more than
+  whatever is being logged, and it used to happen in the middle of the
+  time exchange. So a log call only copies a binary record into a RAM ring:
+
+      at_us    micros() when it was logged
+      level    LOG_LEVEL_*
+      format   the printf format, a literal, which doubles as the event ID
+      args     up to LOG_MAX_ARGS values, each widened to 64 bits
+
+  and the text is made later by log_drain() (altanx_hal), from a task that
+  only runs once everything else is waiting. Any number of tasks can log
+  (the loop, the WiFi callbacks), one drains. A full ring drops the new
+  record and counts it.
+
+  Because the args are only looked at later, a %s must point at something
+  that stays put: a literal or a static table, never a local buffer.
+  Formats use the ordinary printf conversions. Any length modifier is
+  ignored as every integer is carried as 64 bits.
+
+  Levels below LOG_LEVEL are removed at compile time, the LOG_* macros
+  don't even evaluate their arguments. They use the hal of whatever class
+  they're in, which is always called hal.
+
+*/
+
+#ifndef ALTANX_LOG_RING_H
+#define ALTANX_LOG_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+
+#define LOG_LEVEL_TRACE 0 // Every loop
+#define LOG_LEVEL_DEBUG 1 // Every frame, every redraw
+#define LOG_LEVEL_INFO 2  // State changes
+#define LOG_LEVEL_WARN 3  // Something went wrong and was dealt with
+#define LOG_LEVEL_ERROR 4
+#define LOG_LEVEL_NONE 5
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_RING_SLOTS 64 // Power of 2
+#define LOG_MAX_ARGS 8
+#define LOG_LINE_CHARS 256
+
+#define LOG_AT(level,...) do { if ((level)>=LOG_LEVEL) hal.log(level,__VA_ARGS__); } while (0)
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE,__VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG,__VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO,__VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN,__VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR,__VA_ARGS__)
+
+struct log_record
+{
+  int64_t at_us;
+  const char * format;
+  uint8_t level;
+  uint8_t argc;
+  int64_t args[LOG_MAX_ARGS];
+};
+
+// Everything is carried as 64 bits, doubles bit for bit
+inline int64_t log_arg(double value) { int64_t bits; memcpy(&bits,&value,sizeof(bits)); return bits; }
+inline int64_t log_arg(float value) { return log_arg((double)value); }
+inline int64_t log_arg(const char * value) { return (int64_t)(intptr_t)value; }
+template<typename T> inline int64_t log_arg(T value) { return (int64_t)value; }
+
+class log_ring
+{
+  public:
+    log_ring();
+
+    // Any task. Never blocks, false if the ring was full
+    bool push(int64_t at_us,uint8_t level,const char * format,const int64_t * args,uint8_t argc);
+    // One task only
+    bool pop(log_record & record);
+    bool empty(); // Any task, but only a hint outside the one that pops
+
+    std::atomic<uint32_t> dropped;
+
+  private:
+    struct slot
+    {
+      std::atomic<uint32_t> sequence; // Whose turn it is, see log_ring.cpp
+      log_record record;
+    };
+    slot slots[LOG_RING_SLOTS];
+    std::atomic<uint32_t> head; // Next to write
+    std::atomic<uint32_t> tail; // Next to read
+};
+
+// The record as text, at most size-1 characters. Returns the length
+size_t log_format(const log_record & record,char * out,size_t size);
+
+#endif
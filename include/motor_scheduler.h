@@ -0,0 +1,101 @@
+// (c) Ed French 2021
+
+/*
+          Motor scheduler
+          ===============
+
+  Switches the motor on and off at the exact edges of this device's buzz
+  window (its slot, see group.h) from a one-shot hardware timer,
+  so the buzz timing doesn't depend on how long loop() takes. Inside the
+  window it plays a waveform (waveform.h): the timer fires once per step,
+  and the hardware fades between steps.
+
+  Each time the timer fires it applies the edge it was armed for and arms
+  the next one, working from the scheduled edge time rather than when the
+  callback actually ran so lateness never builds up.
+
+  start() and stop() come from the loop and the edges from the timer,
+  which on the device runs in a task of its own on the other core (see
+  hal.h). So the loop never touches what the timer works from: it queues
+  what it wants on a ring with one writer and one reader, as rx_queue
+  does, and posts the timer, which takes the newest and carries on from
+  there. Only the timer arms or cancels it, and only it drives the motor.
+
+      running, epoch_us, slot, slots, mean_duty   what the loop last asked
+                                                  for, loop only
+      on, edges, late_edges, edge_late            written by the timer
+
+*/
+
+#ifndef ALTANX_MOTOR_SCHEDULER_H
+#define ALTANX_MOTOR_SCHEDULER_H
+
+#include <stdint.h>
+#include <atomic>
+#include "hal.h"
+#include "waveform.h"
+#include "bench.h"
+
+#define MOTOR_COMMANDS 4 // Power of 2, a full ring and the loop asks again next pass
+
+// Pure timing sums, no hardware. Times are in us on the same clock as epoch_us
+bool motor_window_on(int64_t t_us,int64_t epoch_us,int64_t start_us,int64_t end_us,int64_t period_us);
+int64_t motor_next_edge(int64_t t_us,int64_t epoch_us,int64_t start_us,int64_t end_us,int64_t period_us);
+// As motor_next_edge() but stopping at each step of the waveform too
+int64_t motor_next_step(int64_t t_us,int64_t epoch_us,int64_t start_us,int64_t end_us,int64_t period_us,const waveform & wave);
+
+class trace_recorder;
+
+// A schedule, from the loop to the timer
+struct motor_command
+{
+  bool run; // false to stop
+  int64_t epoch_us;
+  int64_t window_start_us;
+  int64_t window_end_us;
+  const waveform * wave;
+};
+
+class motor_scheduler : public timer_listener
+{
+  public:
+    motor_scheduler(altanx_hal & hal) : hal(hal),edge_late("motor_edge_late","us") {}
+
+    void start(int64_t epoch_us,uint8_t slot,uint8_t slots,waveform_ids wave);
+    void stop();
+
+    void on_timer(hal_timer timer);
+
+    altanx_hal & hal;
+
+    bool running=false;
+    int64_t epoch_us=0;
+    uint8_t slot=0;
+    uint8_t slots=0;
+    uint8_t mean_duty=0; // Over the whole buzz period, for the energy meter
+
+    volatile bool on=false; // In the window, the waveform may have the motor off for a moment
+    uint32_t edges=0;
+    uint32_t late_edges=0; // Timer fired after the edge after the one it was armed for
+    bench_stat edge_late; // How long after its edge the timer fired, every edge
+
+    trace_recorder * trace=NULL; // Gets the motor edges if set
+
+  private:
+    motor_command commands[MOTOR_COMMANDS];
+    std::atomic<uint32_t> head{0}; // Next slot to write, loop only
+    std::atomic<uint32_t> tail{0}; // Next slot to read, timer only
+
+    // Timer only from here down
+    motor_command active={false,0,0,0,&waveforms[WAVEFORM_SQUARE]};
+    int64_t next_edge_us=0;
+    uint8_t driven=0; // Last duty written
+
+    bool send(const motor_command & command);
+    bool take();
+    void arm_after(int64_t t_us);
+    void apply(int64_t t_us);
+    void drive(uint8_t duty,uint32_t ramp_ms=0);
+};
+
+#endif
@@ -0,0 +1,71 @@
+// (c) Ed French 2021
+
+/*
+          Rendezvous
+          ==========
+
+  A follower that's pairing or syncing used to keep its receiver on, the
+  biggest draw on the board, until the leader turned up. Now the leader
+  sends its pair and sync requests on a fixed beat, one every
+  RENDEZVOUS_BEACON_MS, and the follower only listens in windows long
+  enough to catch two of them:
+
+      leader     |  |  |  |  |  |  |  |  |  |  |  |  |  |  |  |  |  |
+      follower   ____====_________________====_________________====___
+                     <-- RENDEZVOUS_PERIOD_MS -->
+
+  A window is RENDEZVOUS_LISTEN_MS from when the radio is up, so the
+  start up time isn't taken out of it. Once the leader is heard() the
+  follower listens all the time, as it did before, until the handshake
+  is done.
+
+  The leader's requests can't carry where the next one falls before the
+  follower has heard any of them, so the windows aren't lined up, they're
+  just short and far apart. A follower switched on after its leader has
+  its first window straight away and loses nothing. One switched on first
+  waits up to a period longer than it would have once the leader's there.
+
+  A leader that never beats this fast (older firmware backs off to
+  400 ms) can slip between windows, so after RENDEZVOUS_FALLBACK_MS
+  without hearing it the follower goes back to listening all the time.
+
+*/
+
+#ifndef ALTANX_RENDEZVOUS_H
+#define ALTANX_RENDEZVOUS_H
+
+#include <stdint.h>
+#include "hal.h"
+
+#define RENDEZVOUS_BEACON_MS 20 // Leader's pair and sync requests, so about every loop pass
+#define RENDEZVOUS_BEACON_JITTER_PCT 10 // Either way, see retry.h
+#define RENDEZVOUS_LISTEN_MS 60 // Two beacons with the passes running a little over
+#ifndef RENDEZVOUS_PERIOD_MS
+#define RENDEZVOUS_PERIOD_MS 1000 // From one window's start to the next
+#endif
+#define RENDEZVOUS_FALLBACK_MS 30000 // Then listen all the time, half the leader's deadline
+
+class rendezvous
+{
+  public:
+    rendezvous(altanx_hal & hal) : hal(hal) {}
+
+    void start(bool radio_up); // Waiting for the leader, the first window opens now
+    bool wanted(); // Whether the radio should be on
+    void opened(); // Radio's come up for a window
+    void heard(); // Leader's there, listen from now on
+
+    altanx_hal & hal;
+
+    bool found=false; // Heard the leader since start()
+    bool fallen_back=false;
+    uint16_t windows=0; // Since start()
+
+  private:
+    uint32_t started_ms=0;
+    uint32_t opened_ms=0;
+    uint32_t next_ms=0;
+    bool window_open=false;
+};
+
+#endif
@@ -0,0 +1,87 @@
+// (c) Ed French 2021
+
+/*
+          Retries
+          =======
+
+  Pairing and syncing are handshakes: one side keeps asking until the
+  other answers, and gives up after a while. They used to count passes of
+  the loop, which take anything from a few ms to seconds, so neither the
+  gaps nor the give up time meant much. retry_timer works in ms:
+
+      start()    the first attempt is due now
+      sent()     one went out, the next is due a gap later. Each gap is
+                 growth_pct of the last, from first_ms up to max_ms, then
+                 moved up to jitter_pct either way so two leaders started
+                 together don't stay in step
+      heard()    something came back, so the other side is there and the
+                 next try goes at the first gap again
+      expired()  deadline_ms since start()
+
+  It only says when, the caller does the sending. The jitter comes from
+  a generator seeded at start(), not random32(), so a replay (see trace.h)
+  doesn't need every draw recorded.
+
+  retry_stats keeps how many attempts and how long each handshake took
+  to succeed, 'r' on serial prints them.
+
+*/
+
+#ifndef ALTANX_RETRY_H
+#define ALTANX_RETRY_H
+
+#include <stdint.h>
+#include "hal.h"
+
+struct retry_policy
+{
+  uint32_t first_ms; // Gap after the first attempt
+  uint32_t max_ms; // Backoff stops growing here
+  uint16_t growth_pct; // Each gap against the last, 200 doubles it
+  uint8_t jitter_pct; // Either way
+  uint32_t deadline_ms; // After start(), 0 for never
+};
+
+class retry_timer
+{
+  public:
+    retry_timer(altanx_hal & hal) : hal(hal) {}
+
+    void start(const retry_policy & policy,uint32_t seed);
+    bool due(); // Time for the next attempt
+    void sent();
+    void heard();
+    bool expired();
+    uint32_t elapsed_ms(); // Since start()
+
+    altanx_hal & hal;
+
+    uint16_t attempts=0; // sent() since start()
+
+  private:
+    retry_policy policy={0,0,100,0,0};
+    uint32_t started_ms=0;
+    uint32_t next_ms=0;
+    uint32_t gap_ms=0;
+    uint32_t jitter_state=1;
+
+    uint32_t jittered(uint32_t ms);
+};
+
+struct retry_stats
+{
+  retry_stats(const char * name) : name(name) {}
+
+  void record(bool success,uint16_t attempts,uint32_t ms);
+  void report(altanx_hal & hal); // One line over the log output
+
+  const char * name;
+  uint32_t succeeded=0;
+  uint32_t failed=0;
+  uint32_t attempts=0; // Over the ones that succeeded
+  uint16_t max_attempts=0;
+  uint16_t last_attempts=0;
+  uint32_t total_ms=0; // Over the ones that succeeded
+};
+
+#endif
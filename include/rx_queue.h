@@ -0,0 +1,60 @@
+// (c) Ed French 2021
+
+/*
+          Radio receive queue
+          ===================
+
+  The ESP-NOW receive callback runs in the WiFi task while the state
+  engine runs in loop(), a task below it on the same core (hal_esp32.h)
+  which it can cut into anywhere, so received frames are handed over
+  through a fixed ring of slots with one writer and one reader:
+
+    push()  receive callback only. Copies the frame and stamps it, no
+            allocation, no logging, never blocks. A full ring drops the
+            new frame and counts it
+    pop()   loop() only
+
+  The head and tail indices are atomics with acquire/release ordering so
+  the reader never sees a slot before its contents.
+
+*/
+
+#ifndef ALTANX_RX_QUEUE_H
+#define ALTANX_RX_QUEUE_H
+
+#include <stdint.h>
+#include <atomic>
+
+#define RX_QUEUE_SLOTS 8 // Power of 2
+#define RX_FRAME_BYTES 64 // Longer frames are cut short and counted
+
+struct rx_frame
+{
+  uint8_t mac_addr[6];
+  uint8_t len; // Bytes kept in data
+  uint8_t data[RX_FRAME_BYTES];
+  int8_t rssi; // dBm, 0 if the radio didn't say
+  int64_t rx_time_us;
+  uint32_t rx_time_ms;
+};
+
+class rx_queue
+{
+  public:
+    bool push(const uint8_t * mac_addr,const uint8_t * data,int len,int8_t rssi,int64_t rx_time_us,uint32_t rx_time_ms);
+    bool pop(rx_frame & frame);
+    bool empty() const;
+
+    // Only push() writes these
+    std::atomic<uint32_t> received{0};
+    std::atomic<uint32_t> dropped{0}; // Ring was full
+    std::atomic<uint32_t> truncated{0}; // Longer than RX_FRAME_BYTES
+    std::atomic<uint32_t> high_water{0}; // Most slots ever in use
+
+  private:
+    rx_frame slots[RX_QUEUE_SLOTS];
+    std::atomic<uint32_t> head{0}; // Next slot to write, push() only
+    std::atomic<uint32_t> tail{0}; // Next slot to read, pop() only
+};
+
+#endif
@@ -0,0 +1,89 @@
+// (c) Ed French 2021
+
+/*
+          Persistent state store
+          ======================
+
+  What survives a power off (pairing state, partner or the leader's peer
+  table, role, buzz and LED settings) as a small versioned record in NVS,
+  not the raw t_sync_state:
+
+      offset  bytes
+         0     2    magic 'A' 'S'
+         2     1    version, STATE_VERSION when written
+         3     1    payload length n
+         4     4    sequence, little endian, one more on every write
+         8     n    payload, see encode_payload() in state_store.cpp
+       8+n     2    CRC-16/CCITT-FALSE of everything before it
+
+  There are two keys, "state_a" and "state_b", and each write goes to the
+  one not holding the newest good record. A brown out in the middle of a
+  write can only spoil the copy being written, and boot falls back to the
+  other. Boot takes the good record with the higher sequence.
+
+  save() leaves flash alone when the payload matches what's already there,
+  so calling it on every transition costs nothing unless something
+  changed. The sequence is a lifetime count of state writes.
+
+  Versioning: as for the wire protocol, a later version may add fields to
+  the end of the payload and older firmware ignores them. A record older
+  than STATE_VERSION_MIN is ignored. The original firmware saved the raw
+  struct under "syststate"; load() takes that if there's nothing newer and
+  the next save() replaces it.
+
+*/
+
+#ifndef ALTANX_STATE_STORE_H
+#define ALTANX_STATE_STORE_H
+
+#include <stdint.h>
+#include "hal.h"
+#include "group.h"
+
+#define STATE_VERSION 2 // 2 adds the rest of the peer table
+#define STATE_VERSION_MIN 1
+#define STATE_PAYLOAD_BYTES (9+6*(GROUP_MAX_FOLLOWERS-1))
+#define STATE_PAYLOAD_MIN_BYTES 8 // Version 1
+#define STATE_MAX_RECORD (8+32+2) // Room for later versions to grow
+
+#define STATE_SLOT_COUNT 2
+#define STATE_LEGACY_KEY "syststate"
+
+struct t_sync_state;
+
+class state_store
+{
+  public:
+    state_store(altanx_hal & hal) : hal(hal) {}
+
+    // Newest good record into the persistent fields of state, the rest are
+    // cleared. False if there's nothing usable, state is untouched then
+    bool load(t_sync_state & state);
+    // False if the record already says this and nothing was written
+    bool save(const t_sync_state & state);
+    // Takes up where the last boot left off without reading flash, given
+    // the newest payload and where it is (wake_cache.h)
+    void resume(const uint8_t * payload,int8_t slot,uint32_t sequence);
+
+    altanx_hal & hal;
+
+    uint32_t sequence=0; // Of the newest record, 0 if none
+    int8_t slot=-1; // Where the newest record is, -1 if none
+    bool migrated=false; // Loaded from the old raw struct
+    uint32_t writes=0; // This boot
+    uint32_t skipped=0; // Saves that matched what was there
+    uint32_t bad_records=0; // Slots that failed their check at load
+
+  private:
+    uint8_t stored[STATE_PAYLOAD_BYTES];
+    bool have_stored=false;
+
+    bool read_slot(int8_t slot,uint8_t * payload,uint32_t & sequence);
+    bool load_legacy(t_sync_state & state);
+};
+
+// The persistent fields of state to and from STATE_PAYLOAD_BYTES
+void state_encode_payload(const t_sync_state & state,uint8_t * payload);
+void state_decode_payload(const uint8_t * payload,t_sync_state & state);
+
+#endif
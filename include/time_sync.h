@@ -0,0 +1,109 @@
+// (c) Ed French 2021
+
+/*
+          Round trip time synchronisation
+          ===============================
+
+  Same idea as NTP. The follower asks, the leader answers, and each exchange
+  gives four timestamps in microseconds:
+
+      t1  follower sends the time request      (follower clock)
+      t2  leader receives it                   (leader clock)
+      t3  leader sends the time reply          (leader clock)
+      t4  follower receives the reply          (follower clock)
+
+      offset = ((t2-t1)+(t3-t4))/2   leader clock minus follower clock
+      delay  = (t4-t1)-(t3-t2)       time actually spent in the air
+
+  The offset is only wrong by half the difference between the two flight
+  times, so taking the median of several exchanges throws away the ones
+  where the radio or the WiFi task held a packet up.
+
+  Crystals are only good to 20ppm or so, which is 24ms over a 20 minute
+  treatment. So once synced the follower opens the radio for a short burst
+  of exchanges now and then, and drift_estimator fits a straight line
+  through the offsets it gets: the slope is the skew between the two
+  crystals and lets the follower correct its phase between bursts. The
+  better the fit predicts the next burst, the longer the gap before the
+  one after (resync_next_interval_us).
+
+  Every gap is a whole number of RESYNC_MIN_INTERVAL_MS, the same step
+  both sides fall back by when a burst goes wrong. If the follower's last
+  sync done is lost the leader can't know which window it went for, but
+  by stepping along the retry grid it is bound to land on it.
+
+*/
+
+#ifndef ALTANX_TIME_SYNC_H
+#define ALTANX_TIME_SYNC_H
+
+#include <stdint.h>
+
+#define SYNC_EXCHANGES 8 // Round trips per sync
+#define SYNC_REPLY_TIMEOUT_MS 100 // Resend the time request after this
+
+#define RESYNC_EXCHANGES 4 // Round trips per resync burst
+#define RESYNC_FIRST_INTERVAL_MS 20000 // Sync to the first resync, before we know the skew
+#define RESYNC_MIN_INTERVAL_MS 10000 // Also the retry after a burst that got nothing
+#define RESYNC_MAX_INTERVAL_MS 300000
+#define RESYNC_ERROR_BUDGET_US 500 // Drift we're prepared to build up between bursts
+#define RESYNC_NOISE_US 50 // Below this a prediction error is just sync noise
+#define RESYNC_GUARD_MS 100 // Leader listens this much either side: radio start up plus clock uncertainty
+#define RESYNC_LISTEN_MS 300 // Follower stops asking this long after the window starts
+#define RESYNC_LINGER_MS 20 // Lets the last frame of a burst get out before the radio stops
+#define DRIFT_POINTS 8 // Bursts the skew is fitted over
+
+struct sync_sample
+{
+  int64_t offset_us;
+  int64_t delay_us;
+};
+
+class time_sync_estimator
+{
+  public:
+    void reset();
+    void add(int64_t t1,int64_t t2,int64_t t3,int64_t t4);
+    bool complete() { return count>=SYNC_EXCHANGES; }
+
+    int64_t median_offset_us();
+    int64_t median_delay_us();
+    int64_t offset_spread_us(); // Max-min offset, a rough confidence figure
+
+    sync_sample samples[SYNC_EXCHANGES];
+    uint8_t count=0;
+};
+
+// Least squares line through (local time, offset) for the last few bursts
+class drift_estimator
+{
+  public:
+    void reset();
+    void add(int64_t local_us,int64_t offset_us);
+    // Skew to use until there are two points to fit, from the last time
+    // (wake_cache.h). Kept through reset()
+    void seed(double skew_ppm) { prior=skew_ppm/1e6; if (count<2) skew=prior; }
+
+    int64_t offset_at(int64_t local_us); // Leader minus local clock at local_us
+    int64_t local_for(int64_t leader_us); // Where a leader time falls on our clock
+    double skew_ppm() { return skew*1e6; }
+
+    uint8_t count=0;
+
+  private:
+    int64_t local[DRIFT_POINTS];
+    int64_t offset[DRIFT_POINTS];
+    uint8_t next=0;
+    double mean_local=0;
+    double mean_offset=0;
+    double skew=0;
+    double prior=0;
+
+    void fit();
+};
+
+// Gap before the next burst, given the last gap and how far out the fit was
+// at the end of it
+int64_t resync_next_interval_us(int64_t last_interval_us,int64_t prediction_error_us);
+
+#endif
@@ -0,0 +1,109 @@
+// (c) Ed French 2021
+
+/*
+          Event trace
+          ===========
+
+  A flight recorder for field reports. Everything that goes into the state
+  engine (button edges, received frames, send results, the random session
+  ID, battery readings, what was loaded at boot) and the main things that come out of it
+  (frames sent, pairing state changes, motor edges) are kept in RAM with
+  their micros() time. The newest TRACE_EVENTS are kept, the boot record
+  is kept aside so it's never lost.
+
+  Sending 't' over serial dumps it, one line per event:
+
+      TRACE <at_us> <kind> <a> <b> <value> <mac> <data>
+
+  mac and data in hex, '-' for none. Anything before "TRACE " on a line is
+  ignored when it's read back, so a serial capture can be used as it is.
+  The host simulator replays a dump (sim --replay), see
+  src/native/replay.cpp.
+
+  record() can be called from any task. Each writer takes the next slot
+  with an atomic add, so two only meet if one is a whole ring behind.
+  Recording stops while the dump is going.
+
+*/
+
+#ifndef ALTANX_TRACE_H
+#define ALTANX_TRACE_H
+
+#include <stdint.h>
+#include <atomic>
+#include "hal.h"
+
+#define TRACE_EVENTS 512 // Power of 2, a group pairing with the leader beating every 20 ms fits
+#define TRACE_DATA_BYTES 64 // As much of a frame as rx_queue keeps
+#define TRACE_LINE_CHARS (64+2*TRACE_DATA_BYTES)
+
+enum trace_kinds
+{
+  TRACE_NONE=0,
+  TRACE_BOOT,    // a is_leader_def, b state loaded, mac partner, data pairing state, flags, followers
+                 // expected, then the peer table (count, macs). value the cached skew (ppb) on a fast wake
+  TRACE_RANDOM,  // value from random32()
+  TRACE_BUTTON,  // a button, b pressed
+  TRACE_RX,      // mac sender, data frame, a rssi (int8_t, 0 not known)
+  TRACE_TX,      // mac destination, data frame, b accepted by the radio
+  TRACE_SENT,    // mac destination, b delivered
+  TRACE_STATE,   // a from, b to
+  TRACE_MOTOR,   // a duty, value ramp ms
+  TRACE_BATTERY, // value mV, as read
+  TRACE_KIND_COUNT
+};
+
+#define TRACE_BOOT_LEADER 0x01
+#define TRACE_BOOT_BUZZ 0x02
+#define TRACE_BOOT_LED 0x04
+#define TRACE_BOOT_WAKE 0x08 // Loaded from the wake cache, not flash
+#define TRACE_BOOT_ULP 0x10 // Carried on synced from a ULP sleep, which replay can't do
+
+struct trace_event
+{
+  int64_t at_us;
+  uint8_t kind;
+  uint8_t a;
+  uint8_t b;
+  uint8_t len;
+  uint32_t value;
+  uint8_t mac[6];
+  uint8_t data[TRACE_DATA_BYTES];
+};
+
+class trace_recorder
+{
+  public:
+    trace_recorder(altanx_hal & hal);
+
+    void record(trace_kinds kind,uint8_t a,uint8_t b,uint32_t value=0, \
+                const uint8_t * mac=NULL,const uint8_t * data=NULL,size_t len=0,int64_t at_us=-1);
+    void record_boot(const trace_event & event) { boot=event; }
+
+    // Oldest first, from position since on (0 includes the boot record).
+    // Returns how many were copied
+    size_t copy(trace_event * out,size_t max,uint32_t since=0);
+    uint32_t recorded() { return next.load(std::memory_order_acquire); } // Ever, the next position
+    void dump(); // Over the log output, see above
+
+    altanx_hal & hal;
+
+    std::atomic<bool> enabled;
+    trace_event boot;
+    uint32_t lost=0; // Overwritten before the last copy() got to them
+
+  private:
+    struct slot
+    {
+      std::atomic<uint32_t> sequence; // Position+1 once written, 0 while being written
+      trace_event event;
+    };
+    slot slots[TRACE_EVENTS];
+    std::atomic<uint32_t> next;
+};
+
+const char * trace_kind_name(uint8_t kind);
+size_t trace_format(const trace_event & event,char * out,size_t size);
+bool trace_parse(const char * line,trace_event & event); // False if there's no event on the line
+
+#endif
@@ -0,0 +1,124 @@
+// (c) Ed French 2021
+
+/*
+          ULP stimulation
+          ===============
+
+  Once a treatment is under way nothing needs the main cores between
+  resync windows but the motor, and all the motor needs is its pin on for
+  this device's window and off again every period. The ESP32's ULP
+  coprocessor can do that from RTC memory with both Xtensa cores in deep
+  sleep, at a fraction of a light sleeping loop's current:
+
+      1. After ULP_AWAKE_MS with nothing on the screen to read, between
+         windows, the state engine saves what it's synced to in RTC
+         memory (altanx.h) and asks the HAL to sleep until the next resync
+         window, less ULP_BOOT_MS for the boot
+      2. The HAL works out a plan for the ULP in its slow clock's ticks,
+         hands it the pin and sleeps. The ULP plays the windows on the pin
+         from its own timer, one wake per edge of a low rate PWM
+      3. The main cores wake for that window, for a button, or if the ULP
+         gets to the end of its windows first, which it stops at
+         ULP_SPARE_WINDOWS past the wake. The boot picks up from RTC memory
+         already synced, with micros() carried on through the sleep, and
+         the motor goes back to its timer at its next edge
+
+  The ULP's timer counts the RTC slow clock, an RC oscillator of around
+  150 kHz on the ESP32, which the HAL measures against the crystal just
+  before each sleep. The plan is all whole ticks:
+
+      first   ulp_run() to the first window's start
+      on      a pulse's start to its end
+      off     its end to the next pulse's start, within a window
+      gap     the window's last pulse's end to the next window's start,
+              and a 65536th of a tick part (gap_frac) added up from
+              ULP_ACC_START, a tick more each time that goes over
+
+  There's no LEDC in deep sleep, so each window is played as pulses at
+  ULP_PWM_US, on for the schedule's duty: the waveform's mean over the
+  window, so the motor gets the energy it would have had awake rather
+  than full on. The kick and the ramps are lost in the average.
+
+  Each wait is the time between edges less ULP_WAKE_US, what it costs the
+  ULP to wake, switch the pin and halt again. So the window starts stay
+  within a tick of the schedule for as long as the slow clock holds to its
+  calibration. That, and the follower's skew against the leader, set in
+  the schedule from its drift fit, are what the next resync mops up.
+
+  The slow clock doesn't hold to it: it wanders with temperature, so the
+  phase error grows with the length of the sleep, both devices' worth,
+  where the crystal keeps it under a ms. That isn't a skew the drift fit
+  can learn, so while the ULP may sleep the follower resyncs every
+  ULP_RESYNC_INTERVAL_MS whatever its last error. At a 100 ppm wander
+  (sim --rc-ppm) that's still a ms or two by the resync. Hence
+  ENABLE_ULP_STIM is off in the device builds until the wander's been
+  measured on a board.
+
+  ulp_window_us() is the ULP program's timing worked out on the host: the
+  simulator drives the motor from it (sim --ulp), so the timing can be
+  checked without a board. ULP_WAKE_US is a guess until it's been timed
+  on one.
+
+  A flat battery's shut down isn't noticed until the next wake.
+
+*/
+
+#ifndef ALTANX_ULP_STIM_H
+#define ALTANX_ULP_STIM_H
+
+#include <stdint.h>
+
+#define ULP_AWAKE_MS 10000 // After a sync or a button, so the screen can be read
+#define ULP_MIN_SLEEP_MS 5000 // Not worth the boot for less
+#define ULP_BOOT_MS 400 // Deep sleep wake to the state engine running, ahead of the resync guard
+#define ULP_RESYNC_INTERVAL_MS 10000 // Longest resync interval while the ULP may sleep, see above
+#define ULP_LEAD_US 50000 // Calibrating and handing over the pin, before the first window
+#define ULP_SPARE_WINDOWS 30 // A minute past the wake, then the ULP gives up and wakes the cores
+#define ULP_WAKE_US 20 // Timer expiry to the pin and back to halt, taken off each wait
+#define ULP_PWM_US 5000 // 200 Hz, slower than LEDC but the motor's rotor smooths it
+#define ULP_CAL_FRAC_BITS 19 // Slow clock period in us, as rtc_clk_cal() gives it
+#define ULP_ACC_START 0x8000 // Half a tick, so the fraction rounds rather than truncates
+
+// What the state engine wants played, on its micros() clock
+struct ulp_schedule
+{
+  int64_t epoch_us; // A period starts here
+  int64_t period_us; // Leader's clock
+  int64_t window_start_us; // Into each period, leader's clock
+  int64_t window_end_us;
+  int32_t skew_ppb; // Leader's clock against ours, periods are that much shorter on ours
+  uint8_t duty; // 0..255, the waveform's mean over the window
+  int64_t wake_us; // Main cores back up here
+};
+
+// What the ULP is given
+struct ulp_plan
+{
+  uint32_t first_ticks;
+  uint32_t on_ticks;
+  uint32_t off_ticks;
+  uint32_t gap_ticks;
+  uint16_t gap_frac;
+  uint16_t pulses; // A window
+  uint16_t windows; // Then it wakes the main cores and stops
+  int64_t first_us; // micros() of the first window's start, for checking the plan
+};
+
+// False if there isn't a whole window before wake_us, the ticks won't
+// fit or the duty's too near 0 or 255 for a pulse. cal is the slow
+// clock's period in us, ULP_CAL_FRAC_BITS fraction
+bool ulp_plan_for(const ulp_schedule & schedule,int64_t now_us,uint32_t cal,ulp_plan & plan);
+
+// When the ULP starts window n from ulp_run(), and ends its last pulse,
+// if its slow clock really ticks at tick_us and each wake really costs
+// wake_us. False after the last
+bool ulp_window_us(const ulp_plan & plan,uint32_t window,double tick_us,double wake_us,int64_t & start_us,int64_t & end_us);
+
+// Mean duty from a window's start to its end, pulses and all
+uint8_t ulp_window_duty(const ulp_plan & plan,double tick_us,double wake_us);
+
+// Furthest any window starts from the schedule, if the slow clock holds
+// to cal. started_us is the micros() it was run at
+int64_t ulp_plan_error_us(const ulp_plan & plan,const ulp_schedule & schedule,int64_t started_us,uint32_t cal);
+
+#endif
@@ -0,0 +1,74 @@
+// (c) Ed French 2021
+
+/*
+          Wake cache
+          ==========
+
+  A cold boot spends most of three seconds before the sync handshake can
+  start: the 300 and 500 ms start up delays, reading NVS and the two
+  second splash. Waking from deep sleep none of that is needed, so a copy
+  of what the next boot wants is kept in RTC memory (hal.h), which stays
+  powered in deep sleep:
+
+      offset  bytes
+         0     2    magic 'A' 'W'
+         2     1    version, WAKE_CACHE_VERSION
+         3     1    payload length n, STATE_PAYLOAD_BYTES
+         4     4    state_store sequence of the newest record, little endian
+         8     1    state_store slot it's in
+         9     4    follower's crystal skew against the leader, ppb, signed
+        13     n    the state payload, as in flash (state_store.cpp)
+      13+n     2    CRC-16/CCITT-FALSE of everything before it
+      15+n          anything the caller wants kept with it, up to
+                    WAKE_CACHE_EXTRA_BYTES. It checks its own
+
+  It's rewritten with every save_state() and each time a follower's skew
+  estimate moves, both only RAM writes. The state store is told which
+  slot and sequence it's at so the next save goes where it would have
+  after a full load.
+
+  A wake that finds a good cache for a paired device goes straight to
+  syncing with the radio up straight away, and the follower starts its
+  drift fit from the cached skew rather than none. The offset itself
+  can't be kept, both clocks start again from 0 at the wake.
+
+  Anything that doesn't check out, or a different version, and the boot
+  is a cold one. A power off or reset loses RTC memory anyway.
+
+  Going into a ULP sleep (ulp_stim.h) the state engine keeps what it's
+  synced to after the record, and the offset is kept after all as the
+  clock carries on. Any save without it drops it.
+
+*/
+
+#ifndef ALTANX_WAKE_CACHE_H
+#define ALTANX_WAKE_CACHE_H
+
+#include <stdint.h>
+#include "hal.h"
+#include "state_store.h"
+
+#define WAKE_CACHE_VERSION 1
+#define WAKE_CACHE_BYTES (13+STATE_PAYLOAD_BYTES+2)
+#define WAKE_CACHE_EXTRA_BYTES 640
+#define FAST_WAKE_FIRST_BUZZ_MS 500 // What we're aiming at, logged against it
+
+struct t_sync_state;
+
+class wake_cache
+{
+  public:
+    wake_cache(altanx_hal & hal) : hal(hal) {}
+
+    // State as saved, and the store put back where it was. False, and
+    // nothing touched, if there's no good cache
+    bool load(t_sync_state & state,state_store & store,int32_t & skew_ppb);
+    void save(const t_sync_state & state,const state_store & store,int32_t skew_ppb, \
+              const void * extra=NULL,size_t extra_len=0);
+    // What was saved after the record, 0 if nothing. Doesn't check the record
+    size_t load_extra(void * extra,size_t len);
+
+    altanx_hal & hal;
+};
+
+#endif
@@ -0,0 +1,75 @@
+// (c) Ed French 2021
+
+/*
+          Motor waveforms
+          ===============
+
+  What the motor does inside its buzz window, as a table of steps:
+
+      duty     0..255, what the step goes to
+      ramp_ms  how long it takes to get there from wherever the last step
+               left it, 0 for at once. The LEDC fade unit does the ramp in
+               hardware, the CPU only starts it
+      hold_ms  how long it then stays, WAVEFORM_SUSTAIN for as long as the
+               window allows once every other step has had its time
+
+  Steps run from the start of the window and the motor is switched off at
+  the end of it, whatever the table says. A table that ends early leaves
+  the motor at its last duty (normally 0) until then.
+
+  A motor pulls several times its running current to get going, so the
+  soft waveform kicks it hard for a moment, lets it settle to a lower
+  sustain duty which is all a spinning motor needs, and ramps it down
+  rather than stopping dead. Less battery, no inrush dip on the rail at
+  every buzz, and the brushes last longer
+  (info/vibration_motor_lifetime_requirements.xlsx).
+
+*/
+
+#ifndef ALTANX_WAVEFORM_H
+#define ALTANX_WAVEFORM_H
+
+#include <stdint.h>
+
+#define WAVEFORM_SUSTAIN 0xFFFF
+
+struct waveform_step
+{
+  uint8_t duty;
+  uint16_t ramp_ms;
+  uint16_t hold_ms;
+};
+
+struct waveform
+{
+  const char * name;
+  const waveform_step * steps;
+  uint8_t count;
+};
+
+enum waveform_ids
+{
+  WAVEFORM_SQUARE=0, // What it always did, PWM_LEVEL for the whole window
+  WAVEFORM_SOFT,     // Kick, sustain low, ramp down
+  WAVEFORM_PULSES,   // Three soft pulses, a different feel
+  WAVEFORM_COUNT
+};
+
+extern const waveform waveforms[WAVEFORM_COUNT];
+
+// Where a waveform is t_us into a window of window_us
+struct waveform_point
+{
+  int8_t step; // -1 before the window or once it's over, the motor is off
+  uint8_t duty; // Of the step, reached ramp_ms after start_us
+  uint16_t ramp_ms;
+  int64_t start_us; // Of the step, from the start of the window
+  int64_t end_us; // Next thing to do, from the start of the window
+};
+
+// Pure sums, no hardware
+bool waveform_at(const waveform & wave,int64_t t_us,int64_t window_us,waveform_point & point);
+// Average duty over a whole period with the window at the start of it
+uint8_t waveform_mean_duty(const waveform & wave,int64_t window_us,int64_t period_us);
+
+#endif
@@ -0,0 +1,114 @@
+// (c) Ed French 2021
+
+/*
+          Radio wire protocol
+          ===================
+
+  Every ESP-NOW frame is packed little-endian, no padding:
+
+      offset  bytes
+        0       2    magic 'A' 'X'
+        2       1    protocol version
+        3       1    message type (wire_types)
+        4       2    sequence number, per sender
+        6       4    session ID, picked by the leader at boot
+       10     8*n    timestamps in us, n depends on the type
+      end-2     2    CRC-16/CCITT-FALSE of everything before it
+
+  A time request carries the same four timestamp slots as the reply, only
+  t1 used, so both directions spend the same time in the air. The offset
+  maths in time_sync.h assumes they do.
+
+  Times are in the sender's clock, except resync windows which are always
+  in the leader's.
+
+  A group reply (version 2) answers every follower that asked in a round
+  at once, see group.h. After the timestamps (t3, epoch) come:
+
+       26       1    slots in the group, the leader's included
+       27       1    k, the number of entries
+       28     9*k    per entry: slot (1), low 32 bits of its t1 (4),
+                     t3-t2 in us (4)
+
+  The follower knows its own t1 so the low half is enough to find its
+  entry, and t2 comes back as the time the request was held. It keeps the
+  frame inside an rx_frame for a full group.
+
+  Versioning: the header never changes. A later version may add fields
+  after the ones listed here, which older firmware decodes and ignores, so
+  mixed fleets still pair. Frames older than WIRE_MIN_VERSION are refused.
+
+*/
+
+#ifndef ALTANX_WIRE_PROTOCOL_H
+#define ALTANX_WIRE_PROTOCOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define WIRE_MAGIC_0 'A'
+#define WIRE_MAGIC_1 'X'
+#define WIRE_VERSION 2 // 2 adds the group reply
+#define WIRE_MIN_VERSION 1
+#define WIRE_HEADER_BYTES 10
+#define WIRE_CRC_BYTES 2
+#define WIRE_MAX_TIMESTAMPS 4
+#define WIRE_MAX_ENTRIES 3
+#define WIRE_ENTRY_BYTES 9
+#define WIRE_GROUP_BYTES (WIRE_HEADER_BYTES+8*2+2+WIRE_ENTRY_BYTES*WIRE_MAX_ENTRIES+WIRE_CRC_BYTES)
+#define WIRE_MAX_FRAME WIRE_GROUP_BYTES // A full group reply is the longest
+
+enum wire_types
+{
+  WIRE_PAIR_REQUEST=1,  // Leader broadcast
+  WIRE_PAIR_ECHO=2,     // Follower, to the leader
+  WIRE_SYNC_REQUEST=3,  // Leader, asks the follower to start its time exchange
+  WIRE_TIME_REQUEST=4,  // Follower: t1 (and three empty slots)
+  WIRE_TIME_REPLY=5,    // Leader: t1 t2 t3 epoch
+  WIRE_SYNC_DONE=6,     // Follower has lined up on the leader's epoch: t1=next resync window
+  WIRE_GROUP_REPLY=7    // Leader: t3 epoch, then an entry for each follower that asked
+};
+
+enum wire_results
+{
+  WIRE_OK=0,
+  WIRE_TOO_SHORT,
+  WIRE_BAD_MAGIC,
+  WIRE_BAD_VERSION,
+  WIRE_BAD_TYPE,
+  WIRE_BAD_CRC
+};
+
+// One follower's answer in a group reply
+struct wire_entry
+{
+  uint8_t slot;
+  uint32_t t1; // Low 32 bits
+  uint32_t held_us; // t3-t2
+};
+
+// A frame once decoded. Timestamps the type doesn't carry are 0
+struct wire_message
+{
+  uint8_t version;
+  uint8_t type;
+  uint16_t seq;
+  uint32_t session;
+  int64_t t1;
+  int64_t t2;
+  int64_t t3;
+  int64_t epoch;
+  uint8_t slots; // Group reply only, as are the entries
+  uint8_t entry_count;
+  wire_entry entries[WIRE_MAX_ENTRIES];
+};
+
+// Returns the frame length, 0 if the buffer is too small or the type unknown
+size_t wire_encode(const wire_message & message,uint8_t * buffer,size_t size);
+wire_results wire_decode(const uint8_t * data,size_t len,wire_message & message);
+
+const char * wire_type_name(uint8_t type);
+const char * wire_result_name(wire_results result);
+uint16_t wire_crc16(const uint8_t * data,size_t len);
+
+#endif
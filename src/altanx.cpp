@@ -0,0 +1,1894 @@
+// (c) Ed French 2021
+
+
+
+/*
+          Bilateral alternating stimulation
+          =================================
+
+
+Signalling methodology
+======================
+
+
+ State    Leader                                    Follower
+ =====    ======                                    ========
+
+ PAIRING  1. Leader broadcasts pairing avail.
+                                                    2. Follower Receives broadcast
+                                                    notes leader's address
+
+                                                    3. Follower sends Echo message directly
+                                                    Follower now paired, goes to SYNCING
+          4. Leader records follower mac
+          picks its phase epoch
+          Leader now paired, goes to SYNCING
+          and sends the first sync message (below)
+
+    -------------------------------------------------------------------
+
+  SYNCING  1. Leader sends sync message to
+              follower mac                          2. Follower receives targeted sync message
+
+                                                    3. Follower sends time request (t1)
+           4. Leader replies with t1, t2, t3
+              and its phase epoch                   5. Follower notes t4
+                                                    Steps 3-5 repeat SYNC_EXCHANGES times
+
+                                                    6. Follower takes the median offset,
+                                                    sets its epoch to the leader's
+                                                    Follower now synced, sends sync echo
+           7. Leader now synced                     8. Follower switches off radio once
+                                                    the echo is acked
+
+  See time_sync.h for the sums.
+
+
+
+
+
+
+*/
+
+
+
+#include <string.h>
+#include "altanx.h"
+#include "board.h"
+
+static_assert(WIRE_MAX_FRAME<=RX_FRAME_BYTES,"Wire frames must fit in an rx_frame");
+static_assert(sizeof(ulp_snapshot)<=WAKE_CACHE_EXTRA_BYTES,"A ULP snapshot has to fit after the wake cache");
+
+uint8_t broadcast_addr[]={0xFF,0xFF,0xFF,0xFF,0xFF,0xFF};
+uint8_t blank_partner[]={0,0,0,0,0,0};
+
+const char *state_names[] =
+        { "blank", "Pairing", "paired not synced", "syncing","paired+sync","dummy" };
+const char *event_names[] =
+        { "poll", "received", "short press", "long press", "very long press", "paired", "synced", "timed out" };
+
+#ifdef SAVE_PEER_INFO
+  bool saving_peer_info=true;
+#else
+  bool saving_peer_info=false;
+#endif
+
+
+altanx_device::altanx_device(altanx_hal & hal,bool is_leader_def)
+  : hal(hal),is_leader_def(is_leader_def),buttons(hal),handshake(hal),pair_stats("pair"),sync_stats("sync"),listen_windows(hal),motor(hal),renderer(hal),store(hal),wake(hal),trace(hal),battery(hal),energy(hal),link(hal)
+{
+  buttons.trace=&trace;
+  motor.trace=&trace;
+  battery.trace=&trace;
+  main_state={BLANK_WAITING_TO_START_PAIRING, \
+              {0,0,0,0,0,0}, \
+              is_leader_def, \
+              false, \
+              true, \
+              false, \
+              0, \
+              0, \
+              {0,{}}, \
+              (uint8_t)(is_leader_def?0:1), \
+              2}; // Will be overwritten from preferences
+
+  old_state={DUMMY, \
+             {0,0,0,0,0,0},\
+             !is_leader_def, \
+             true, \
+             false, \
+             false, \
+             1, \
+             1, \
+             {0,{}}, \
+             0xFF, \
+             0};
+  memset(members,0,sizeof(members));
+  memset(transition_timing,0,sizeof(transition_timing));
+}
+
+void altanx_device::delay_with_yield(uint32_t ms)
+{
+  energy.set(ENERGY_CPU,0);
+  hal.delay_ms(ms);
+  energy.set(ENERGY_CPU,ENERGY_FULL);
+}
+
+
+// In place, a copy needn't keep the padding
+static uint16_t ulp_snapshot_crc(ulp_snapshot & snapshot)
+{
+  uint16_t kept=snapshot.crc;
+  snapshot.crc=0;
+  uint16_t crc=wire_crc16((const uint8_t *)&snapshot,sizeof(snapshot));
+  snapshot.crc=kept;
+  return crc;
+}
+
+void buff_print_mac(char * buffer,const uint8_t * mac_addr)
+{
+  // Writes a nicely formatted mac address
+  sprintf(buffer,"%x:%x:%x:%x:%x:%x",mac_addr[0],mac_addr[1],mac_addr[2],mac_addr[3],mac_addr[4],mac_addr[5]);
+}
+
+
+// callback when data is sent
+void altanx_device::on_sent(const uint8_t *mac_addr,bool success)
+{
+  // if (status==ESP_NOW_SEND_SUCCESS && memcmp(mac_addr,broadcast_addr,6)!=0)
+  // {
+  //   main_state.time_offset=millis();
+  //   main_state.is_synced=true;
+  // }
+  if (success && sync_done_pending)
+  {
+    // Leader has the sync echo, follower can switch off now
+    sync_done_acked=true;
+  }
+  trace.record(TRACE_SENT,0,success,0,mac_addr);
+  link.delivered(mac_addr,success);
+  LOG_DEBUG("Last packet to %x:%x:%x:%x:%x:%x: %s\n",mac_addr[0],mac_addr[1],mac_addr[2], \
+            mac_addr[3],mac_addr[4],mac_addr[5],success?"Delivery Success":"Delivery Fail");
+}
+
+void altanx_device::change_pairing_state(pairing_states new_state, const char * marker)
+{
+  LOG_INFO("\n=============================\n"
+           "Changing from : %s --to--> %s\n"
+           "At marker: %s\n"
+           "===============================\n", \
+           state_names[main_state.pairing_state], \
+           state_names[new_state], \
+           marker);
+  trace.record(TRACE_STATE,main_state.pairing_state,new_state);
+  main_state.pairing_state=new_state;
+  main_state.state_change_time=hal.millis();
+  lit_ms=hal.millis(); // Worth a look before any ULP sleep
+}
+
+
+void altanx_device::update_display(t_sync_state main_state,bool force_update)
+{
+  if (!display_awake) return;
+  uint32_t bytes=renderer.render(main_state,old_state,radio_on,buzzing,force_update);
+  if (bytes) LOG_DEBUG("Display frame: %u bytes\n",(unsigned)bytes);
+}
+
+void altanx_device::show_message(uint8_t seconds,const char* message)
+{
+  // Queued for the display, never waits. See display_renderer.h
+  #ifdef ENABLE_DISPLAY
+  if (!display_awake) display_init(false);
+  renderer.toast(seconds*1000,message);
+  #endif
+}
+
+void altanx_device::switch_off_wifi(uint32_t linger_ms)
+{
+  LOG_DEBUG("Turning radio off...\n");
+  delay_with_yield(linger_ms);
+  hal.radio_stop();
+  radio_on=false;
+  energy.set(ENERGY_RADIO,0);
+  LOG_DEBUG("Radio now off\n");
+}
+
+
+void altanx_device::save_state(const void * extra,size_t extra_len)
+{
+  // Don't save Pairing or syncing or synced modes- but copy first
+  // so we don't change the live state...
+
+  t_sync_state temp_state;
+  memcpy(&temp_state,&main_state,sizeof(main_state));
+  if (temp_state.pairing_state==PAIRING)
+  {
+    temp_state.pairing_state=BLANK_WAITING_TO_START_PAIRING;
+  }
+  if (temp_state.pairing_state==SYNCING)
+  {
+    temp_state.pairing_state=PAIRED_NOT_SYNCED;
+  }
+  if (temp_state.pairing_state==PAIRED_SYNCED)
+  {
+    temp_state.pairing_state=PAIRED_NOT_SYNCED;
+  }
+  temp_state.is_synced=false; // save it without is_synced set
+  if (store.save(temp_state))
+  {
+    LOG_INFO("Saved state, write %u\n",(unsigned)store.sequence);
+  }
+  // Only RAM, so kept up to date even when flash is left alone
+  wake.save(temp_state,store,main_state.is_leader?0:(int32_t)(drift.skew_ppm()*1000),extra,extra_len);
+}
+
+void altanx_device::leader_pairing_rx()
+{
+   received_msg rx=last_received;
+   last_received.new_ready=false;
+   if (rx.message.type!=WIRE_PAIR_ECHO || rx.message.session!=session_id)
+    {
+      const char * buffer="\n\n==================\n"
+                          "ERROR - expected pairing message\n"
+                          "Ignoring!\n";
+      LOG_WARN("%s",buffer);
+      show_message(5,"ERROR!\nTry re-pair");
+      return;
+    }
+    // Valid pairing message so pair!
+
+    // Note valid follower address, it gets the next slot
+    int8_t index=main_state.group.add(rx.mac_addr);
+    if (index<0)
+    {
+      LOG_WARN("Group full, not pairing %x:%x:%x:%x:%x:%x\n",rx.mac_addr[0],rx.mac_addr[1], \
+               rx.mac_addr[2],rx.mac_addr[3],rx.mac_addr[4],rx.mac_addr[5]);
+      return;
+    }
+    hal.radio_add_peer(rx.mac_addr);
+    if (!pair_first_ms) pair_first_ms=hal.millis();
+    handshake.heard(); // Others may be close behind
+    LOG_INFO("Follower %d of %u paired\n",index+1,(unsigned)pair_expected);
+    if (main_state.group.count>=pair_expected) raise(EVENT_PAIRED);
+    rx.new_ready=false; // Flag it's now processed and we can rx another
+}
+
+void altanx_device::leader_finish_pairing()
+{
+    // Radio's still on so go straight into the time exchange
+    time_offset_us=hal.micros(); // Our phase epoch
+    main_state.time_offset=time_offset_us/1000;
+    main_state.slot=0;
+    main_state.slots=main_state.group.slots();
+    memset(members,0,sizeof(members));
+    round_started_us=0;
+    finish_handshake(pair_stats,true);
+    save_state();
+    if (main_state.group.count>1) hal.radio_add_peer(broadcast_addr);
+    start_handshake(false);
+    leader_send_sync_request();
+    handshake.sent();
+    show_message(3,"Paired\nOK");
+}
+
+void altanx_device::leader_syncing_rx()
+{
+    received_msg rx=last_received;
+    last_received.new_ready=false;
+    int8_t member=main_state.group.find(rx.mac_addr);
+    if (rx.message.type==WIRE_PAIR_ECHO && member>=0)
+    {
+      // Follower answered more than one of our pair requests, we've already
+      // got what we needed from the first
+      rx.new_ready=false;
+      return;
+    }
+    if (rx.message.session!=session_id)
+    {
+      LOG_DEBUG("Ignoring %s from another session\n",wire_type_name(rx.message.type));
+      rx.new_ready=false;
+      return;
+    }
+// Checks:
+    if ((rx.message.type!=WIRE_SYNC_DONE && \
+         rx.message.type!=WIRE_TIME_REQUEST) || \
+        member<0)
+    {
+      const char * buffer="\n\n==================\n"
+                          "ERROR - expected sync message\n"
+                          "Ignoring!\n";
+      LOG_WARN("%s",buffer);
+      show_message(5,"ERROR!\nTry switch off");
+      LOG_WARN("Incoming message from mac: %x:%x:%x:%x:%x:%x\n",rx.mac_addr[0],rx.mac_addr[1], \
+               rx.mac_addr[2],rx.mac_addr[3],rx.mac_addr[4],rx.mac_addr[5]);
+      LOG_WARN("Message type: %s\n",wire_type_name(rx.message.type));
+      rx.new_ready=false;
+      return;
+    }
+    group_member & m=members[member];
+    if (rx.message.type==WIRE_TIME_REQUEST)
+    {
+      m.asked_ms=hal.millis();
+      leader_round_rx(rx,member);
+      rx.new_ready=false;
+      return;
+    }
+    // Follower has finished its exchanges and lined up on our epoch
+    if (!m.synced) LOG_INFO("Follower %d synced\n",member+1);
+    m.synced=true;
+    m.window_us=rx.message.t1; // Its first resync
+    rx.new_ready=false; // Flag it's now processed and we can rx another
+    if (leader_all_synced()) raise(EVENT_SYNCED);
+}
+
+void altanx_device::leader_finish_sync()
+{
+    // Windows are on one grid, the first is whichever's soonest
+    resync_window_us=0;
+    for (uint8_t i=0;i<main_state.group.count;i++)
+    {
+      if (members[i].synced && (!resync_window_us || members[i].window_us<resync_window_us)) resync_window_us=members[i].window_us;
+    }
+    resync_active=false;
+    main_state.is_synced=true;
+    finish_handshake(sync_stats,true);
+    LOG_INFO("Sync set at millis: %d\n",main_state.time_offset);
+    switch_off_wifi(RESYNC_LINGER_MS); // Nothing comes in while it lingers, and the motor waits on it
+}
+
+bool altanx_device::leader_all_synced()
+{
+  for (uint8_t i=0;i<main_state.group.count;i++)
+  {
+    if (!members[i].synced) return false;
+  }
+  return main_state.group.count>0;
+}
+
+bool altanx_device::leader_any_synced()
+{
+  for (uint8_t i=0;i<main_state.group.count;i++)
+  {
+    if (members[i].synced) return true;
+  }
+  return false;
+}
+
+void altanx_device::leader_round_rx(received_msg rx,int8_t member)
+{
+  // A pair gets its answer straight away, as it always did
+  if (main_state.group.count<=1)
+  {
+    leader_send_time_reply(rx);
+    return;
+  }
+  // A follower asking again (its answer was lost) replaces what it asked before
+  group_member & m=members[member];
+  if (!round_started_us) round_started_us=hal.micros();
+  m.asked=true;
+  m.request_t1=rx.message.t1;
+  m.request_t2=rx.rx_time_us;
+  leader_round_update();
+}
+
+void altanx_device::leader_round_update()
+{
+  // Answers the round once every follower it's waiting on has asked, or
+  // once the first has waited GROUP_ROUND_MS
+  if (!round_started_us) return;
+  bool waiting=false;
+  for (uint8_t i=0;i<main_state.group.count;i++)
+  {
+    const group_member & m=members[i];
+    bool expected=resync_active?(m.due && !m.done):!m.synced;
+    if (expected && !m.asked) waiting=true;
+  }
+  if (waiting && hal.micros()-round_started_us<GROUP_ROUND_MS*1000LL) return;
+  leader_send_round();
+}
+
+void altanx_device::leader_send_round()
+{
+  uint8_t count=0;
+  int8_t only=-1;
+  for (uint8_t i=0;i<main_state.group.count;i++)
+  {
+    if (!members[i].asked) continue;
+    message.entries[count].slot=i+1;
+    message.entries[count].t1=(uint32_t)members[i].request_t1;
+    count++;
+    only=i;
+  }
+  round_started_us=0;
+  if (!count) return;
+  message.slots=main_state.group.slots();
+  message.entry_count=count;
+  message.epoch=time_offset_us;
+  message.t3=hal.micros(); // As late as possible
+  for (uint8_t i=0;i<count;i++)
+  {
+    group_member & m=members[message.entries[i].slot-1];
+    message.entries[i].held_us=(uint32_t)(message.t3-m.request_t2);
+    m.asked=false;
+  }
+  rounds++;
+  // One broadcast for the round, or straight to the one follower so it gets the radio's retries
+  if (!send_message(count==1?main_state.group.macs[only]:broadcast_addr,WIRE_GROUP_REPLY))
+  {
+      LOG_WARN("Error sending the group reply\n");
+  }
+}
+
+void altanx_device::follower_pairing_rx()
+{
+    received_msg rx=last_received;
+    last_received.new_ready=false;
+   // Checks
+    if (rx.message.type==WIRE_SYNC_REQUEST || rx.message.type==WIRE_GROUP_REPLY)
+    {
+      // The leader's syncing a group we're too late for, it'll be broadcast
+      LOG_DEBUG("Ignoring %s to the group\n",wire_type_name(rx.message.type));
+      rx.new_ready=false;
+      return;
+    }
+    if (rx.message.type!=WIRE_PAIR_REQUEST)
+    {
+      const char * buffer="\n\n==================\n"
+                          "ERROR - expected pairing message\n"
+                          "Ignoring!\n";
+      LOG_WARN("%s",buffer);
+      show_message(5,"ERROR!\nTry re-pair");
+      rx.new_ready=false;
+      return;
+    }
+    LOG_INFO("Received valid pair message\n");
+    // Genuine pairing message so...
+    memcpy(main_state.partner,rx.mac_addr,6);
+    session_id=rx.message.session; // Everything from now on is in the leader's session
+
+    // Add the new party as a peer
+    bool add_result=hal.radio_add_peer(rx.mac_addr);
+
+    LOG_DEBUG("Result of adding peer info: %s\n",add_result?"ok":"failed");
+
+    // Send the echo message back directly
+    if (!send_message(main_state.partner,WIRE_PAIR_ECHO))
+    {
+        LOG_WARN("Error sending the echo data\n");
+    } else {
+
+        LOG_DEBUG("Echo Sent with success\n");
+        handshake.sent();
+        raise(EVENT_PAIRED);
+
+    }
+    rx.new_ready=false; // Flag it's now processed and we can rx another
+}
+
+void altanx_device::follower_finish_pairing()
+{
+    // Paired, the leader will ask us to sync while the radio is still on
+    finish_handshake(pair_stats,true);
+    start_handshake(false);
+    listen_windows.heard(); // Sync request comes as soon as the leader's done pairing
+    time_request_t1=-1;
+    save_state();
+    show_message(3,"Paired\nOK");
+}
+
+void altanx_device::follower_syncing_rx()
+{
+    received_msg rx=last_received;
+    last_received.new_ready=false;
+    if (rx.message.type==WIRE_PAIR_REQUEST && \
+        memcmp(rx.mac_addr,main_state.partner,6)==0)
+    {
+      // Leader never heard our pair echo, say it again
+      session_id=rx.message.session;
+      send_message(main_state.partner,WIRE_PAIR_ECHO);
+      rx.new_ready=false;
+      return;
+    }
+// Checks
+    if ((rx.message.type!=WIRE_SYNC_REQUEST && \
+         rx.message.type!=WIRE_TIME_REPLY && \
+         rx.message.type!=WIRE_GROUP_REPLY) || \
+        memcmp(rx.mac_addr,main_state.partner,6)!=0)
+    {
+      const char * buffer="\n\n==================\n"
+                          "ERROR - expected sync message\n"
+                          "Ignoring!\n";
+      LOG_WARN("%s",buffer);
+      show_message(5,"ERROR!\nTry re-sync");
+      rx.new_ready=false;
+      return;
+    }
+    if (rx.message.type==WIRE_SYNC_REQUEST)
+    {
+      // Genuine sync message so start the exchange, unless we're already in one
+      session_id=rx.message.session;
+      listen_windows.heard();
+      if (time_request_t1<0)
+      {
+        follower_start_exchange();
+      }
+      rx.new_ready=false;
+      return;
+    }
+
+    // Time reply, ignore it if it's for a request we've given up on, or
+    // a round we weren't in
+    int64_t t2;
+    if (!follower_reply_t2(rx,t2))
+    {
+      LOG_DEBUG("Stale %s ignored\n",wire_type_name(rx.message.type));
+      rx.new_ready=false;
+      return;
+    }
+    sync_estimator.add(time_request_t1,t2,rx.message.t3,rx.rx_time_us);
+    leader_epoch_us=rx.message.epoch;
+    time_request_t1=-1;
+    if (sync_estimator.complete())
+    {
+      raise(EVENT_SYNCED);
+    } else {
+      follower_send_time_request();
+    }
+    rx.new_ready=false; // Flag it's now processed and we can rx another
+}
+
+bool altanx_device::follower_reply_t2(const received_msg & rx,int64_t & t2)
+{
+  // Our answer, from a time reply or our entry in a group reply, and the
+  // slot that comes with it
+  if (time_request_t1<0 || rx.message.session!=session_id) return false;
+  if (rx.message.type==WIRE_TIME_REPLY)
+  {
+    if (rx.message.t1!=time_request_t1) return false;
+    t2=rx.message.t2;
+    main_state.slot=1;
+    main_state.slots=2;
+    return true;
+  }
+  if (rx.message.type!=WIRE_GROUP_REPLY) return false;
+  for (uint8_t i=0;i<rx.message.entry_count;i++)
+  {
+    const wire_entry & entry=rx.message.entries[i];
+    if (entry.t1!=(uint32_t)time_request_t1) continue;
+    t2=rx.message.t3-entry.held_us;
+    main_state.slot=entry.slot;
+    main_state.slots=rx.message.slots;
+    return true;
+  }
+  return false;
+}
+
+void altanx_device::follower_start_exchange()
+{
+  sync_estimator.reset();
+  hal.radio_add_peer(main_state.partner);
+  follower_send_time_request();
+}
+
+void altanx_device::follower_send_time_request()
+{
+  if (main_state.pairing_state==SYNCING) handshake.sent();
+  message.t1=hal.micros();
+  time_request_t1=message.t1;
+  time_request_sent_ms=hal.millis();
+  if (!send_message(main_state.partner,WIRE_TIME_REQUEST))
+  {
+      LOG_WARN("Error sending the time request\n");
+  }
+}
+
+void altanx_device::follower_send_sync_done()
+{
+  message.t1=resync_window_us;
+  sync_done_pending=true;
+  sync_done_tries++;
+  sync_done_sent_ms=hal.millis();
+  if (!send_message(main_state.partner,WIRE_SYNC_DONE))
+  {
+      LOG_WARN("Error sending the sync echo data\n");
+  } else {
+      LOG_DEBUG("Echo sync Sent with success\n");
+  }
+}
+
+void altanx_device::follower_finish_sync()
+{
+  int64_t offset_us=sync_estimator.median_offset_us();
+  time_offset_us=leader_epoch_us-offset_us; // Leader's epoch on our clock
+  main_state.time_offset=time_offset_us/1000;
+  main_state.is_synced=true;
+  // First point for the drift fit, and the first resync before we know the skew
+  int64_t now=hal.micros();
+  drift.reset();
+  drift.add(now,offset_us);
+  resync_interval_us=RESYNC_FIRST_INTERVAL_MS*1000LL;
+  resync_window_us=resync_grid_after(now+offset_us+resync_interval_us,leader_epoch_us); // Shared with the rest of the group
+  resync_active=false;
+  LOG_INFO("Follower synced: offset %lld us, delay %lld us, spread %lld us\n", \
+           (long long)offset_us, \
+           (long long)sync_estimator.median_delay_us(), \
+           (long long)sync_estimator.offset_spread_us());
+  finish_handshake(sync_stats,true);
+  sync_done_acked=false;
+  sync_done_tries=0;
+  follower_send_sync_done();
+}
+
+void altanx_device::leader_resync_rx()
+{
+  received_msg rx=last_received;
+  last_received.new_ready=false;
+  int8_t member=main_state.group.find(rx.mac_addr);
+  if (member<0 || !members[member].synced || rx.message.session!=session_id || !resync_active)
+  {
+    LOG_DEBUG("Ignoring %s outside a resync window\n",wire_type_name(rx.message.type));
+    return;
+  }
+  // One we weren't expecting counts too, it may have gone on to a window
+  // we never heard about
+  group_member & m=members[member];
+  m.due=true;
+  m.heard=true;
+  if (rx.message.type==WIRE_TIME_REQUEST)
+  {
+    resync_last_heard_us=hal.micros();
+    leader_round_rx(rx,member);
+  } else if (rx.message.type==WIRE_SYNC_DONE)
+  {
+    if (rx.message.t1) m.proposed_us=rx.message.t1;
+    m.done=true;
+  }
+}
+
+void altanx_device::leader_resync_update()
+{
+  if (!resync_window_us) return;
+  int64_t now=hal.micros();
+  if (!resync_active)
+  {
+    if (now<resync_window_us-RESYNC_GUARD_MS*1000LL) return;
+    esp_now_startup();
+    resync_active=true;
+    resync_last_heard_us=0;
+    round_started_us=0;
+    for (uint8_t i=0;i<main_state.group.count;i++)
+    {
+      group_member & m=members[i];
+      m.due=m.synced && m.window_us==resync_window_us;
+      m.heard=false;
+      m.done=false;
+      m.asked=false;
+      m.proposed_us=0;
+    }
+    return;
+  }
+  leader_round_update();
+  // Each follower stops asking at the end of its listen time, then sends
+  // its sync done until we ack it. Only worth waiting for if one turned up
+  bool closing=true;
+  for (uint8_t i=0;i<main_state.group.count;i++)
+  {
+    if (members[i].due && !members[i].done) closing=false;
+  }
+  int64_t close_us=resync_window_us+(RESYNC_LISTEN_MS+RESYNC_GUARD_MS)*1000LL;
+  if (resync_last_heard_us) close_us=resync_last_heard_us+RESYNC_DONE_WAIT_MS*1000LL;
+  if (!closing && now<close_us) return;
+
+  switch_off_wifi(0);
+  resync_active=false;
+  int64_t closed_us=resync_window_us;
+  resync_window_us=0;
+  for (uint8_t i=0;i<main_state.group.count;i++)
+  {
+    group_member & m=members[i];
+    if (m.due)
+    {
+      if (m.done && m.proposed_us>closed_us)
+      {
+        m.window_us=m.proposed_us;
+        resyncs++;
+      } else {
+        // Without its sync done the follower may be retrying or may have
+        // gone on to the window it proposed. Both are on the retry grid, so
+        // walk it until we hear from the follower again
+        m.window_us=closed_us+RESYNC_MIN_INTERVAL_MS*1000LL;
+        if (!m.heard) resync_misses++;
+      }
+      m.due=false;
+    }
+    if (m.synced && (!resync_window_us || m.window_us<resync_window_us)) resync_window_us=m.window_us;
+  }
+  LOG_INFO("Resync window closed, next in %lld ms\n",(long long)((resync_window_us-now)/1000));
+}
+
+void altanx_device::follower_resync_rx()
+{
+  if (sync_done_pending) return; // Nothing but the leader's ack until that's done
+  received_msg rx=last_received;
+  last_received.new_ready=false;
+  int64_t t2;
+  if (memcmp(rx.mac_addr,main_state.partner,6)!=0 || !resync_active || !follower_reply_t2(rx,t2))
+  {
+    LOG_DEBUG("Ignoring %s outside a resync exchange\n",wire_type_name(rx.message.type));
+    return;
+  }
+  sync_estimator.add(time_request_t1,t2,rx.message.t3,rx.rx_time_us);
+  time_request_t1=-1;
+  if (sync_estimator.count>=RESYNC_EXCHANGES)
+  {
+    follower_finish_resync();
+  } else {
+    follower_send_time_request();
+  }
+}
+
+void altanx_device::follower_resync_update()
+{
+  if (!resync_window_us || !drift.count) return;
+  int64_t now=hal.micros();
+  int64_t start=drift.local_for(resync_window_us);
+  if (!resync_active)
+  {
+    if (now<start-RESYNC_GUARD_MS*1000LL) return;
+    esp_now_startup();
+    resync_active=true;
+    sync_estimator.reset();
+    time_request_t1=-1;
+    if (main_state.slots>2) resync_proposal_us=group_resync_after(resync_window_us,resync_interval_us,leader_epoch_us);
+    else resync_proposal_us=resync_window_us+resync_interval_us;
+    return;
+  }
+  if (now>=start+RESYNC_LISTEN_MS*1000LL)
+  {
+    follower_finish_resync();
+    return;
+  }
+  if (now<start) return; // Leader's radio may not be up yet
+  if (time_request_t1<0 || hal.millis()-time_request_sent_ms>SYNC_REPLY_TIMEOUT_MS)
+  {
+    follower_send_time_request();
+  }
+}
+
+void altanx_device::follower_finish_resync()
+{
+  int64_t now=hal.micros();
+  if (sync_estimator.count>0)
+  {
+    int64_t measured=sync_estimator.median_offset_us();
+    int64_t error=measured-drift.offset_at(now);
+    drift.add(now,measured);
+    save_state(); // The new skew for the wake cache, flash is left alone
+    resync_window_us=resync_proposal_us;
+    resync_interval_us=resync_next_interval_us(resync_interval_us,error);
+    if (!ulp_unavailable && resync_interval_us>ULP_RESYNC_INTERVAL_MS*1000LL) resync_interval_us=ULP_RESYNC_INTERVAL_MS*1000LL;
+    resyncs++;
+    LOG_INFO("Resynced: error %lld us, skew %.2f ppm, next in %lld ms\n", \
+             (long long)error,drift.skew_ppm(),(long long)((resync_window_us-(now+measured))/1000));
+    // Tells the leader where the next window is, the radio goes off once
+    // it's acked (PAIRED_SYNCED in update_state)
+    time_request_t1=-1;
+    sync_done_acked=false;
+    sync_done_tries=0;
+    follower_send_sync_done();
+    return;
+  }
+  // Retry on a grid the leader also falls back to
+  resync_window_us+=RESYNC_MIN_INTERVAL_MS*1000LL;
+  resync_misses++;
+  LOG_WARN("Resync window missed\n");
+  time_request_t1=-1;
+  resync_active=false;
+  switch_off_wifi(RESYNC_LINGER_MS);
+}
+
+void altanx_device::follower_track_epoch()
+{
+  // Start of the leader's current buzz period, on our clock as corrected
+  // for drift. The motor runs on our own crystal from here, which is close
+  // enough for one period
+  int64_t period_us=BUZZ_PERIOD_MS*1000LL;
+  int64_t now=hal.micros();
+  int64_t since=now+drift.offset_at(now)-leader_epoch_us;
+  int64_t periods=since/period_us;
+  if (since<0 && since%period_us) periods--;
+  time_offset_us=drift.local_for(leader_epoch_us+periods*period_us);
+}
+
+void altanx_device::follower_rendezvous_update()
+{
+  // Radio on for each listen window, or all the time once the leader's
+  // been heard, see rendezvous.h
+  if (listen_windows.wanted())
+  {
+    if (radio_on) return;
+    if (main_state.pairing_state==PAIRING) follower_pairing_init();
+    else follower_syncing_init();
+    listen_windows.opened();
+  } else if (radio_on)
+  {
+    switch_off_wifi(0);
+  }
+}
+
+uint32_t altanx_device::ms_until_resync()
+{
+  // How long the loop can sleep before a resync window needs the radio
+  if (!resync_window_us || resync_active || !main_state.is_synced) return IDLE_WAIT_MS;
+  int64_t start=main_state.is_leader?resync_window_us:drift.local_for(resync_window_us);
+  int64_t wait_us=start-RESYNC_GUARD_MS*1000LL-hal.micros();
+  if (wait_us<=0) return 0;
+  if (wait_us>=IDLE_WAIT_MS*1000LL) return IDLE_WAIT_MS;
+  return (uint32_t)(wait_us/1000)+1;
+}
+
+int64_t altanx_device::ulp_wake_us()
+{
+  // When the main cores have to be back for the next resync window, 0 if
+  // there's none planned
+  if (!resync_window_us || (!main_state.is_leader && !drift.count)) return 0;
+  int64_t start=main_state.is_leader?resync_window_us:drift.local_for(resync_window_us);
+  return start-(RESYNC_GUARD_MS+ULP_BOOT_MS)*1000LL;
+}
+
+bool altanx_device::ulp_sleep_due()
+{
+  // From an idle pass, between this device's windows, once nobody's looking
+  if (ulp_unavailable || !motor.running || motor.on || resync_active || sync_done_pending) return false;
+  if (display_awake && hal.millis()-lit_ms<ULP_AWAKE_MS) return false;
+  #ifdef ENABLE_DISPLAY
+  if (renderer.toast_showing()) return false;
+  #endif
+  int64_t wake_us=ulp_wake_us();
+  return wake_us && wake_us-hal.micros()>=ULP_MIN_SLEEP_MS*1000LL;
+}
+
+void altanx_device::ulp_sleep()
+{
+  int64_t start_us,end_us;
+  buzz_window(main_state.slot,main_state.slots,start_us,end_us);
+  ulp_schedule schedule;
+  schedule.epoch_us=time_offset_us;
+  schedule.period_us=BUZZ_PERIOD_MS*1000LL;
+  schedule.window_start_us=start_us;
+  schedule.window_end_us=end_us;
+  schedule.skew_ppb=main_state.is_leader?0:(int32_t)(drift.skew_ppm()*1000);
+  schedule.duty=waveform_mean_duty(waveforms[BUZZ_WAVEFORM],end_us-start_us,end_us-start_us);
+  schedule.wake_us=ulp_wake_us();
+
+  ulp_snapshot snapshot=ulp_snapshot(); // Padding and all zeroed, for the CRC
+  snapshot.version=ULP_SNAPSHOT_VERSION;
+  snapshot.slot=main_state.slot;
+  snapshot.slots=main_state.slots;
+  snapshot.session_id=session_id;
+  snapshot.time_offset_us=time_offset_us;
+  snapshot.leader_epoch_us=leader_epoch_us;
+  snapshot.resync_window_us=resync_window_us;
+  snapshot.resync_interval_us=resync_interval_us;
+  snapshot.resyncs=resyncs;
+  snapshot.resync_misses=resync_misses;
+  memcpy(snapshot.members,members,sizeof(members));
+  snapshot.drift=drift;
+  snapshot.crc=ulp_snapshot_crc(snapshot);
+  save_state(&snapshot,sizeof(snapshot));
+
+  LOG_INFO("ULP sleep, back in %lld ms\n",(long long)((schedule.wake_us-hal.micros())/1000));
+  if (hal.ulp_sleep(schedule)) return;
+
+  // Carry on as we were, nothing's been touched
+  LOG_WARN("The ULP can't play this, staying awake\n");
+  ulp_unavailable=true;
+  save_state();
+}
+
+bool altanx_device::ulp_resume()
+{
+  // Back synced from a ULP sleep, micros() carried on through it
+  ulp_snapshot snapshot;
+  if (wake.load_extra(&snapshot,sizeof(snapshot))!=sizeof(snapshot)) return false;
+  if (snapshot.version!=ULP_SNAPSHOT_VERSION || \
+      snapshot.crc!=ulp_snapshot_crc(snapshot))
+  {
+    LOG_WARN("ULP snapshot is no good\n");
+    return false;
+  }
+  main_state.pairing_state=PAIRED_SYNCED;
+  main_state.is_synced=true;
+  main_state.slot=snapshot.slot;
+  main_state.slots=snapshot.slots;
+  session_id=snapshot.session_id;
+  time_offset_us=snapshot.time_offset_us;
+  leader_epoch_us=snapshot.leader_epoch_us;
+  resync_window_us=snapshot.resync_window_us;
+  resync_interval_us=snapshot.resync_interval_us;
+  resyncs=snapshot.resyncs;
+  resync_misses=snapshot.resync_misses;
+  memcpy(members,snapshot.members,sizeof(members));
+  drift=snapshot.drift;
+  first_buzz_us=0; // Nothing to time, it never stopped
+  waking_press=hal.wake_cause()==WAKE_BUTTON && hal.button_pressed(BUTTON_FRONT);
+  save_state(); // Used up, a later wake mustn't find it
+  LOG_INFO("Back from a ULP sleep (%s), next resync in %lld ms\n",hal.wake_cause()==WAKE_BUTTON?"button":"timer", \
+           (long long)((ulp_wake_us()-hal.micros())/1000));
+  return true;
+}
+
+void altanx_device::leader_send_time_reply(received_msg rx)
+{
+  message.t1=rx.message.t1;
+  message.t2=rx.rx_time_us;
+  message.epoch=time_offset_us;
+  message.t3=hal.micros(); // As late as possible
+  if (!send_message(rx.mac_addr,WIRE_TIME_REPLY))
+  {
+      LOG_WARN("Error sending the time reply\n");
+  }
+}
+
+void altanx_device::on_recv(const uint8_t * mac, const uint8_t *incomingData, int len, int8_t rssi)
+{
+  // WiFi task: stamp it and queue it, the state engine does the rest.
+  // Nothing in here may block or log
+  radio_rx.push(mac,incomingData,len,rssi,hal.micros(),hal.millis());
+}
+
+bool altanx_device::send_message(const uint8_t * mac_addr,wire_types type)
+{
+  // Sends whatever timestamps are in message that this type carries
+  uint8_t frame[WIRE_MAX_FRAME];
+  message.type=type;
+  message.seq=tx_seq++;
+  message.session=session_id;
+  size_t len=wire_encode(message,frame,sizeof(frame));
+  if (!len) return false;
+  bool sent=hal.radio_send(mac_addr,frame,len);
+  trace.record(TRACE_TX,type,sent,0,mac_addr,frame,len);
+  if (sent) link.sending(mac_addr);
+  return sent;
+}
+
+bool altanx_device::next_received()
+{
+  // Moves the oldest queued frame that decodes into last_received
+  rx_frame frame;
+  wire_results result;
+  do
+  {
+    if (!radio_rx.pop(frame)) return false;
+    trace.record(TRACE_RX,(uint8_t)frame.rssi,0,0,frame.mac_addr,frame.data,frame.len,frame.rx_time_us);
+    link.heard(frame.mac_addr,frame.rssi);
+    result=wire_decode(frame.data,frame.len,last_received.message);
+    if (result!=WIRE_OK)
+    {
+      wire_errors++;
+      LOG_WARN("Dropped a %d byte frame: %s\n",frame.len,wire_result_name(result));
+    }
+  } while (result!=WIRE_OK);
+  memcpy(last_received.mac_addr,frame.mac_addr,6);
+  last_received.rx_time=frame.rx_time_ms;
+  last_received.rx_time_us=frame.rx_time_us;
+  last_received.new_ready=true;
+
+  LOG_DEBUG("Bytes received: %d from %x:%x:%x:%x:%x:%x\n",frame.len,frame.mac_addr[0],frame.mac_addr[1], \
+            frame.mac_addr[2],frame.mac_addr[3],frame.mac_addr[4],frame.mac_addr[5]);
+  LOG_DEBUG("content %s, seq %u, session %08x\n",wire_type_name(last_received.message.type), \
+            last_received.message.seq,last_received.message.session);
+  return true;
+}
+
+
+void altanx_device::shutdown()
+{
+  // Stop motor
+  motor.stop();
+  //mark synced as false
+  main_state.is_synced=false;
+  //if we are paired change pairing state
+  if (main_state.pairing_state==PAIRING)
+  {
+    change_pairing_state(BLANK_WAITING_TO_START_PAIRING,"Shutdown during pairing, return to blank");
+  }
+  if (main_state.pairing_state==SYNCING || main_state.pairing_state==PAIRED_SYNCED)
+  {
+        change_pairing_state(PAIRED_NOT_SYNCED,"Shutdown during synching or running. revert to paired not synced");
+  }
+  save_state();
+
+  switch_off_wifi();
+
+  show_message(3,"Shutting\nDown");
+
+  // Wait for shutdown key to be released, and for any messages to have
+  // had their time on the screen. Nothing else is running by now
+  while (true)
+  {
+    #ifdef ENABLE_DISPLAY
+    update_display(main_state);
+    #endif
+    delay_with_yield(100); // Anti bounce
+    if (hal.button_pressed(BUTTON_FRONT)) continue;
+    #ifdef ENABLE_DISPLAY
+    if (renderer.toast_showing()) continue;
+    #endif
+    break;
+  }
+  delay_with_yield(100); //Anti bounce
+
+
+  // Now sleep the display
+  energy.set(ENERGY_BACKLIGHT,0);
+  hal.display_sleep();
+
+  hal.deep_sleep();
+}
+
+
+void altanx_device::display_init(bool splash)
+{
+  LOG_INFO("Initialising display\n");
+  hal.display_init();
+  energy.set(ENERGY_BACKLIGHT,ENERGY_FULL);
+  display_awake=true;
+  lit_ms=hal.millis();
+  renderer.invalidate(); // Whatever it had drawn went with the last sleep
+  if (!splash) return; // The status screen's first frame covers it
+  hal.display_fill(COLOUR_RED);
+  hal.display_text(0,0,2,COLOUR_WHITE,main_state.is_leader?"Leader":"Follower");
+  delay_with_yield(2000);
+}
+
+
+
+void altanx_device::update_battery()
+{
+  bool was_low=battery.low;
+  if (battery.poll(motor.on)) renderer.set_battery(battery.known(),battery.percent,battery.minutes_left,battery.charging);
+  if (battery.flat())
+  {
+    LOG_WARN("Battery flat at %u mV, shutting down\n",(unsigned)battery.mv);
+    show_message(5,"Battery\nflat"); // Stays up through shutdown()
+    shutdown();
+  }
+  if (battery.low && !was_low)
+  {
+    LOG_INFO("Battery low, %u minutes left\n",(unsigned)battery.minutes_left);
+    show_message(3,"Battery\nlow");
+  }
+}
+
+
+void altanx_device::report_energy()
+{
+  energy.report(battery.known()?battery.percent:100);
+  show_message(5,energy.summary(battery.known()?battery.percent:100));
+}
+
+void altanx_device::report_retries()
+{
+  pair_stats.report(hal);
+  sync_stats.report(hal);
+}
+
+
+void altanx_device::start_handshake(bool pairing)
+{
+  // The leader asks on this, on the rendezvous beat. The follower only
+  // watches the deadline, and listens in windows until it hears the leader
+  uint32_t deadline_ms=pairing?PAIR_DEADLINE_MS:(main_state.is_leader?SYNC_DEADLINE_MS:FOLLOWER_SYNC_DEADLINE_MS);
+  retry_policy policy={RENDEZVOUS_BEACON_MS,RENDEZVOUS_BEACON_MS,100, \
+                       RENDEZVOUS_BEACON_JITTER_PCT,deadline_ms};
+  handshake.start(policy,session_id);
+  if (!main_state.is_leader) listen_windows.start(radio_on);
+}
+
+void altanx_device::finish_handshake(retry_stats & stats,bool success)
+{
+  stats.record(success,handshake.attempts,handshake.elapsed_ms());
+  LOG_INFO("%s %s after %u attempts, %u ms\n",stats.name,success?"done":"given up", \
+           (unsigned)handshake.attempts,(unsigned)handshake.elapsed_ms());
+}
+
+
+void altanx_device::update_alerts()
+{
+  // The motor edges themselves come from the motor scheduler's timer, here
+  // we just start and stop it to match the state
+  bool should_buzz=main_state.buzz_enabled && main_state.is_synced; // Only buzz when synced
+
+  #ifdef ENABLE_BUZZING
+  if (should_buzz && (!motor.running || motor.epoch_us!=time_offset_us || \
+                      motor.slot!=main_state.slot || motor.slots!=main_state.slots))
+  {
+    motor.start(time_offset_us,main_state.slot,main_state.slots,BUZZ_WAVEFORM);
+  }
+  if (!should_buzz && motor.running)
+  {
+    motor.stop();
+  }
+  #endif
+  energy.set(ENERGY_MOTOR,motor.running?motor.mean_duty:0);
+  buzzing=motor.on;
+  if (buzzing && first_buzz_us<0)
+  {
+    first_buzz_us=hal.micros();
+    LOG_INFO("First buzz %u ms after %s (aiming for %u)\n",(unsigned)(first_buzz_us/1000), \
+             fast_wake?"a fast wake":"a cold boot",FAST_WAKE_FIRST_BUZZ_MS);
+  }
+  #ifdef ENABLE_LED
+
+  hal.led_write((!buzzing) | (!main_state.led_enabled)); // Low is LED on
+
+  #endif
+}
+
+const char * altanx_device::button_hint(const button_event & event)
+{
+  // What letting go now would do, see the table in update_state()
+  switch (event.kind)
+  {
+    case BUTTON_DOWN:
+      return "Release: off";
+    case BUTTON_HELD_LONG:
+      return main_state.pairing_state==SYNCING?"Release: pair":"Release: off";
+    case BUTTON_HELD_VERY_LONG:
+      return "Release: reset";
+    default:
+      return "";
+  }
+}
+
+
+void altanx_device::esp_now_startup(bool broadcast)
+{
+  // Set device as a Wi-Fi Station and init ESP-NOW
+  radio_on=true;
+  energy.set(ENERGY_RADIO,ENERGY_FULL);
+  if (!hal.radio_start()) {
+    LOG_ERROR("Error initializing ESP-NOW\n");
+    return;
+  }
+  link.radio_started();
+  hal.radio_set_tx_power(link.power);
+
+  if (broadcast)
+  {
+    LOG_DEBUG("Starting broadcast channel\n");
+    if (!hal.radio_add_peer(broadcast_addr))
+    {
+      LOG_ERROR("Failed to add peer\n");
+      return;
+    }
+  } else if (main_state.is_leader)
+  {
+    LOG_DEBUG("Starting channel to %u followers\n",(unsigned)main_state.group.count);
+    // Each follower, and broadcast for the group replies
+    for (uint8_t i=0;i<main_state.group.count;i++)
+    {
+      if (!hal.radio_add_peer(main_state.group.macs[i]))
+      {
+        LOG_ERROR("Failed to add peer\n");
+        return;
+      }
+    }
+    if (main_state.group.count>1 && !hal.radio_add_peer(broadcast_addr))
+    {
+      LOG_ERROR("Failed to add peer\n");
+      return;
+    }
+  } else {
+    LOG_DEBUG("Starting peer-to-peer channel\n");
+    // Add peer
+    if (!hal.radio_add_peer(main_state.partner))
+    {
+      LOG_ERROR("Failed to add peer\n");
+      return;
+    }
+
+  }
+}
+
+void altanx_device::pairing_init()
+{
+  esp_now_startup(true);
+}
+void altanx_device::leader_pairing_init()
+{
+  pairing_init();
+}
+void altanx_device::follower_pairing_init()
+{
+  pairing_init();
+}
+
+void altanx_device::syncing_init()
+{
+  esp_now_startup(false);
+}
+
+void altanx_device::leader_syncing_init()
+{
+  syncing_init();
+}
+
+
+
+void altanx_device::follower_syncing_init()
+{
+  syncing_init();
+
+}
+
+
+
+
+void altanx_device::leader_send_pair_request()
+{
+    LOG_DEBUG("Attempting to call to follower...\n");
+    if (!radio_on)
+    {
+      LOG_DEBUG("Switching on radio...\n");
+      leader_pairing_init();
+
+    } else {
+      LOG_DEBUG("Radio is on\n");
+    }
+    hal.radio_add_peer(broadcast_addr);
+
+    // Was sent to pair_address, now it's broadcast
+    if (send_message(broadcast_addr,WIRE_PAIR_REQUEST)) {
+      LOG_DEBUG("Sent with success\n");
+    } else {
+      LOG_WARN("Error sending the data\n");
+    }
+}
+
+void altanx_device::start_pairing()
+{
+    main_state.is_synced=false;
+    start_handshake(true);
+    if (main_state.is_leader)
+    {
+      pair_first_ms=0;
+      leader_pairing_init();
+      leader_send_pair_request();
+      handshake.sent();
+    }
+    // A follower's radio comes up for its first listen window in update_state()
+
+
+}
+
+void altanx_device::leader_send_sync_request()
+{
+    LOG_DEBUG("Attempting to call to follower...\n");
+    // One for the whole group
+    const uint8_t * to=main_state.group.count>1?broadcast_addr:main_state.group.macs[0];
+    if (send_message(to,WIRE_SYNC_REQUEST)) {
+      LOG_DEBUG("Sent with success\n");
+    } else {
+      LOG_WARN("Error sending the data\n");
+    }
+}
+
+
+
+void altanx_device::start_syncing()
+{
+    main_state.is_synced=false;
+    if (main_state.is_leader)
+    {
+      main_state.is_synced=false;// this will change when we get synced
+      time_offset_us=hal.micros(); // Our phase epoch, the follower lines up on it
+      main_state.time_offset=time_offset_us/1000;
+      main_state.slot=0;
+      main_state.slots=main_state.group.slots();
+      memset(members,0,sizeof(members));
+      round_started_us=0;
+      start_handshake(false);
+      leader_syncing_init();
+      leader_send_sync_request();
+      handshake.sent();
+    } else {
+      main_state.is_synced=false;
+      time_request_t1=-1;
+      start_handshake(false); // Radio comes up in update_state()
+    }
+}
+
+
+
+// What each state does with each event, see fsm.h. State first, then the
+// events in the order of pairing_events
+#define ACTION(name) &altanx_device::name
+static constexpr fsm_transition<altanx_device> transitions[]=
+{
+  // Blank, only on the first pass after a boot or a reset
+  {BLANK_WAITING_TO_START_PAIRING,EVENT_POLL,PAIRING,ACTION(start_pairing),ACTION(start_pairing),"Auto start pairing"},
+  {BLANK_WAITING_TO_START_PAIRING,EVENT_RECEIVED,BLANK_WAITING_TO_START_PAIRING,NULL,NULL,NULL},
+  {BLANK_WAITING_TO_START_PAIRING,EVENT_SHORT_PRESS,BLANK_WAITING_TO_START_PAIRING,ACTION(switch_off),ACTION(switch_off),NULL},
+  {BLANK_WAITING_TO_START_PAIRING,EVENT_LONG_PRESS,BLANK_WAITING_TO_START_PAIRING,NULL,NULL,NULL},
+  {BLANK_WAITING_TO_START_PAIRING,EVENT_VERY_LONG_PRESS,BLANK_WAITING_TO_START_PAIRING,ACTION(factory_reset),ACTION(factory_reset),NULL},
+  {BLANK_WAITING_TO_START_PAIRING,EVENT_PAIRED,BLANK_WAITING_TO_START_PAIRING,NULL,NULL,NULL},
+  {BLANK_WAITING_TO_START_PAIRING,EVENT_SYNCED,BLANK_WAITING_TO_START_PAIRING,NULL,NULL,NULL},
+  {BLANK_WAITING_TO_START_PAIRING,EVENT_TIMED_OUT,BLANK_WAITING_TO_START_PAIRING,NULL,NULL,NULL},
+
+  // Pairing
+  {PAIRING,EVENT_POLL,PAIRING,ACTION(leader_pairing_poll),ACTION(follower_rendezvous_update),NULL},
+  {PAIRING,EVENT_RECEIVED,PAIRING,ACTION(leader_pairing_rx),ACTION(follower_pairing_rx),NULL},
+  {PAIRING,EVENT_SHORT_PRESS,BLANK_WAITING_TO_START_PAIRING,ACTION(switch_off),ACTION(switch_off),"Switched off while pairing"},
+  {PAIRING,EVENT_LONG_PRESS,PAIRING,NULL,NULL,NULL},
+  {PAIRING,EVENT_VERY_LONG_PRESS,BLANK_WAITING_TO_START_PAIRING,ACTION(factory_reset),ACTION(factory_reset),"Factory reset selected"},
+  {PAIRING,EVENT_PAIRED,SYNCING,ACTION(leader_finish_pairing),ACTION(follower_finish_pairing),"Successful pair"},
+  {PAIRING,EVENT_SYNCED,PAIRING,NULL,NULL,NULL},
+  {PAIRING,EVENT_TIMED_OUT,BLANK_WAITING_TO_START_PAIRING,ACTION(give_up_pairing),ACTION(give_up_pairing),"Timed out pairing"},
+
+  // Paired not synced, only on the first pass after a boot
+  {PAIRED_NOT_SYNCED,EVENT_POLL,SYNCING,ACTION(start_syncing),ACTION(start_syncing),"Starting to sync"},
+  {PAIRED_NOT_SYNCED,EVENT_RECEIVED,PAIRED_NOT_SYNCED,NULL,NULL,NULL},
+  {PAIRED_NOT_SYNCED,EVENT_SHORT_PRESS,PAIRED_NOT_SYNCED,ACTION(switch_off),ACTION(switch_off),NULL},
+  {PAIRED_NOT_SYNCED,EVENT_LONG_PRESS,PAIRED_NOT_SYNCED,NULL,NULL,NULL},
+  {PAIRED_NOT_SYNCED,EVENT_VERY_LONG_PRESS,BLANK_WAITING_TO_START_PAIRING,ACTION(factory_reset),ACTION(factory_reset),"Factory reset selected"},
+  {PAIRED_NOT_SYNCED,EVENT_PAIRED,PAIRED_NOT_SYNCED,NULL,NULL,NULL},
+  {PAIRED_NOT_SYNCED,EVENT_SYNCED,PAIRED_NOT_SYNCED,NULL,NULL,NULL},
+  {PAIRED_NOT_SYNCED,EVENT_TIMED_OUT,PAIRED_NOT_SYNCED,NULL,NULL,NULL},
+
+  // Syncing
+  {SYNCING,EVENT_POLL,SYNCING,ACTION(leader_syncing_poll),ACTION(follower_syncing_poll),NULL},
+  {SYNCING,EVENT_RECEIVED,SYNCING,ACTION(leader_syncing_rx),ACTION(follower_syncing_rx),NULL},
+  {SYNCING,EVENT_SHORT_PRESS,PAIRED_NOT_SYNCED,ACTION(switch_off),ACTION(switch_off),"Switched off while syncing"},
+  {SYNCING,EVENT_LONG_PRESS,PAIRING,ACTION(repair),ACTION(repair),"Long press during sync"},
+  {SYNCING,EVENT_VERY_LONG_PRESS,BLANK_WAITING_TO_START_PAIRING,ACTION(factory_reset),ACTION(factory_reset),"Factory reset selected"},
+  {SYNCING,EVENT_PAIRED,SYNCING,NULL,NULL,NULL},
+  {SYNCING,EVENT_SYNCED,PAIRED_SYNCED,ACTION(leader_finish_sync),ACTION(follower_finish_sync),"Successful sync"},
+  {SYNCING,EVENT_TIMED_OUT,PAIRED_NOT_SYNCED,ACTION(give_up_syncing),ACTION(give_up_syncing),"Timed out syncing"},
+
+  // Paired and synced
+  {PAIRED_SYNCED,EVENT_POLL,PAIRED_SYNCED,ACTION(leader_resync_update),ACTION(follower_synced_poll),NULL},
+  {PAIRED_SYNCED,EVENT_RECEIVED,PAIRED_SYNCED,ACTION(leader_resync_rx),ACTION(follower_resync_rx),NULL},
+  {PAIRED_SYNCED,EVENT_SHORT_PRESS,PAIRED_NOT_SYNCED,ACTION(switch_off),ACTION(switch_off),"Switched off"},
+  {PAIRED_SYNCED,EVENT_LONG_PRESS,PAIRED_NOT_SYNCED,ACTION(switch_off),ACTION(switch_off),"Switched off"},
+  {PAIRED_SYNCED,EVENT_VERY_LONG_PRESS,BLANK_WAITING_TO_START_PAIRING,ACTION(factory_reset),ACTION(factory_reset),"Factory reset selected"},
+  {PAIRED_SYNCED,EVENT_PAIRED,PAIRED_SYNCED,NULL,NULL,NULL},
+  {PAIRED_SYNCED,EVENT_SYNCED,PAIRED_SYNCED,NULL,NULL,NULL},
+  {PAIRED_SYNCED,EVENT_TIMED_OUT,PAIRED_SYNCED,NULL,NULL,NULL},
+
+  // Dummy, never entered
+  {DUMMY,EVENT_POLL,DUMMY,ACTION(dummy_state),ACTION(dummy_state),NULL},
+  {DUMMY,EVENT_RECEIVED,DUMMY,NULL,NULL,NULL},
+  {DUMMY,EVENT_SHORT_PRESS,DUMMY,ACTION(switch_off),ACTION(switch_off),NULL},
+  {DUMMY,EVENT_LONG_PRESS,DUMMY,NULL,NULL,NULL},
+  {DUMMY,EVENT_VERY_LONG_PRESS,BLANK_WAITING_TO_START_PAIRING,ACTION(factory_reset),ACTION(factory_reset),"Factory reset selected"},
+  {DUMMY,EVENT_PAIRED,DUMMY,NULL,NULL,NULL},
+  {DUMMY,EVENT_SYNCED,DUMMY,NULL,NULL,NULL},
+  {DUMMY,EVENT_TIMED_OUT,DUMMY,NULL,NULL,NULL}
+};
+#undef ACTION
+#define TRANSITION_COUNT (sizeof(transitions)/sizeof(transitions[0]))
+
+static_assert(fsm_complete(transitions,TRANSITION_COUNT,PAIRING_STATE_COUNT,PAIRING_EVENT_COUNT), \
+              "The transition table needs every state and event, in order");
+static_assert(fsm_reachable(transitions,TRANSITION_COUNT, \
+                            (1UL<<BLANK_WAITING_TO_START_PAIRING)|(1UL<<PAIRED_NOT_SYNCED)|(1UL<<PAIRED_SYNCED), \
+                            PAIRING_STATE_COUNT)== \
+              (1UL<<DUMMY)-1,"Every state but dummy has to be reachable from the ones begin() leaves us in");
+static_assert(!fsm_dead_ends(transitions,TRANSITION_COUNT,PAIRING_STATE_COUNT), \
+              "Every state needs a way out");
+static_assert(sizeof(event_names)/sizeof(event_names[0])==PAIRING_EVENT_COUNT,"A name for every event");
+
+void altanx_device::update_state()
+{
+  // This function defines the behaviour of the device. It is called many times each second
+  // to consider how things need to change.
+
+
+  //uint32_t state_duration=(main_state.state_change_time-millis());
+  // Changes state based on button presses and progress pairing
+
+  /*
+
+      Button behaviour
+      ================
+
+
+        Terminology:
+          Pairing- the process of learning and remembering the partner device. IN theory should only need to happen once
+          Syncing- the process of two previously paired devices getting their buzzing in sync. This has to happen every time the devices switch on.
+
+
+        Objectives:
+          To do what the user intuitively expects without them having to really understand this stuff!
+
+        Problems:
+          Feedback: How will the user know what is happening if we don't have a screen?
+
+        When switched off (deep-sleep mode for now)
+
+        When in deep-sleep, any press on a button should wake the device
+        (not coded here, that'll have to come later).
+            If paired it will automatically try to sync for 1 minute before going back to sleep.
+            If not paired it will go into pairing mode for 1 minute before going back to sleep.
+
+        When awake:
+
+            When in pairing mode:
+              A short press causes it to stop pairing and go back to deep-sleep
+              A very long press causes it to factory reset
+
+            When in syncing mode:
+              A short press causes it to stop syncing and go back to deep-sleep
+              A long press causes it to re-enter pairing mode
+              A very long press causes it to factory reset
+
+            When in paired and synced mode:
+              A short press causes it to switch off/deep-sleep
+              A long press causes it to switch off
+              A very long press causes it to factory reset
+
+
+
+
+  */
+
+  // Everything else is in the transition table
+  if (front_button.pressed)
+  {
+    switch (front_button.kind)
+    {
+      case BUTTON_VERY_LONG_PRESS:
+        dispatch(EVENT_VERY_LONG_PRESS);
+        break;
+      case BUTTON_LONG_PRESS:
+        dispatch(EVENT_LONG_PRESS);
+        break;
+      case BUTTON_SHORT_PRESS:
+        dispatch(EVENT_SHORT_PRESS);
+        break;
+      default:
+        break;
+    }
+  }
+  if (last_received.new_ready) dispatch(EVENT_RECEIVED);
+  dispatch(EVENT_POLL);
+  if ((main_state.pairing_state==PAIRING || main_state.pairing_state==SYNCING) && handshake.expired())
+  {
+    dispatch(EVENT_TIMED_OUT);
+  }
+}
+
+void altanx_device::dispatch(pairing_events event)
+{
+  // One transition, then whatever its action raised
+  while (event<PAIRING_EVENT_COUNT)
+  {
+    uint8_t index=main_state.pairing_state*PAIRING_EVENT_COUNT+event;
+    const fsm_transition<altanx_device> & transition=transitions[index];
+    int64_t started_us=hal.micros();
+    raised=PAIRING_EVENT_COUNT;
+    if (transition.to!=transition.from) change_pairing_state((pairing_states)transition.to,transition.marker);
+    void (altanx_device::*action)()=main_state.is_leader?transition.leader:transition.follower;
+    if (action) (this->*action)();
+    transition_timing[index].record(hal.micros()-started_us);
+    event=raised;
+  }
+}
+
+void altanx_device::raise(pairing_events event)
+{
+  // Taken from the table once the action raising it returns
+  raised=event;
+}
+
+void altanx_device::leader_pairing_poll()
+{
+  if (pair_first_ms && (hal.millis()-pair_first_ms>=GROUP_PAIR_WINDOW_MS || handshake.expired()))
+  {
+    // Everyone who's coming has had their chance
+    LOG_INFO("Pairing closed with %u followers\n",(unsigned)main_state.group.count);
+    raise(EVENT_PAIRED);
+    return;
+  }
+  if (handshake.due())
+  {
+    leader_send_pair_request();
+    handshake.sent();
+  }
+}
+
+void altanx_device::leader_syncing_poll()
+{
+  if (handshake.elapsed_ms()>=SYNC_PARTIAL_MS && leader_any_synced())
+  {
+    // Carry on with the ones that made it
+    LOG_WARN("Not all followers synced, going without the rest\n");
+    raise(EVENT_SYNCED);
+    return;
+  }
+  // Only nag if a follower hasn't started its time exchange
+  bool nag=false;
+  for (uint8_t i=0;i<main_state.group.count;i++)
+  {
+    if (members[i].synced) continue;
+    if (!members[i].asked_ms || hal.millis()-members[i].asked_ms>SYNC_QUIET_MS) nag=true;
+  }
+  if (handshake.due())
+  {
+    if (nag)
+    {
+      leader_send_sync_request();// Send another request
+      handshake.sent();
+    } else {
+      handshake.heard(); // They're all talking, check again a first gap on
+    }
+  }
+  leader_round_update();
+}
+
+void altanx_device::follower_syncing_poll()
+{
+  follower_rendezvous_update();
+  if (time_request_t1>=0 && hal.millis()-time_request_sent_ms>SYNC_REPLY_TIMEOUT_MS)
+  {
+    LOG_DEBUG("Time reply lost, asking again\n");
+    follower_send_time_request();
+  }
+}
+
+void altanx_device::follower_synced_poll()
+{
+  // Keep the radio on until the leader has had our sync echo
+  if (sync_done_pending)
+  {
+    if (sync_done_acked || sync_done_tries>=SYNC_DONE_TRIES)
+    {
+      sync_done_pending=false;
+      switch_off_wifi(RESYNC_LINGER_MS);
+      resync_active=false;
+    } else if (hal.millis()-sync_done_sent_ms>SYNC_REPLY_TIMEOUT_MS)
+    {
+      follower_send_sync_done();
+    }
+    return;
+  }
+  follower_resync_update();
+}
+
+void altanx_device::give_up_pairing()
+{
+  finish_handshake(pair_stats,false);
+  LOG_WARN("Pairing failed, reverting to blank state\n");
+  save_state();
+  shutdown();
+}
+
+void altanx_device::give_up_syncing()
+{
+  finish_handshake(sync_stats,false);
+  LOG_WARN("Sync failed, packing up\n");
+  save_state();
+  shutdown();
+}
+
+void altanx_device::switch_off()
+{
+  save_state();
+  LOG_INFO("Switching off now...\n");
+  shutdown();
+}
+
+void altanx_device::factory_reset()
+{
+  main_state.is_synced=false;
+  memset(&main_state.partner,0,6);
+  main_state.group.clear();
+  save_state();
+  show_message(5,"Factory\nReset"); // Stays up through shutdown()
+  LOG_INFO("Pairing deleted, shutting down....\n");
+  shutdown();
+}
+
+void altanx_device::repair()
+{
+  // Long press during syncing, forget the partner and pair again
+  main_state.is_synced=false;
+  memcpy(main_state.partner,blank_partner,6);
+  main_state.group.clear();
+  start_pairing();
+}
+
+void altanx_device::dummy_state()
+{
+  LOG_ERROR("Wierdly, state is in dummy state!\n");
+}
+
+void altanx_device::report_transitions()
+{
+  for (uint8_t i=0;i<PAIRING_STATE_COUNT*PAIRING_EVENT_COUNT;i++)
+  {
+    const fsm_timing & timing=transition_timing[i];
+    if (!timing.count) continue;
+    char line[112];
+    snprintf(line,sizeof(line),"FSM %s %s n=%lu mean_us=%lu max_us=%lu\n", \
+             state_names[i/PAIRING_EVENT_COUNT],event_names[i%PAIRING_EVENT_COUNT], \
+             (unsigned long)timing.count,(unsigned long)(timing.total_us/timing.count),(unsigned long)timing.max_us);
+    hal.log_write(hal.micros(),line);
+  }
+}
+
+void altanx_device::run_benchmarks()
+{
+  bench_wire(hal,BENCH_RUNS);
+  bench_motor(hal,BENCH_RUNS);
+
+  // Only where a pass leaves it in the same state, and stopping if one of
+  // them moves it on after all
+  pairing_states state=main_state.pairing_state;
+  const fsm_transition<altanx_device> & poll=transitions[state*PAIRING_EVENT_COUNT+EVENT_POLL];
+  if (poll.to==poll.from)
+  {
+    bench_stat step("fsm_poll","cycles");
+    for (uint32_t i=0;i<BENCH_RUNS && main_state.pairing_state==state;i++)
+    {
+      uint32_t started=hal.cpu_cycles();
+      dispatch(EVENT_POLL);
+      step.record(hal.cpu_cycles()-started);
+    }
+    step.report(hal);
+  }
+
+  #ifdef ENABLE_DISPLAY
+  bench_stat frame("display_frame","cycles");
+  for (uint32_t i=0;i<BENCH_FRAMES;i++)
+  {
+    uint32_t started=hal.cpu_cycles();
+    renderer.render(main_state,old_state,radio_on,buzzing,true);
+    frame.record(hal.cpu_cycles()-started);
+  }
+  frame.report(hal);
+  #endif
+
+  motor.edge_late.report(hal);
+  report_retries();
+}
+
+
+void altanx_device::update_buttons()
+{
+  front_button.pressed=false;
+  side_button.pressed=false;
+  buttons.poll();
+  button_event event;
+  while (buttons.next(event))
+  {
+    lit_ms=hal.millis();
+    if (event.button==BUTTON_FRONT && !waking_press) renderer.set_hint(button_hint(event));
+    if (event.kind<BUTTON_SHORT_PRESS) continue; // Still held
+    LOG_INFO("Button pressed for : %u ms\n\n",(unsigned)event.length_ms);
+    if (event.button==BUTTON_FRONT && waking_press)
+    {
+      waking_press=false;
+      continue;
+    }
+    #ifdef ENABLE_DISPLAY
+    if (!display_awake && event.kind==BUTTON_SHORT_PRESS)
+    {
+      // Dark after a ULP sleep, a short press only lights it
+      display_init(false);
+      continue;
+    }
+    #endif
+    button_state & state=event.button==BUTTON_FRONT?front_button:side_button;
+    state.pressed=true;
+    state.press_length_ms=event.length_ms>0xFFFF?0xFFFF:event.length_ms;
+    state.kind=event.kind;
+  }
+}
+
+
+void altanx_device::begin()
+{
+  hal.radio_set_listener(this);
+  session_id=hal.random32(); // Tells this boot's frames from stale ones, followers adopt the leader's
+  trace.record(TRACE_RANDOM,0,0,session_id);
+
+  ulp_unavailable=!hal.ulp_available(); // Before any resync interval's worked out
+  energy.begin();
+  battery.begin();
+  if (battery.too_flat_to_start())
+  {
+    // Back to sleep until it's been on charge
+    LOG_WARN("Battery at %u mV, not starting\n",(unsigned)battery.mv);
+    hal.deep_sleep();
+    return;
+  }
+  renderer.set_battery(battery.known(),battery.percent,battery.minutes_left,battery.charging);
+
+  // Back from deep sleep paired, go straight to syncing, see wake_cache.h
+  t_sync_state cached;
+  int32_t skew_ppb=0;
+  fast_wake=saving_peer_info && wake.load(cached,store,skew_ppb) && cached.pairing_state==PAIRED_NOT_SYNCED;
+  if (fast_wake)
+  {
+    main_state=cached;
+    drift.seed(skew_ppb/1000.0);
+    LOG_INFO("Fast wake, skew %.3f ppm\n",skew_ppb/1000.0);
+    ulp_resumed=hal.wake_cause()!=WAKE_POWER_ON && ulp_resume();
+  } else {
+    delay_with_yield(300);
+    LOG_INFO("booted\n");
+
+    delay_with_yield(500);
+  }
+
+  // Load the state from preferences
+  bool loaded=fast_wake || (saving_peer_info && store.load(main_state)); // Disabled during development
+  record_boot(loaded,skew_ppb);
+  if (hal.wake_cause()!=WAKE_POWER_ON && !ulp_resumed) hal.motor_write(0); // The ULP's still playing
+  if (loaded)
+  {
+      // The follower's slot comes with its time replies, until then it's a
+      // pair. Back from a ULP sleep it's the one it had
+      if (!ulp_resumed)
+      {
+        main_state.slot=main_state.is_leader?0:1;
+        main_state.slots=main_state.is_leader?main_state.group.slots():2;
+      }
+      memcpy(&old_state,&main_state,sizeof(old_state));
+      LOG_INFO("Succesfully loaded state from %s...\n",fast_wake?"RTC memory":"flash");
+      LOG_INFO("\t\tIs leader: %d\n",main_state.is_leader);
+      LOG_INFO("\t\tIs synced: %d\n",main_state.is_synced);
+      LOG_INFO("\t\tPair state: %s\n",state_names[main_state.pairing_state]);
+
+      /* Should be one of two states only:
+        BLANK_WAITING_TO_START_PAIRING
+        or
+        PAIRED_NOT_SYNCED
+
+        At switch on we need to start either pairing or syncing, which
+        the transition table does on the first pass
+      */
+
+  } else {
+    // Write in a new blank state... and auto start pairing
+
+
+    main_state.is_leader=is_leader_def;
+    main_state.is_synced=false;
+    main_state.pairing_state=BLANK_WAITING_TO_START_PAIRING; // Pairing starts on the first pass
+    main_state.led_enabled=false;
+    main_state.buzz_enabled=true;
+    memcpy(main_state.partner,blank_partner,6);
+    main_state.group.clear();
+    main_state.slot=main_state.is_leader?0:1;
+    main_state.slots=2;
+    main_state.time_offset=0;
+    save_state();
+
+    memcpy(&old_state,&main_state,sizeof(main_state));
+    LOG_INFO("Successfully put dummy state into the store\n");
+
+  }
+
+  #ifdef ENABLE_DISPLAY
+  // Out of a ULP sleep the screen stays dark unless it was a button
+  if (!ulp_resumed || hal.wake_cause()==WAKE_BUTTON) display_init(!fast_wake);
+  LOG_DEBUG("Returned from displaying welcome message\n");
+  #endif
+
+  LOG_INFO("Device %s leader?\n",main_state.is_leader?"IS":"ISN'T");
+}
+
+
+void altanx_device::record_boot(bool loaded,int32_t skew_ppb)
+{
+  // What replay needs to start where this boot did
+  trace_event boot;
+  memset(&boot,0,sizeof(boot));
+  boot.at_us=hal.micros();
+  boot.kind=TRACE_BOOT;
+  boot.a=is_leader_def;
+  boot.b=loaded;
+  boot.data[2]=pair_expected;
+  boot.len=3;
+  if (loaded)
+  {
+    memcpy(boot.mac,main_state.partner,6);
+    boot.data[0]=main_state.pairing_state;
+    boot.data[1]=(main_state.is_leader?TRACE_BOOT_LEADER:0) | \
+                 (main_state.buzz_enabled?TRACE_BOOT_BUZZ:0) | \
+                 (main_state.led_enabled?TRACE_BOOT_LED:0) | \
+                 (fast_wake?TRACE_BOOT_WAKE:0) | \
+                 (ulp_resumed?TRACE_BOOT_ULP:0);
+    boot.value=(uint32_t)skew_ppb;
+    // The leader's peer table
+    boot.data[3]=main_state.group.count;
+    memcpy(boot.data+4,main_state.group.macs,sizeof(main_state.group.macs));
+    boot.len=4+sizeof(main_state.group.macs);
+  }
+  trace.record_boot(boot);
+}
+
+
+void altanx_device::loop_once()
+{
+  // Picked up on the next pass
+  switch (hal.serial_read())
+  {
+    case 't':
+      trace.dump();
+      break;
+    case 'e':
+      report_energy();
+      break;
+    case 'r':
+      report_retries();
+      break;
+    case 'f':
+      report_transitions();
+      break;
+    case 'b':
+      run_benchmarks();
+      break;
+    case 'l':
+      link.report();
+      break;
+  }
+  if (!main_state.is_leader && main_state.is_synced && drift.count) follower_track_epoch();
+
+  update_alerts(); // does buzzing and or LED
+  update_battery();
+  update_buttons(); // reads button states
+  next_received(); // One message a pass, so it goes to the state it arrived in
+  if (link.poll() && radio_on) hal.radio_set_tx_power(link.power);
+  update_state(); // looks for state changes
+  if (last_received.new_ready)
+  {
+    LOG_DEBUG("No use for %s in %s\n",wire_type_name(last_received.message.type),state_names[main_state.pairing_state]);
+    last_received.new_ready=false;
+  }
+  #ifdef ENABLE_DISPLAY
+  update_display(main_state);
+  #endif
+  // Once synced with the radio off there is nothing to poll, the motor runs
+  // off its own timer. Only counts once a whole loop has gone by like that,
+  // so update_alerts() gets to start the motor first, and not while a button
+  // is held as the hints need to change on time
+  bool idle=main_state.pairing_state==PAIRED_SYNCED && old_state.pairing_state==PAIRED_SYNCED && !radio_on && !buttons.any_down();
+  old_state=main_state;
+  LOG_TRACE("buzz:%d,   fr_but: %d ,buzz_en:%d ,mstr: %d,  ,state: %s,  sync: %d    Radio: %d   rx drop: %u\n", \
+            buzzing, \
+            front_button.pressed, \
+            main_state.buzz_enabled, \
+            main_state.is_leader, \
+            state_names[main_state.pairing_state], \
+            main_state.is_synced, \
+            radio_on, \
+            (unsigned)radio_rx.dropped.load(std::memory_order_relaxed));
+
+  // Sleep until a buzz edge, a button or the radio wakes us
+  if (!radio_rx.empty())
+  {
+    // More to handle already
+  } else if (idle && ulp_sleep_due())
+  {
+    ulp_sleep(); // Only comes back if the board can't
+  } else if (idle)
+  {
+    uint32_t wait_ms=ms_until_resync();
+    #ifdef ENABLE_DISPLAY
+    if (renderer.ms_until_change()<wait_ms) wait_ms=renderer.ms_until_change(); // A message to take down
+    #endif
+    if (battery.ms_until_sample()<wait_ms) wait_ms=battery.ms_until_sample();
+    energy.set(ENERGY_CPU,0);
+    hal.wait_event(wait_ms);
+  } else {
+    energy.set(ENERGY_CPU,0);
+    hal.wait_event(LOOP_DELAY_MS);
+  }
+  energy.set(ENERGY_CPU,ENERGY_FULL);
+
+}
@@ -0,0 +1,125 @@
+// (c) Ed French 2021
+
+#include "battery.h"
+#include "trace.h"
+
+
+// Resting voltage of a small LiPo against charge left, 0 being where it
+// hits the cutoff. Flat in the middle, steep at both ends
+struct curve_point
+{
+  uint16_t permille;
+  uint16_t mv;
+};
+
+static const curve_point discharge_curve[]=
+{
+  {0,2900},
+  {20,3300},
+  {50,3600},
+  {100,3690},
+  {200,3740},
+  {300,3770},
+  {400,3790},
+  {500,3820},
+  {600,3870},
+  {700,3920},
+  {800,3980},
+  {900,4060},
+  {1000,4200}
+};
+
+#define CURVE_POINTS (sizeof(discharge_curve)/sizeof(discharge_curve[0]))
+
+uint32_t battery_curve_mv(uint16_t permille)
+{
+  if (permille>=1000) return discharge_curve[CURVE_POINTS-1].mv;
+  for (uint8_t i=1;i<CURVE_POINTS;i++)
+  {
+    const curve_point & lo=discharge_curve[i-1];
+    const curve_point & hi=discharge_curve[i];
+    if (permille<=hi.permille)
+    {
+      return lo.mv+(uint32_t)(hi.mv-lo.mv)*(permille-lo.permille)/(hi.permille-lo.permille);
+    }
+  }
+  return discharge_curve[CURVE_POINTS-1].mv;
+}
+
+uint8_t battery_percent(uint32_t mv)
+{
+  if (mv<=discharge_curve[0].mv) return 0;
+  if (mv>=discharge_curve[CURVE_POINTS-1].mv) return 100;
+  for (uint8_t i=1;i<CURVE_POINTS;i++)
+  {
+    const curve_point & lo=discharge_curve[i-1];
+    const curve_point & hi=discharge_curve[i];
+    if (mv<=hi.mv)
+    {
+      uint32_t permille=lo.permille+(uint32_t)(hi.permille-lo.permille)*(mv-lo.mv)/(hi.mv-lo.mv);
+      return (uint8_t)(permille/10);
+    }
+  }
+  return 100;
+}
+
+
+void battery_monitor::begin()
+{
+  uint32_t total=0;
+  for (int i=0;i<BATTERY_FIRST_SAMPLES;i++) total+=read();
+  take_sample(total/BATTERY_FIRST_SAMPLES);
+  next_sample_us=hal.micros()+(int64_t)BATTERY_SAMPLE_MS*1000;
+}
+
+uint32_t battery_monitor::ms_until_sample()
+{
+  int64_t left_us=next_sample_us-hal.micros();
+  return left_us>0?(uint32_t)(left_us/1000)+1:0;
+}
+
+bool battery_monitor::poll(bool motor_on)
+{
+  int64_t now=hal.micros();
+  if (now<next_sample_us) return false;
+  if (motor_on)
+  {
+    deferred++;
+    next_sample_us=now+(int64_t)BATTERY_DEFER_MS*1000;
+    return false;
+  }
+
+  uint8_t old_percent=percent;
+  bool old_low=low;
+  bool old_charging=charging;
+  take_sample(read());
+  next_sample_us=now+(int64_t)(low?BATTERY_SAMPLE_LOW_MS:BATTERY_SAMPLE_MS)*1000;
+  return percent!=old_percent || low!=old_low || charging!=old_charging;
+}
+
+uint32_t battery_monitor::read()
+{
+  uint32_t sample=hal.battery_mv();
+  if (trace) trace->record(TRACE_BATTERY,0,0,sample);
+  return sample;
+}
+
+void battery_monitor::take_sample(uint32_t sample)
+{
+  samples++;
+  if (!sample)
+  {
+    mv=0;
+    return;
+  }
+  // Plugging in or out is a real step, not noise
+  bool on_usb=sample>=BATTERY_USB_MV;
+  if (!filtered_x16 || on_usb!=charging) filtered_x16=sample<<4;
+  else filtered_x16=filtered_x16-(filtered_x16>>BATTERY_FILTER_SHIFT)+((sample<<4)>>BATTERY_FILTER_SHIFT);
+  mv=filtered_x16>>4;
+  charging=on_usb;
+  percent=charging?100:battery_percent(mv);
+  minutes_left=(uint16_t)((uint32_t)percent*BATTERY_FULL_MINUTES/100);
+  low=!charging && mv<(low?BATTERY_LOW_MV+BATTERY_HYSTERESIS_MV:BATTERY_LOW_MV);
+  LOG_DEBUG("Battery %u mV (sample %u), %u%%, %u minutes\n",(unsigned)mv,(unsigned)sample,(unsigned)percent,(unsigned)minutes_left);
+}
@@ -0,0 +1,96 @@
+// (c) Ed French 2021
+
+#include <stdio.h>
+#include <string.h>
+#include "bench.h"
+#include "altanx.h"
+#include "wire_protocol.h"
+#include "motor_scheduler.h"
+
+
+void bench_stat::record(uint32_t value)
+{
+  count++;
+  total+=value;
+  if (value<min) min=value;
+  if (value>max) max=value;
+}
+
+void bench_stat::report(altanx_hal & hal)
+{
+  uint32_t mean=count?(uint32_t)(total/count):0;
+  char ns[24]="";
+  uint32_t mhz=hal.cpu_mhz();
+  if (strcmp(unit,"cycles")==0 && mhz) snprintf(ns,sizeof(ns)," mean_ns=%lu",(unsigned long)((uint64_t)mean*1000/mhz));
+  char line[128];
+  snprintf(line,sizeof(line),"BENCH %s unit=%s n=%lu min=%lu mean=%lu max=%lu%s\n", \
+           name,unit,(unsigned long)count,(unsigned long)(count?min:0),(unsigned long)mean,(unsigned long)max,ns);
+  hal.log_write(hal.micros(),line);
+}
+
+
+// Kept so the compiler can't drop what's being timed
+static volatile uint32_t bench_sink;
+
+void bench_wire(altanx_hal & hal,uint32_t runs)
+{
+  wire_message reply={};
+  reply.version=WIRE_VERSION;
+  reply.type=WIRE_TIME_REPLY;
+  reply.seq=1234;
+  reply.session=0xA5A5A5A5;
+  reply.t1=123456789;
+  reply.t2=123460000;
+  reply.t3=123460150;
+  reply.epoch=100000000;
+  uint8_t frame[WIRE_MAX_FRAME];
+  bench_stat encode("wire_encode","cycles");
+  for (uint32_t i=0;i<runs;i++)
+  {
+    reply.seq++;
+    uint32_t started=hal.cpu_cycles();
+    bench_sink=wire_encode(reply,frame,sizeof(frame));
+    encode.record(hal.cpu_cycles()-started);
+  }
+  encode.report(hal);
+
+  // The longest frame there is
+  wire_message group=reply;
+  group.type=WIRE_GROUP_REPLY;
+  group.slots=WIRE_MAX_ENTRIES+1;
+  group.entry_count=WIRE_MAX_ENTRIES;
+  for (uint8_t i=0;i<WIRE_MAX_ENTRIES;i++)
+  {
+    group.entries[i].slot=i+1;
+    group.entries[i].t1=1000000*(i+1);
+    group.entries[i].held_us=150+i;
+  }
+  size_t len=wire_encode(group,frame,sizeof(frame));
+  wire_message decoded;
+  bench_stat decode("wire_decode","cycles");
+  for (uint32_t i=0;i<runs;i++)
+  {
+    uint32_t started=hal.cpu_cycles();
+    bench_sink=wire_decode(frame,len,decoded);
+    decode.record(hal.cpu_cycles()-started);
+  }
+  decode.report(hal);
+}
+
+void bench_motor(altanx_hal & hal,uint32_t runs)
+{
+  // A follower's window in a pair, playing the soft waveform, from all
+  // through the period
+  int64_t start_us,end_us;
+  buzz_window(1,2,start_us,end_us);
+  int64_t period_us=BUZZ_PERIOD_MS*1000LL;
+  bench_stat step("motor_next_step","cycles");
+  for (uint32_t i=0;i<runs;i++)
+  {
+    int64_t t_us=1000000000LL+(int64_t)i*period_us/runs*7;
+    uint32_t started=hal.cpu_cycles();
+    bench_sink=(uint32_t)motor_next_step(t_us,0,start_us,end_us,period_us,waveforms[WAVEFORM_SOFT]);
+    step.record(hal.cpu_cycles()-started);
+  }
+  step.report(hal);
+}
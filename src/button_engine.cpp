@@ -0,0 +1,114 @@
+// (c) Ed French 2021
+
+#include "button_engine.h"
+#include "altanx.h"
+#include "trace.h"
+
+
+button_engine::button_engine(altanx_hal & hal) : hal(hal)
+{
+  for (int i=0;i<HAL_BUTTON_COUNT;i++)
+  {
+    buttons[i].down=false;
+    buttons[i].down_us=0;
+    buttons[i].last_edge_us=-BUTTON_DEBOUNCE_MS*1000LL;
+    buttons[i].held_sent=0;
+  }
+}
+
+void button_engine::push(hal_button button,button_events kind,uint32_t length_ms)
+{
+  if ((uint8_t)(event_head-event_tail)>=BUTTON_EVENT_QUEUE)
+  {
+    dropped_events++;
+    return;
+  }
+  button_event & event=events[event_head%BUTTON_EVENT_QUEUE];
+  event.button=button;
+  event.kind=kind;
+  event.length_ms=length_ms;
+  event_head++;
+}
+
+bool button_engine::next(button_event & event)
+{
+  if (event_tail==event_head) return false;
+  event=events[event_tail%BUTTON_EVENT_QUEUE];
+  event_tail++;
+  return true;
+}
+
+bool button_engine::any_down()
+{
+  for (int i=0;i<HAL_BUTTON_COUNT;i++)
+  {
+    if (buttons[i].down) return true;
+  }
+  return false;
+}
+
+void button_engine::change(hal_button button,bool down,int64_t at_us)
+{
+  button_track & track=buttons[button];
+  track.down=down;
+  if (down)
+  {
+    track.down_us=at_us;
+    track.held_sent=0;
+    push(button,BUTTON_DOWN,0);
+    return;
+  }
+  uint32_t length_ms=(uint32_t)((at_us-track.down_us)/1000);
+  if (length_ms>VERY_LONG_BUTTON_THRESHOLD)
+  {
+    push(button,BUTTON_VERY_LONG_PRESS,length_ms);
+  } else if (length_ms>SHORT_BUTTON_THRESHOLD)
+  {
+    push(button,BUTTON_LONG_PRESS,length_ms);
+  } else {
+    push(button,BUTTON_SHORT_PRESS,length_ms);
+  }
+}
+
+void button_engine::poll()
+{
+  hal_button_edge edge;
+  while (hal.button_next_edge(edge))
+  {
+    if (trace) trace->record(TRACE_BUTTON,edge.button,edge.pressed,0,NULL,NULL,0,edge.at_us);
+    button_track & track=buttons[edge.button];
+    if (edge.at_us-track.last_edge_us<BUTTON_DEBOUNCE_MS*1000LL)
+    {
+      bounces++;
+    } else {
+      // The first edge after a quiet spell is a real change whatever the
+      // pin read in the interrupt, it may already have bounced back
+      change(edge.button,!track.down,edge.at_us);
+    }
+    track.last_edge_us=edge.at_us;
+  }
+
+  int64_t now=hal.micros();
+  for (int i=0;i<HAL_BUTTON_COUNT;i++)
+  {
+    hal_button button=(hal_button)i;
+    button_track & track=buttons[i];
+    if (now-track.last_edge_us>=BUTTON_DEBOUNCE_MS*1000LL && hal.button_pressed(button)!=track.down)
+    {
+      change(button,!track.down,now);
+      track.last_edge_us=now;
+    }
+    if (!track.down) continue;
+    uint32_t held_ms=(uint32_t)((now-track.down_us)/1000);
+    if (track.held_sent==0 && held_ms>SHORT_BUTTON_THRESHOLD)
+    {
+      push(button,BUTTON_HELD_LONG,held_ms);
+      track.held_sent=1;
+    }
+    if (track.held_sent==1 && held_ms>VERY_LONG_BUTTON_THRESHOLD)
+    {
+      push(button,BUTTON_HELD_VERY_LONG,held_ms);
+      track.held_sent=2;
+    }
+  }
+}
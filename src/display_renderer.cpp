@@ -0,0 +1,172 @@
+// (c) Ed French 2021
+
+#include <string.h>
+#include "display_renderer.h"
+#include "altanx.h"
+
+
+uint32_t display_renderer::draw_line(uint8_t line,const char * text)
+{
+  return hal.display_line(line*DISPLAY_LINE_HEIGHT,DISPLAY_LINE_HEIGHT,DISPLAY_TEXT_SIZE,COLOUR_WHITE,COLOUR_BLACK,text);
+}
+
+uint32_t display_renderer::draw_toast(const char * text)
+{
+  // Red box, up to three lines of white text
+  hal.display_fill(COLOUR_RED);
+  hal.display_rect(5,5,DISPLAY_WIDTH-10,DISPLAY_HEIGHT-10,COLOUR_WHITE);
+  char line[TOAST_LINE_CHARS+1];
+  uint8_t lineno=0;
+  const char * start=text;
+  while (lineno<TOAST_LINES)
+  {
+    const char * end=start;
+    while (*end && *end!='\n' && *end!='\r') end++;
+    size_t len=end-start;
+    if (len<=TOAST_LINE_CHARS)
+    {
+      memcpy(line,start,len);
+      line[len]=0;
+      hal.display_text(10,10+14*lineno,2,COLOUR_WHITE,line);
+    } else {
+      LOG_WARN("Message line too long, left off\n");
+    }
+    lineno++;
+    if (!*end) break;
+    start=end+1;
+  }
+  return DISPLAY_WIDTH*DISPLAY_HEIGHT*2;
+}
+
+void display_renderer::toast(uint32_t duration_ms,const char * text)
+{
+  LOG_INFO("Message: %s\n",text);
+  if (toast_count)
+  {
+    // Same again just keeps the last one up for longer
+    struct toast & last=toasts[(toast_first+toast_count-1)%TOAST_QUEUE];
+    if (strcmp(last.text,text)==0)
+    {
+      if (toast_count==1 && toast_drawn)
+      {
+        uint32_t until=hal.millis()+duration_ms;
+        if ((int32_t)(until-toast_expires_ms)>0) toast_expires_ms=until;
+      } else if (duration_ms>last.duration_ms)
+      {
+        last.duration_ms=duration_ms;
+      }
+      return;
+    }
+  }
+  if (toast_count==TOAST_QUEUE)
+  {
+    // Drop the oldest one still waiting, the front one is already up
+    for (uint8_t i=1;i<TOAST_QUEUE-1;i++)
+    {
+      toasts[(toast_first+i)%TOAST_QUEUE]=toasts[(toast_first+i+1)%TOAST_QUEUE];
+    }
+    toast_count--;
+  }
+  toasts[(toast_first+toast_count)%TOAST_QUEUE]={text,duration_ms};
+  toast_count++;
+}
+
+uint32_t display_renderer::ms_until_change()
+{
+  if (!toast_count) return UINT32_MAX;
+  if (!toast_drawn) return 0;
+  int32_t left=(int32_t)(toast_expires_ms-hal.millis());
+  return left>0?(uint32_t)left:0;
+}
+
+void display_renderer::set_battery(bool known,uint8_t percent,uint16_t minutes_left,bool charging)
+{
+  if (!known) battery[0]=0;
+  else if (charging) snprintf(battery,sizeof(battery),"charging");
+  else snprintf(battery,sizeof(battery),"%u%% %um",(unsigned)percent,(unsigned)minutes_left);
+}
+
+uint32_t display_renderer::render(const t_sync_state & state,const t_sync_state & old_state,bool radio_on,bool buzzing,bool force)
+{
+  uint32_t bytes=0;
+  uint16_t dirty=0;
+
+  // A message covers the status lines until its time is up
+  uint32_t now=hal.millis();
+  if (toast_count && toast_drawn && (int32_t)(now-toast_expires_ms)>=0)
+  {
+    toast_first=(toast_first+1)%TOAST_QUEUE;
+    toast_count--;
+    toast_drawn=false;
+    if (!toast_count) valid=false;
+  }
+  if (toast_count)
+  {
+    if (!toast_drawn || force)
+    {
+      const struct toast & front=toasts[toast_first];
+      bytes=draw_toast(front.text);
+      if (!toast_drawn) toast_expires_ms=now+front.duration_ms;
+      toast_drawn=true;
+    }
+    last_frame_bytes=bytes;
+    total_bytes+=bytes;
+    if (bytes) frames++;
+    return bytes;
+  }
+
+  if (force || !valid)
+  {
+    // Someone else has drawn on the screen, start again
+    hal.display_fill(COLOUR_BLACK);
+    bytes+=DISPLAY_WIDTH*DISPLAY_HEIGHT*2;
+    dirty=(1<<DISPLAY_LINE_COUNT)-1;
+    valid=true;
+  } else {
+    if (state.is_leader!=old_state.is_leader || strcmp(battery,drawn_battery)!=0) dirty|=1<<LINE_ROLE;
+    if (state.is_synced!=old_state.is_synced) dirty|=1<<LINE_SYNC;
+    if (state.pairing_state!=old_state.pairing_state) dirty|=(1<<LINE_PAIR_STATE)|(1<<LINE_STATE_NAME);
+    if (memcmp(state.partner,old_state.partner,6)!=0 || state.slots!=old_state.slots || \
+        state.slot!=old_state.slot || state.group.count!=old_state.group.count) dirty|=1<<LINE_PARTNER;
+    if (radio_on!=drawn_radio_on) dirty|=1<<LINE_RADIO;
+    if (buzzing!=drawn_buzzing) dirty|=1<<LINE_BUZZ;
+    if (strcmp(hint,drawn_hint)!=0) dirty|=1<<LINE_HINT;
+  }
+
+  char line[30];
+  if (dirty&(1<<LINE_ROLE))
+  {
+    snprintf(line,sizeof(line),"%-9s%10s",state.is_leader?"leader":"follower",battery);
+    bytes+=draw_line(LINE_ROLE,line);
+  }
+  if (dirty&(1<<LINE_SYNC)) bytes+=draw_line(LINE_SYNC,state.is_synced?"synced":"unsynced");
+  if (dirty&(1<<LINE_PAIR_STATE))
+  {
+    snprintf(line,sizeof(line),"Pair state: %d",state.pairing_state);
+    bytes+=draw_line(LINE_PAIR_STATE,line);
+  }
+  if (dirty&(1<<LINE_PARTNER))
+  {
+    // Who we're paired with, or where we are in a bigger group
+    if (state.slots>2) snprintf(line,sizeof(line),"Slot %u of %u",(unsigned)state.slot+1,(unsigned)state.slots);
+    else buff_print_mac(line,state.is_leader?state.group.macs[0]:state.partner);
+    bytes+=draw_line(LINE_PARTNER,line);
+  }
+  if (dirty&(1<<LINE_STATE_NAME)) bytes+=draw_line(LINE_STATE_NAME,state_names[state.pairing_state]);
+  if (dirty&(1<<LINE_RADIO))
+  {
+    snprintf(line,sizeof(line),"Radio: %s",radio_on?"on":"off");
+    bytes+=draw_line(LINE_RADIO,line);
+  }
+  if (dirty&(1<<LINE_BUZZ)) bytes+=draw_line(LINE_BUZZ,buzzing?"Buzz":"Quiet");
+  if (dirty&(1<<LINE_HINT)) bytes+=draw_line(LINE_HINT,hint);
+  drawn_radio_on=radio_on;
+  drawn_buzzing=buzzing;
+  drawn_hint=hint;
+  strcpy(drawn_battery,battery);
+
+  last_frame_bytes=bytes;
+  total_bytes+=bytes;
+  if (bytes) frames++;
+  return bytes;
+}
@@ -0,0 +1,121 @@
+// (c) Ed French 2021
+
+#include <stdio.h>
+#include "energy.h"
+
+
+static const char * subsystem_names[ENERGY_SUBSYSTEM_COUNT]={"base","cpu","radio","motor","backlight"};
+static const uint32_t full_ua[ENERGY_SUBSYSTEM_COUNT]= \
+  {ENERGY_BASE_UA,ENERGY_CPU_UA,ENERGY_RADIO_UA,ENERGY_MOTOR_UA,ENERGY_BACKLIGHT_UA};
+
+const char * energy_subsystem_name(energy_subsystems subsystem)
+{
+  return subsystem<ENERGY_SUBSYSTEM_COUNT?subsystem_names[subsystem]:"?";
+}
+
+void energy_meter::begin()
+{
+  started_us=hal.micros();
+  for (int i=0;i<ENERGY_SUBSYSTEM_COUNT;i++)
+  {
+    levels[i]=0;
+    level_us[i]=0;
+    since_us[i]=started_us;
+  }
+  levels[ENERGY_BASE]=ENERGY_FULL;
+  levels[ENERGY_CPU]=ENERGY_FULL; // Awake until the first wait
+  summary_text[0]=0;
+}
+
+void energy_meter::set(energy_subsystems subsystem,uint8_t level)
+{
+  if (levels[subsystem]==level) return;
+  int64_t now=hal.micros();
+  level_us[subsystem]+=(uint64_t)levels[subsystem]*(now-since_us[subsystem]);
+  since_us[subsystem]=now;
+  levels[subsystem]=level;
+}
+
+void energy_meter::catch_up(int64_t now)
+{
+  for (int i=0;i<ENERGY_SUBSYSTEM_COUNT;i++)
+  {
+    level_us[i]+=(uint64_t)levels[i]*(now-since_us[i]);
+    since_us[i]=now;
+  }
+}
+
+uint32_t energy_meter::used_uah(energy_subsystems subsystem)
+{
+  catch_up(hal.micros());
+  // level_us/255 is us at full, times uA, over 3600e6 us in an hour
+  return (uint32_t)(level_us[subsystem]/ENERGY_FULL*full_ua[subsystem]/3600000000ULL);
+}
+
+uint32_t energy_meter::used_uah()
+{
+  uint32_t total=0;
+  for (int i=0;i<ENERGY_SUBSYSTEM_COUNT;i++) total+=used_uah((energy_subsystems)i);
+  return total;
+}
+
+uint32_t energy_meter::on_permille(energy_subsystems subsystem)
+{
+  int64_t now=hal.micros();
+  catch_up(now);
+  if (now<=started_us) return 0;
+  return (uint32_t)(level_us[subsystem]*1000/ENERGY_FULL/(uint64_t)(now-started_us));
+}
+
+uint32_t energy_meter::average_ua()
+{
+  int64_t now=hal.micros();
+  catch_up(now);
+  if (now<=started_us) return 0;
+  uint64_t total=0;
+  for (int i=0;i<ENERGY_SUBSYSTEM_COUNT;i++) total+=level_us[i]/ENERGY_FULL*full_ua[i];
+  return (uint32_t)(total/(uint64_t)(now-started_us));
+}
+
+uint32_t energy_meter::minutes_from(uint32_t mah)
+{
+  uint32_t average=average_ua();
+  if (!average) return 0;
+  return (uint32_t)((uint64_t)mah*1000*60/average);
+}
+
+void energy_meter::report(uint8_t battery_percent)
+{
+  char line[96];
+  uint32_t total=used_uah();
+  int64_t now=hal.micros();
+  snprintf(line,sizeof(line),"ENERGY since_boot_s=%lu used_uah=%lu average_ua=%lu\n", \
+           (unsigned long)((now-started_us)/1000000),(unsigned long)total,(unsigned long)average_ua());
+  hal.log_write(now,line);
+  for (int i=0;i<ENERGY_SUBSYSTEM_COUNT;i++)
+  {
+    energy_subsystems subsystem=(energy_subsystems)i;
+    uint32_t uah=used_uah(subsystem);
+    snprintf(line,sizeof(line),"ENERGY %s on_permille=%lu uah=%lu share_pct=%lu\n",subsystem_names[i], \
+             (unsigned long)on_permille(subsystem),(unsigned long)uah,(unsigned long)(total?uah*100/total:0));
+    hal.log_write(now,line);
+  }
+  snprintf(line,sizeof(line),"ENERGY full_charge_min=%lu left_min=%lu target_min=%u\n", \
+           (unsigned long)minutes_from(ENERGY_BATTERY_MAH), \
+           (unsigned long)minutes_from(ENERGY_BATTERY_MAH*battery_percent/100),ENERGY_TARGET_MINUTES);
+  hal.log_write(now,line);
+}
+
+const char * energy_meter::summary(uint8_t battery_percent)
+{
+  // Three lines of TOAST_LINE_CHARS at most
+  uint32_t total=used_uah();
+  uint32_t share[ENERGY_SUBSYSTEM_COUNT];
+  for (int i=0;i<ENERGY_SUBSYSTEM_COUNT;i++) share[i]=total?used_uah((energy_subsystems)i)*100/total:0;
+  // What's left of this battery, the full charge figure is in report()
+  snprintf(summary_text,sizeof(summary_text),"Mot %lu%% Rad %lu%%\nCPU %lu%% Lit %lu%%\n%lum left of %um", \
+           (unsigned long)share[ENERGY_MOTOR],(unsigned long)share[ENERGY_RADIO], \
+           (unsigned long)share[ENERGY_CPU],(unsigned long)share[ENERGY_BACKLIGHT], \
+           (unsigned long)minutes_from(ENERGY_BATTERY_MAH*battery_percent/100),ENERGY_TARGET_MINUTES);
+  return summary_text;
+}
@@ -0,0 +1,955 @@
+// (c) Ed French 2021
+
+#include <Arduino.h>
+#include <Preferences.h>
+
+#ifdef BOARD_TYPE_M5STICKC
+
+// M5 specific libraries
+    //#include <M5StickC.h>
+
+#endif
+
+//#ifdef BOARD_TYPE_TDISPLAY
+  #include <TFT_eSPI.h> // Graphics and font library for ST7735 driver chip
+  #include <SPI.h>
+//#endif
+
+#include <esp_now.h>
+#include <esp_wifi.h>
+#include <esp_timer.h>
+#include <esp_pm.h>
+#include <esp_sleep.h>
+#include <esp_system.h>
+#include <driver/gpio.h>
+#include <driver/ledc.h>
+#include <soc/gpio_struct.h>
+#ifdef ENABLE_ULP_STIM
+#include <esp32/ulp.h>
+#include <esp32/clk.h>
+#include <driver/rtc_io.h>
+#include <soc/rtc.h>
+#include <soc/rtc_cntl_reg.h>
+#include <soc/rtc_io_reg.h>
+#include <soc/sens_reg.h>
+#endif
+#include "WiFi.h"
+
+#include "hal_esp32.h"
+#include "board.h"
+#include "ulp_stim.h"
+
+
+TFT_eSPI tft = TFT_eSPI(135,240);  // Invoke library, pins defined in User_Setup.h
+TFT_eSprite line_sprite = TFT_eSprite(&tft); // Off-screen buffer for display_line()
+
+Preferences preferences;
+
+// Slow RTC memory stays powered in deep sleep, see rtc_read(). The wake
+// cache and what a ULP sleep leaves after it (altanx.h)
+#define ESP32_RTC_BYTES 1024
+RTC_DATA_ATTR static uint8_t esp32_rtc[ESP32_RTC_BYTES];
+RTC_DATA_ATTR static size_t esp32_rtc_len=0;
+
+esp_now_peer_info_t peerInfo;
+
+// micros() carries on through a ULP sleep: the RTC timer counts the slow
+// clock all through deep sleep, so the boot after adds what it counted
+// to where micros() was going in
+RTC_DATA_ATTR static bool esp32_ulp_slept=false;
+RTC_DATA_ATTR static int64_t esp32_slept_us=0;
+RTC_DATA_ATTR static uint64_t esp32_slept_ticks=0; // rtc_time_get()
+RTC_DATA_ATTR static uint32_t esp32_slept_cal=0;
+static int64_t esp32_micros_base=0; // Added to esp_timer_get_time()
+static bool esp32_ulp_woke=false; // This boot is out of a ULP sleep
+static volatile bool esp32_ulp_has_motor=false; // It's still playing, the first motor write takes over
+
+// loop() blocks on a task notification in wait_event(), anything that
+// might need it to run again gives one
+static TaskHandle_t esp32_loop_task=NULL;
+
+static void esp32_wake_loop()
+{
+  if (esp32_loop_task) xTaskNotifyGive(esp32_loop_task);
+}
+
+// Log records are formatted and printed by a task below every other one,
+// so it only gets the CPU when they're all waiting. wait_event() and
+// delay_ms() nudge it when there's anything queued
+static TaskHandle_t esp32_log_task=NULL;
+
+static void esp32_log_drain(void * arg)
+{
+  esp32_hal * hal=(esp32_hal *)arg;
+  while (true)
+  {
+    ulTaskNotifyTake(pdTRUE,portMAX_DELAY);
+    hal->log_drain();
+  }
+}
+
+static void esp32_kick_log(esp32_hal & hal)
+{
+  if (esp32_log_task && !hal.log_records.empty()) xTaskNotifyGive(esp32_log_task);
+}
+
+// Raw button edges from the GPIO interrupts, read by button_next_edge().
+// A light sleep GPIO wake has to be a level interrupt, and it's the same
+// interrupt type as the edge one, so the buttons are level interrupts
+// turned round at each edge: armed for whatever the pin isn't, they fire
+// once per edge rather than for as long as a button's held, and either
+// edge wakes us
+#define ESP32_EDGE_RING 16 // Power of 2
+static hal_button_edge esp32_edges[ESP32_EDGE_RING];
+static volatile uint8_t esp32_edge_head=0; // Only the interrupt writes this
+static volatile uint8_t esp32_edge_tail=0; // Only loop() writes this
+
+static void IRAM_ATTR esp32_push_edge(hal_button button,uint8_t pin)
+{
+  bool high=digitalRead(pin);
+  GPIO.pin[pin].int_type=high?GPIO_INTR_LOW_LEVEL:GPIO_INTR_HIGH_LEVEL; // Fires straight away if it's already changed back
+  uint8_t head=esp32_edge_head;
+  if ((uint8_t)(head-esp32_edge_tail)<ESP32_EDGE_RING)
+  {
+    // A full ring just loses bounce, button_engine re-reads the pin anyway
+    hal_button_edge & edge=esp32_edges[head%ESP32_EDGE_RING];
+    edge.button=button;
+    edge.pressed=high==PRESSED;
+    edge.at_us=esp_timer_get_time()+esp32_micros_base;
+    esp32_edge_head=head+1;
+  }
+  BaseType_t woken=pdFALSE;
+  if (esp32_loop_task) vTaskNotifyGiveFromISR(esp32_loop_task,&woken);
+  if (woken) portYIELD_FROM_ISR();
+}
+
+static void esp32_watch_button(uint8_t pin,void (*on_edge)())
+{
+  bool high=digitalRead(pin);
+  attachInterrupt(digitalPinToInterrupt(pin),on_edge,high?ONLOW:ONHIGH);
+  gpio_wakeup_enable((gpio_num_t)pin,high?GPIO_INTR_LOW_LEVEL:GPIO_INTR_HIGH_LEVEL);
+}
+
+static void IRAM_ATTR esp32_on_front_edge()
+{
+  esp32_push_edge(BUTTON_FRONT,PIN_FRONT_BUTTON);
+}
+
+#ifdef PIN_SIDE_BUTTON
+static void IRAM_ATTR esp32_on_side_edge()
+{
+  esp32_push_edge(BUTTON_SIDE,PIN_SIDE_BUTTON);
+}
+#endif
+
+// LEDC runs off the APB clock, which stops in light sleep
+static esp_pm_lock_handle_t esp32_motor_lock=NULL;
+static bool esp32_motor_locked=false;
+
+#ifdef ENABLE_ULP_STIM
+// The ULP program, see ulp_stim.h. Its variables are the first words of
+// RTC slow memory, in the space the IDF keeps for the ULP, the program
+// after them. One run per wake of its timer, the sleep register it
+// picks is how long the next wait is:
+//
+//    0  first    1  on    2  off    3  gap    4  gap and a tick
+#define ESP32_ULP_STATE 0 // 0 before the first window, then whichever edge is next
+#define ESP32_ULP_FRAC 1 // ulp_plan gap_frac
+#define ESP32_ULP_ACC 2 // What it adds up to, from ULP_ACC_START
+#define ESP32_ULP_LEFT 3 // Windows still to play
+#define ESP32_ULP_PULSES 4 // ulp_plan pulses
+#define ESP32_ULP_PULSE 5 // Pulses still to play in this window
+#define ESP32_ULP_PROGRAM 8 // Words
+#define ESP32_ULP_ON_NEXT 1
+#define ESP32_ULP_OFF_NEXT 2
+#define ESP32_ULP_CAL_CYCLES 8192 // Slow clock cycles timed against the crystal, about 55 ms
+
+static bool esp32_ulp_load(int io)
+{
+  const ulp_insn_t program[]={
+    I_MOVI(R3,0), // Variables from word 0
+    I_LD(R0,R3,ESP32_ULP_STATE),
+    M_BGE(1,ESP32_ULP_OFF_NEXT),
+    M_BGE(2,ESP32_ULP_ON_NEXT),
+    // Started, wait for the first window
+    I_SLEEP_CYCLE_SEL(0),
+    I_MOVI(R0,ESP32_ULP_ON_NEXT),
+    I_ST(R0,R3,ESP32_ULP_STATE),
+    I_HALT(),
+    // Pulse starts
+    M_LABEL(2),
+    I_WR_REG(RTC_GPIO_OUT_W1TS_REG,RTC_GPIO_OUT_DATA_W1TS_S+io,RTC_GPIO_OUT_DATA_W1TS_S+io,1),
+    I_SLEEP_CYCLE_SEL(1),
+    I_MOVI(R0,ESP32_ULP_OFF_NEXT),
+    I_ST(R0,R3,ESP32_ULP_STATE),
+    I_HALT(),
+    // Pulse ends
+    M_LABEL(1),
+    I_WR_REG(RTC_GPIO_OUT_W1TC_REG,RTC_GPIO_OUT_DATA_W1TC_S+io,RTC_GPIO_OUT_DATA_W1TC_S+io,1),
+    I_MOVI(R0,ESP32_ULP_ON_NEXT),
+    I_ST(R0,R3,ESP32_ULP_STATE),
+    I_LD(R0,R3,ESP32_ULP_PULSE),
+    I_SUBI(R0,R0,1),
+    M_BXZ(5),
+    I_ST(R0,R3,ESP32_ULP_PULSE),
+    I_SLEEP_CYCLE_SEL(2),
+    I_HALT(),
+    M_LABEL(5), // Window ends
+    I_LD(R0,R3,ESP32_ULP_PULSES),
+    I_ST(R0,R3,ESP32_ULP_PULSE),
+    I_LD(R0,R3,ESP32_ULP_LEFT),
+    I_SUBI(R0,R0,1),
+    M_BXZ(4),
+    I_ST(R0,R3,ESP32_ULP_LEFT),
+    I_LD(R0,R3,ESP32_ULP_ACC),
+    I_LD(R1,R3,ESP32_ULP_FRAC),
+    I_ADDR(R0,R0,R1),
+    M_BXF(3),
+    I_ST(R0,R3,ESP32_ULP_ACC),
+    I_SLEEP_CYCLE_SEL(3),
+    I_HALT(),
+    M_LABEL(3), // Went over, a tick longer this time
+    I_ST(R0,R3,ESP32_ULP_ACC),
+    I_SLEEP_CYCLE_SEL(4),
+    I_HALT(),
+    M_LABEL(4), // That was the last, wake the main cores and stop the timer
+    I_WAKE(),
+    I_END(),
+    I_HALT()
+  };
+  size_t size=sizeof(program)/sizeof(ulp_insn_t);
+  return ulp_process_macros_and_load(ESP32_ULP_PROGRAM,program,&size)==ESP_OK;
+}
+
+static void esp32_ulp_periods(const ulp_plan & plan)
+{
+  const uint32_t ticks[]={plan.first_ticks,plan.on_ticks,plan.off_ticks,plan.gap_ticks,plan.gap_ticks+1};
+  for (int i=0;i<5;i++) REG_SET_FIELD(SENS_ULP_CP_SLEEP_CYC0_REG+i*sizeof(uint32_t),SENS_SLEEP_CYCLES_S0,ticks[i]);
+}
+#endif
+
+// The first motor write after a ULP sleep takes the pin back for LEDC,
+// timer task only
+static void esp32_take_motor()
+{
+  #ifdef ENABLE_ULP_STIM
+  if (!esp32_ulp_has_motor) return;
+  CLEAR_PERI_REG_MASK(RTC_CNTL_STATE0_REG,RTC_CNTL_ULP_CP_SLP_TIMER_EN); // Stops at its next halt
+  rtc_gpio_deinit((gpio_num_t)PIN_VIBRATION);
+  ledcAttachPin(PIN_VIBRATION,PWM_CHANNEL);
+  esp32_ulp_has_motor=false;
+  #endif
+}
+
+// ESP-NOW callbacks have no context pointer so the listener has to be static
+static radio_listener * esp32_listener=NULL;
+
+static void esp32_on_sent(const uint8_t *mac_addr, esp_now_send_status_t status)
+{
+  if (esp32_listener) esp32_listener->on_sent(mac_addr,status==ESP_NOW_SEND_SUCCESS);
+  esp32_wake_loop();
+}
+
+// ESP-NOW's receive callback doesn't say how strong the frame was, so the
+// radio also runs promiscuous for management frames and this keeps the
+// RSSI of the last ESP-NOW one (a vendor specific action frame). The
+// receive callback for the same frame follows it on the WiFi task
+static int8_t esp32_last_rssi=0;
+static uint8_t esp32_last_rssi_mac[6];
+
+static void esp32_on_promiscuous(void * buffer,wifi_promiscuous_pkt_type_t type)
+{
+  if (type!=WIFI_PKT_MGMT) return;
+  const wifi_promiscuous_pkt_t * packet=(const wifi_promiscuous_pkt_t *)buffer;
+  const uint8_t * frame=packet->payload;
+  // Action frame control, then the category after the 24 byte header
+  if (packet->rx_ctrl.sig_len<25 || frame[0]!=0xD0 || frame[24]!=127) return;
+  memcpy(esp32_last_rssi_mac,frame+10,6); // Transmitter
+  esp32_last_rssi=packet->rx_ctrl.rssi;
+}
+
+static void esp32_on_recv(const uint8_t * mac, const uint8_t *incomingData, int len)
+{
+  int8_t rssi=memcmp(mac,esp32_last_rssi_mac,6)==0?esp32_last_rssi:0;
+  if (esp32_listener) esp32_listener->on_recv(mac,incomingData,len,rssi);
+  esp32_wake_loop();
+}
+
+static esp_timer_handle_t esp32_timers[HAL_TIMER_COUNT]; // Created the first time each is armed
+static timer_listener * volatile esp32_timer_listeners[HAL_TIMER_COUNT];
+static TaskHandle_t esp32_timer_task=NULL;
+
+#ifdef ENABLE_HW_TIMER_EDGES
+// Each hal_timer is a hardware timer whose interrupt is allocated on the
+// timer task's core, counting us off the APB clock. Its alarm sets the
+// timer's bit in the timer task's notification value, a timer_post() its
+// bit up at ESP32_TIMER_POSTED, and the task calls the listener.
+//
+// The APB clock drops with the CPU's and stops in light sleep, so an
+// armed alarm holds esp32_alarm_lock. For a long wait an esp_timer, which
+// light sleep keeps, comes first: ESP32_TIMER_LEAD_US ahead it sets the
+// timer's bit up at ESP32_TIMER_NEAR, from esp_timer's task, and the
+// timer task takes the lock and sets the alarm. The WiFi task can hold
+// that up, but only by as much as the lead before an edge is late
+static hw_timer_t * esp32_alarms[HAL_TIMER_COUNT]; // esp32_timers are the long waits
+static int64_t esp32_alarm_at[HAL_TIMER_COUNT]; // micros(), timer task only
+static esp_pm_lock_handle_t esp32_alarm_lock=NULL;
+static uint32_t esp32_alarms_set=0; // Bit per timer holding the lock
+static uint32_t esp32_alarms_near=0; // Bit per timer on its esp_timer, a late ESP32_TIMER_NEAR bit is dropped
+static uint32_t esp32_alarms_stale=0; // Bit per timer whose alarm went off as it was stopped, its bit is dropped
+static uint64_t esp32_alarm_count[HAL_TIMER_COUNT]; // What it's set to
+
+template<int timer> static void IRAM_ATTR esp32_on_alarm()
+{
+  BaseType_t woken=pdFALSE;
+  xTaskNotifyFromISR(esp32_timer_task,1UL<<timer,eSetBits,&woken);
+  if (woken) portYIELD_FROM_ISR();
+}
+static void (* const esp32_alarm_isrs[])()={esp32_on_alarm<TIMER_MOTOR>};
+static_assert(sizeof(esp32_alarm_isrs)/sizeof(esp32_alarm_isrs[0])==HAL_TIMER_COUNT,"An alarm interrupt for every hal_timer");
+static_assert(HAL_TIMER_COUNT<=ESP32_TIMER_POSTED && ESP32_TIMER_POSTED+HAL_TIMER_COUNT<=ESP32_TIMER_NEAR, \
+              "The notification bits would overlap");
+
+static void esp32_on_near(void * arg)
+{
+  xTaskNotify(esp32_timer_task,1UL<<((intptr_t)arg+ESP32_TIMER_NEAR),eSetBits);
+}
+
+static void esp32_alarm_stop(int timer,bool fired)
+{
+  if (esp32_timers[timer]) esp_timer_stop(esp32_timers[timer]); // Fails harmlessly if it wasn't running
+  if (esp32_alarms[timer]) timerAlarmDisable(esp32_alarms[timer]);
+  esp32_alarms_near&=~(1UL<<timer);
+  if (!(esp32_alarms_set>>timer&1)) return;
+  // The interrupt's on this core so it's been and gone if it was due,
+  // and its bit mustn't be taken for the next alarm's
+  if (!fired && timerRead(esp32_alarms[timer])>=esp32_alarm_count[timer]) esp32_alarms_stale|=1UL<<timer;
+  esp32_alarms_set&=~(1UL<<timer);
+  if (esp32_alarm_lock) esp_pm_lock_release(esp32_alarm_lock);
+}
+
+static void esp32_alarm_set(int timer,int64_t now_us)
+{
+  if (!esp32_alarms[timer]) return;
+  if (!(esp32_alarms_set>>timer&1))
+  {
+    // Before the counter's read, so it's counting at full speed from here
+    if (esp32_alarm_lock) esp_pm_lock_acquire(esp32_alarm_lock);
+    esp32_alarms_set|=1UL<<timer;
+  }
+  int64_t delay_us=esp32_alarm_at[timer]-now_us;
+  if (delay_us<1) delay_us=1;
+  esp32_alarm_count[timer]=timerRead(esp32_alarms[timer])+delay_us;
+  timerAlarmWrite(esp32_alarms[timer],esp32_alarm_count[timer],false);
+  timerAlarmEnable(esp32_alarms[timer]);
+}
+
+static void esp32_run_timers(void * arg)
+{
+  // The interrupts go to the core that attaches them
+  for (int timer=0;timer<HAL_TIMER_COUNT;timer++)
+  {
+    esp32_alarms[timer]=timerBegin(ESP32_TIMER_FIRST+timer,ESP32_TIMER_DIVIDER,true);
+    if (esp32_alarms[timer]) timerAttachInterrupt(esp32_alarms[timer],esp32_alarm_isrs[timer],false);
+  }
+  esp32_hal & hal=*(esp32_hal *)arg;
+  while (true)
+  {
+    uint32_t fired=0;
+    xTaskNotifyWait(0,UINT32_MAX,&fired,portMAX_DELAY);
+    for (int timer=0;timer<HAL_TIMER_COUNT;timer++)
+    {
+      if ((fired>>(timer+ESP32_TIMER_NEAR))&1 && (esp32_alarms_near>>timer)&1)
+      {
+        esp32_alarms_near&=~(1UL<<timer);
+        esp32_alarm_set(timer,hal.micros());
+      }
+      bool alarm=(fired>>timer)&1;
+      if (alarm && (esp32_alarms_stale>>timer)&1)
+      {
+        esp32_alarms_stale&=~(1UL<<timer);
+        alarm=false;
+      }
+      if (!alarm && !((fired>>(timer+ESP32_TIMER_POSTED))&1)) continue;
+      if (alarm) esp32_alarm_stop(timer,true); // Lets go of the lock, a post leaves the alarm be
+      timer_listener * listener=esp32_timer_listeners[timer];
+      if (listener) listener->on_timer((hal_timer)timer);
+    }
+    esp32_wake_loop();
+  }
+}
+#else
+// An expiry or a timer_post() sets the timer's bit in the timer task's
+// notification value, and the task calls the listener
+static void esp32_run_timers(void * arg)
+{
+  while (true)
+  {
+    uint32_t fired=0;
+    xTaskNotifyWait(0,UINT32_MAX,&fired,portMAX_DELAY);
+    for (int timer=0;timer<HAL_TIMER_COUNT;timer++)
+    {
+      timer_listener * listener=esp32_timer_listeners[timer];
+      if ((fired>>timer)&1 && listener) listener->on_timer((hal_timer)timer);
+    }
+    esp32_wake_loop();
+  }
+}
+
+#ifdef CONFIG_ESP_TIMER_SUPPORTS_ISR_DISPATCH_METHOD
+static void IRAM_ATTR esp32_on_timer(void * arg)
+{
+  BaseType_t woken=pdFALSE;
+  xTaskNotifyFromISR(esp32_timer_task,1UL<<(intptr_t)arg,eSetBits,&woken);
+  if (woken) esp_timer_isr_dispatch_need_yield();
+}
+#else
+static void esp32_on_timer(void * arg)
+{
+  // From esp_timer's task, which the WiFi task can hold up
+  xTaskNotify(esp32_timer_task,1UL<<(intptr_t)arg,eSetBits);
+}
+#endif
+#endif
+
+
+void esp32_hal::begin()
+{
+  #ifdef ENABLE_ULP_STIM
+  if (esp32_ulp_slept && esp_reset_reason()==ESP_RST_DEEPSLEEP)
+  {
+    uint64_t ticks=rtc_time_get()-esp32_slept_ticks;
+    esp32_micros_base=esp32_slept_us+(int64_t)rtc_time_slowclk_to_us(ticks,esp32_slept_cal)-esp_timer_get_time();
+    esp32_ulp_woke=true;
+    esp32_ulp_has_motor=true;
+  }
+  esp32_ulp_slept=false;
+  #endif
+  Serial.begin(115200);
+  setCpuFrequencyMhz(80);// Slow down the cores to save a little juice
+  xTaskCreatePinnedToCore(esp32_log_drain,"log",4096,this,tskIDLE_PRIORITY,&esp32_log_task,xPortGetCoreID());
+  xTaskCreatePinnedToCore(esp32_run_timers,"timers",ESP32_TIMER_STACK,this,ESP32_TIMER_PRIORITY,&esp32_timer_task,ESP32_TIMER_CORE);
+
+  if (!esp32_ulp_has_motor)
+  {
+    pinMode(PIN_VIBRATION,OUTPUT);
+    digitalWrite(PIN_VIBRATION,VIBE_STOPPED);
+  }
+  pinMode(PIN_LED,OUTPUT);
+  pinMode(PIN_FRONT_BUTTON,INPUT);
+  #ifdef PIN_SIDE_BUTTON
+  pinMode(PIN_SIDE_BUTTON,INPUT);
+  #endif
+
+  preferences.begin("altanx"); // Load the preferences
+
+  // Set up pwm
+  ledcSetup(PWM_CHANNEL,PWM_FREQ,PWM_RESOLUTION);
+  if (!esp32_ulp_has_motor) ledcAttachPin(PIN_VIBRATION,PWM_CHANNEL); // Else the first motor write
+  ledcWrite(PWM_CHANNEL,0);
+  ledc_fade_func_install(0); // For motor_fade()
+
+  #ifdef PIN_BATTERY
+  pinMode(PIN_ADC_ENABLE,OUTPUT);
+  digitalWrite(PIN_ADC_ENABLE,LOW); // The divider only draws while sampling
+  #endif
+
+  // Events that end wait_event()
+  esp32_loop_task=xTaskGetCurrentTaskHandle();
+  esp32_watch_button(PIN_FRONT_BUTTON,esp32_on_front_edge);
+  #ifdef PIN_SIDE_BUTTON
+  esp32_watch_button(PIN_SIDE_BUTTON,esp32_on_side_edge);
+  #endif
+  esp_sleep_enable_gpio_wakeup();
+
+  // Automatic light sleep whenever every task is blocked. Needs
+  // CONFIG_PM_ENABLE and CONFIG_FREERTOS_USE_TICKLESS_IDLE in the sdkconfig,
+  // without them we still get far fewer wake ups, just no light sleep
+  #ifdef CONFIG_PM_ENABLE
+  esp_pm_config_esp32_t pm_config={};
+  pm_config.max_freq_mhz=80;
+  pm_config.min_freq_mhz=40;
+  pm_config.light_sleep_enable=true;
+  esp_err_t result=esp_pm_configure(&pm_config);
+  if (result!=ESP_OK) log(LOG_LEVEL_WARN,"esp_pm_configure: %s\n",esp_err_to_name(result));
+  esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP,0,"motor",&esp32_motor_lock);
+  #ifdef ENABLE_HW_TIMER_EDGES
+  esp_pm_lock_create(ESP_PM_APB_FREQ_MAX,0,"alarm",&esp32_alarm_lock);
+  #endif
+  #endif
+}
+
+uint32_t esp32_hal::millis()
+{
+  return (uint32_t)(micros()/1000);
+}
+
+int64_t esp32_hal::micros()
+{
+  return esp_timer_get_time()+esp32_micros_base;
+}
+
+uint32_t esp32_hal::cpu_cycles()
+{
+  return ESP.getCycleCount();
+}
+
+uint32_t esp32_hal::cpu_mhz()
+{
+  return getCpuFrequencyMhz();
+}
+
+void esp32_hal::delay_ms(uint32_t ms)
+{
+  esp32_kick_log(*this);
+  yield();
+  if (ms<100)
+  {
+    delay(ms);
+  } else {
+    uint32_t remaining=ms;
+    while (true)
+    {
+      if (remaining<100)
+      {
+        delay(remaining);
+        break;
+      } else {
+        delay(50);
+        yield();
+        remaining-=50;
+      }
+    }
+  }
+}
+
+void esp32_hal::wait_event(uint32_t timeout_ms)
+{
+  esp32_kick_log(*this);
+  // Clears the count so a burst of events only costs one extra loop
+  ulTaskNotifyTake(pdTRUE,pdMS_TO_TICKS(timeout_ms));
+}
+
+void esp32_hal::timer_arm(hal_timer timer,int64_t at_us,timer_listener * listener)
+{
+  // Timer task only, as are the listeners that call it
+  if (!esp32_timers[timer])
+  {
+    esp_timer_create_args_t args={};
+    #ifdef ENABLE_HW_TIMER_EDGES
+    args.callback=esp32_on_near;
+    args.dispatch_method=ESP_TIMER_TASK;
+    #else
+    args.callback=esp32_on_timer;
+    #ifdef CONFIG_ESP_TIMER_SUPPORTS_ISR_DISPATCH_METHOD
+    args.dispatch_method=ESP_TIMER_ISR;
+    #else
+    args.dispatch_method=ESP_TIMER_TASK;
+    #endif
+    #endif
+    args.arg=(void *)(intptr_t)timer;
+    args.name="altanx";
+    if (esp_timer_create(&args,&esp32_timers[timer])!=ESP_OK) return;
+  }
+  esp32_timer_listeners[timer]=listener;
+  #ifdef ENABLE_HW_TIMER_EDGES
+  esp32_alarm_stop(timer,false);
+  esp32_alarm_at[timer]=at_us;
+  int64_t now=micros();
+  if (at_us-now>ESP32_TIMER_LEAD_US)
+  {
+    esp32_alarms_near|=1UL<<timer;
+    esp_timer_start_once(esp32_timers[timer],at_us-now-ESP32_TIMER_LEAD_US);
+  }
+  else esp32_alarm_set(timer,now);
+  #else
+  esp_timer_stop(esp32_timers[timer]); // Fails harmlessly if it wasn't running
+  int64_t delay_us=at_us-micros();
+  if (delay_us<0) delay_us=0;
+  esp_timer_start_once(esp32_timers[timer],delay_us);
+  #endif
+}
+
+void esp32_hal::timer_cancel(hal_timer timer)
+{
+  #ifdef ENABLE_HW_TIMER_EDGES
+  esp32_alarm_stop(timer,false);
+  #else
+  if (esp32_timers[timer]) esp_timer_stop(esp32_timers[timer]);
+  #endif
+}
+
+void esp32_hal::timer_post(hal_timer timer,timer_listener * listener)
+{
+  esp32_timer_listeners[timer]=listener;
+  #ifdef ENABLE_HW_TIMER_EDGES
+  if (esp32_timer_task) xTaskNotify(esp32_timer_task,1UL<<(timer+ESP32_TIMER_POSTED),eSetBits);
+  #else
+  if (esp32_timer_task) xTaskNotify(esp32_timer_task,1UL<<timer,eSetBits);
+  #endif
+}
+
+void esp32_hal::motor_write(uint8_t duty)
+{
+  esp32_take_motor();
+  // Keep the PWM clock running for as long as the motor is on
+  if (esp32_motor_lock && duty && !esp32_motor_locked)
+  {
+    esp_pm_lock_acquire(esp32_motor_lock);
+    esp32_motor_locked=true;
+  }
+  ledcWrite(PWM_CHANNEL,duty); // Also ends any fade
+  if (esp32_motor_lock && !duty && esp32_motor_locked)
+  {
+    esp_pm_lock_release(esp32_motor_lock);
+    esp32_motor_locked=false;
+  }
+}
+
+void esp32_hal::motor_fade(uint8_t duty,uint32_t ramp_ms)
+{
+  // Arduino puts channels 0-7 in high speed mode. The clock stays locked
+  // through a fade down to 0, the motor_write(0) at the window's end lets go
+  esp32_take_motor();
+  if (esp32_motor_lock && !esp32_motor_locked)
+  {
+    esp_pm_lock_acquire(esp32_motor_lock);
+    esp32_motor_locked=true;
+  }
+  ledc_set_fade_with_time(LEDC_HIGH_SPEED_MODE,(ledc_channel_t)PWM_CHANNEL,duty,ramp_ms);
+  ledc_fade_start(LEDC_HIGH_SPEED_MODE,(ledc_channel_t)PWM_CHANNEL,LEDC_FADE_NO_WAIT);
+}
+
+void esp32_hal::led_write(bool level)
+{
+  digitalWrite(PIN_LED,level);
+}
+
+bool esp32_hal::button_pressed(hal_button button)
+{
+  if (button==BUTTON_SIDE)
+  {
+    #ifdef PIN_SIDE_BUTTON
+    return digitalRead(PIN_SIDE_BUTTON)==PRESSED;
+    #else
+    return false;
+    #endif
+  }
+  return digitalRead(PIN_FRONT_BUTTON)==PRESSED;
+}
+
+bool esp32_hal::button_next_edge(hal_button_edge & edge)
+{
+  uint8_t tail=esp32_edge_tail;
+  if (tail==esp32_edge_head) return false;
+  edge=esp32_edges[tail%ESP32_EDGE_RING];
+  esp32_edge_tail=tail+1;
+  return true;
+}
+
+void esp32_hal::radio_set_listener(radio_listener * listener)
+{
+  esp32_listener=listener;
+}
+
+bool esp32_hal::radio_start()
+{
+  // Set device as a Wi-Fi Station
+  WiFi.mode(WIFI_STA);
+  // Init ESP-NOW
+  if (esp_now_init() != ESP_OK) return false;
+  esp_now_register_send_cb(esp32_on_sent);
+  esp_now_register_recv_cb(esp32_on_recv);
+  wifi_promiscuous_filter_t filter={WIFI_PROMIS_FILTER_MASK_MGMT};
+  esp_wifi_set_promiscuous_filter(&filter);
+  esp_wifi_set_promiscuous_rx_cb(esp32_on_promiscuous);
+  esp_wifi_set_promiscuous(true);
+  return true;
+}
+
+void esp32_hal::radio_stop()
+{
+  WiFi.disconnect(true);
+  WiFi.mode(WIFI_OFF);
+}
+
+bool esp32_hal::radio_add_peer(const uint8_t * mac_addr)
+{
+  peerInfo.channel=0;
+  peerInfo.encrypt=false;
+  memcpy(peerInfo.peer_addr,mac_addr,6);
+  return esp_now_add_peer(&peerInfo)==ESP_OK;
+}
+
+bool esp32_hal::radio_send(const uint8_t * mac_addr,const uint8_t * data,size_t len)
+{
+  esp_err_t result=esp_now_send(mac_addr,data,len);
+  if (result!=ESP_OK)
+  {
+    log(LOG_LEVEL_WARN,"esp_now_send: %s\n",esp_err_to_name(result));
+  }
+  return result==ESP_OK;
+}
+
+void esp32_hal::radio_set_tx_power(uint8_t quarter_dbm)
+{
+  esp_err_t result=esp_wifi_set_max_tx_power((int8_t)quarter_dbm);
+  if (result!=ESP_OK) log(LOG_LEVEL_WARN,"esp_wifi_set_max_tx_power: %s\n",esp_err_to_name(result));
+}
+
+uint32_t esp32_hal::random32()
+{
+  return esp_random(); // True random once the radio has been on
+}
+
+bool esp32_hal::store_has(const char * key)
+{
+  return preferences.isKey(key);
+}
+
+size_t esp32_hal::store_read(const char * key,void * buffer,size_t len)
+{
+  return preferences.getBytes(key,buffer,len);
+}
+
+void esp32_hal::store_write(const char * key,const void * buffer,size_t len)
+{
+  preferences.putBytes(key,buffer,len);
+}
+
+size_t esp32_hal::rtc_read(void * buffer,size_t len)
+{
+  // After a reset RTC memory holds whatever the last run left, not what
+  // it put there before a sleep
+  if (esp_reset_reason()!=ESP_RST_DEEPSLEEP) return 0;
+  size_t n=esp32_rtc_len<len?esp32_rtc_len:len;
+  memcpy(buffer,esp32_rtc,n);
+  return n;
+}
+
+void esp32_hal::rtc_write(const void * buffer,size_t len)
+{
+  esp32_rtc_len=len<ESP32_RTC_BYTES?len:ESP32_RTC_BYTES;
+  memcpy(esp32_rtc,buffer,esp32_rtc_len);
+}
+
+void esp32_hal::display_init()
+{
+  #ifdef BOARD_TYPE_TDISPLAY
+  tft.init();
+  tft.setRotation(1);
+  #endif
+  //NB This will need fixing to work with the M5StickC again, not expecting to do that at the moment
+}
+
+void esp32_hal::display_fill(uint16_t colour)
+{
+  tft.fillScreen(colour);
+}
+
+void esp32_hal::display_rect(int16_t x,int16_t y,int16_t w,int16_t h,uint16_t colour)
+{
+  tft.drawRect(x,y,w,h,colour);
+}
+
+void esp32_hal::display_text(int16_t x,int16_t y,uint8_t size,uint16_t colour,const char * text)
+{
+  tft.setCursor(x,y);
+  tft.setTextSize(size);
+  tft.setTextColor(colour);
+  tft.print(text);
+}
+
+uint32_t esp32_hal::display_line(int16_t y,int16_t h,uint8_t size,uint16_t colour,uint16_t background,const char * text)
+{
+  if (!line_sprite.created() || line_sprite.height()!=h)
+  {
+    if (line_sprite.created()) line_sprite.deleteSprite();
+    line_sprite.setColorDepth(16);
+    line_sprite.createSprite(DISPLAY_WIDTH,h);
+  }
+  if (!line_sprite.created())
+  {
+    // Out of RAM, draw straight to the panel and put up with the flicker
+    tft.fillRect(0,y,DISPLAY_WIDTH,h,background);
+    display_text(0,y,size,colour,text);
+    return DISPLAY_WIDTH*h*2+strlen(text)*6*8*size*size*2;
+  }
+  line_sprite.fillSprite(background);
+  line_sprite.setCursor(0,0);
+  line_sprite.setTextSize(size);
+  line_sprite.setTextColor(colour);
+  line_sprite.print(text);
+  line_sprite.pushSprite(0,y);
+  return DISPLAY_WIDTH*h*2;
+}
+
+void esp32_hal::display_sleep()
+{
+  pinMode(PIN_BACKLIGHT,OUTPUT); //
+  digitalWrite(PIN_BACKLIGHT,LOW); // Should force backlight off
+  tft.writecommand(ST7789_DISPOFF);// Switch off the display
+  tft.writecommand(ST7789_SLPIN);// Sleep the display driver
+}
+
+static void esp32_settle_log(esp32_hal & hal)
+{
+  // Let the log task catch up, it's the only one that may drain
+  for (int i=0;i<50 && !hal.log_records.empty();i++)
+  {
+    esp32_kick_log(hal);
+    delay(10);
+  }
+  Serial.flush();
+}
+
+void esp32_hal::deep_sleep()
+{
+  if (esp32_ulp_has_motor) motor_write(0); // Still playing a ULP sleep's windows
+  esp32_settle_log(*this);
+  esp_sleep_enable_ext0_wakeup(WAKE_UP_PIN_DEFN,PRESSED);
+  esp_deep_sleep_start();
+}
+
+bool esp32_hal::ulp_sleep(const ulp_schedule & schedule)
+{
+  #ifdef ENABLE_ULP_STIM
+  gpio_num_t pin=(gpio_num_t)PIN_VIBRATION;
+  int io=rtc_io_number_get(pin);
+  uint32_t cal=rtc_clk_cal(RTC_CAL_RTC_MUX,ESP32_ULP_CAL_CYCLES); // 0 if it didn't tick
+  ulp_plan plan;
+  if (io<0 || !ulp_plan_for(schedule,micros(),cal,plan) || !esp32_ulp_load(io)) return false;
+  log(LOG_LEVEL_INFO,"ULP: %u windows of %u pulses from %lld ms, %u/%u/%u/%u+%u ticks of %u/%u us, worst start %lld us\n", \
+      (unsigned)plan.windows,(unsigned)plan.pulses,(long long)(plan.first_us/1000),(unsigned)plan.first_ticks, \
+      (unsigned)plan.on_ticks,(unsigned)plan.off_ticks,(unsigned)plan.gap_ticks,(unsigned)plan.gap_frac, \
+      (unsigned)cal,1U<<ULP_CAL_FRAC_BITS,(long long)ulp_plan_error_us(plan,schedule,micros(),cal));
+  esp32_settle_log(*this);
+  display_sleep();
+
+  // Nothing else may drive the motor now, the ULP has the pin from here
+  vTaskSuspend(esp32_timer_task);
+  for (int timer=0;timer<HAL_TIMER_COUNT;timer++) timer_cancel((hal_timer)timer);
+  ledcWrite(PWM_CHANNEL,0);
+  ledcDetachPin(PIN_VIBRATION);
+  if (esp32_motor_locked)
+  {
+    esp_pm_lock_release(esp32_motor_lock);
+    esp32_motor_locked=false;
+  }
+  rtc_gpio_init(pin);
+  rtc_gpio_set_direction(pin,RTC_GPIO_MODE_OUTPUT_ONLY);
+  rtc_gpio_set_level(pin,VIBE_STOPPED); // The program sets it for VIBRATING
+
+  esp_clk_slowclk_cal_set(cal); // The wake timer counts the same clock
+  esp_sleep_pd_config(ESP_PD_DOMAIN_RTC_PERIPH,ESP_PD_OPTION_ON);
+  esp_sleep_enable_ext0_wakeup(WAKE_UP_PIN_DEFN,PRESSED);
+  esp_sleep_enable_ulp_wakeup();
+  // Again now it's all but running, the first window must be from here
+  int64_t now=micros();
+  if (!ulp_plan_for(schedule,now,cal,plan)) plan.windows=0;
+  RTC_SLOW_MEM[ESP32_ULP_STATE]=0;
+  RTC_SLOW_MEM[ESP32_ULP_FRAC]=plan.gap_frac;
+  RTC_SLOW_MEM[ESP32_ULP_ACC]=ULP_ACC_START;
+  RTC_SLOW_MEM[ESP32_ULP_LEFT]=plan.windows;
+  RTC_SLOW_MEM[ESP32_ULP_PULSES]=plan.pulses;
+  RTC_SLOW_MEM[ESP32_ULP_PULSE]=plan.pulses;
+  esp32_ulp_periods(plan);
+  esp_sleep_enable_timer_wakeup(schedule.wake_us>now?schedule.wake_us-now:1);
+  esp32_slept_us=micros();
+  esp32_slept_ticks=rtc_time_get();
+  esp32_slept_cal=cal;
+  esp32_ulp_slept=true;
+  if (plan.windows) ulp_run(ESP32_ULP_PROGRAM);
+  esp_deep_sleep_start();
+  #endif
+  return false;
+}
+
+bool esp32_hal::ulp_available()
+{
+  #ifdef ENABLE_ULP_STIM
+  return rtc_io_number_get((gpio_num_t)PIN_VIBRATION)>=0; // The ULP can only drive an RTC pin
+  #else
+  return false;
+  #endif
+}
+
+hal_wakes esp32_hal::wake_cause()
+{
+  if (!esp32_ulp_woke) return WAKE_POWER_ON;
+  switch (esp_sleep_get_wakeup_cause())
+  {
+    case ESP_SLEEP_WAKEUP_EXT0:
+      return WAKE_BUTTON;
+    default:
+      return WAKE_TIMER;
+  }
+}
+
+uint32_t esp32_hal::battery_mv()
+{
+  #ifdef PIN_BATTERY
+  // About 1 ms all told, only ever called from loop()
+  digitalWrite(PIN_ADC_ENABLE,HIGH);
+  delayMicroseconds(100); // Divider settles
+  uint32_t total=0;
+  for (int i=0;i<BATTERY_OVERSAMPLE;i++) total+=analogReadMilliVolts(PIN_BATTERY); // Calibrated per chip
+  digitalWrite(PIN_ADC_ENABLE,LOW);
+  return total*BATTERY_DIVIDER/BATTERY_OVERSAMPLE;
+  #else
+  return 0; // The M5StickC's battery is behind its AXP192, not done yet
+  #endif
+}
+
+void esp32_hal::log_write(int64_t at_us,const char * text)
+{
+  // Printed some time after the event, so say when it was
+  Serial.printf("%8lu ",(unsigned long)(at_us/1000));
+  Serial.print(text);
+}
+
+int esp32_hal::serial_read()
+{
+  return Serial.available()?Serial.read():-1;
+}
+
+// #ifdef BOARD_TYPE_M5STICKC
+//     void M5_display_init()
+//     {
+//       M5.begin();
+//       M5.Lcd.setRotation(1);
+//       M5.Lcd.fillScreen(BLACK);
+//     }
+//     uint32_t M5_colour(uint8_t red,uint8_t green, uint8_t blue)
+//     {
+//       return red << 11 | green << 5 | blue;
+//     }
+
+//     void M5_draw_leader(bool is_leader)
+//     {
+//       int32_t width=is_leader?90:112;
+//       int32_t top_left_x=80-(width/2);
+//       int32_t top_left_y=0;
+
+//       M5.Lcd.fillRect(top_left_x,top_left_y,width,22,BLACK);
+//       M5.Lcd.drawRect(top_left_x,top_left_y,width,22,is_leader?GREEN:RED);
+//       M5.Lcd.setCursor(top_left_x+2,top_left_y+3);
+//       M5.Lcd.setTextSize(2);
+//       M5.Lcd.setTextColor(is_leader?RED:GREEN);
+//       M5.Lcd.print(is_leader?"Leading":"Following");
+
+//     }
+
+//     void M5_draw_sync(bool is_synced)
+//     {
+//       int32_t top_left_x=35;
+//       int32_t top_left_y=50;
+//       M5.Lcd.fillRect(top_left_x,top_left_y,90,22,BLACK);
+//       M5.Lcd.drawRect(top_left_x,top_left_y,90,22,is_synced?GREEN:RED);
+//       M5.Lcd.setCursor(top_left_x+2,top_left_y+3);
+//       M5.Lcd.setTextSize(2);
+//       M5.Lcd.setTextColor(is_synced?GREEN:RED);
+//       M5.Lcd.print(is_synced?"Synced":"Waiting");
+//     }
+
+// #endif
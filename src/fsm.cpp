@@ -0,0 +1,12 @@
+// (c) Ed French 2021
+
+#include "fsm.h"
+
+
+void fsm_timing::record(int64_t us)
+{
+  uint32_t took=us<0?0:(us>0xFFFFFFFF?0xFFFFFFFF:(uint32_t)us);
+  count++;
+  total_us=total_us+took<total_us?0xFFFFFFFF:total_us+took; // Stops at the top rather than wrapping
+  if (took>max_us) max_us=took;
+}
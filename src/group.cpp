@@ -0,0 +1,56 @@
+// (c) Ed French 2021
+
+#include <string.h>
+#include "group.h"
+#include "altanx.h"
+
+
+void peer_table::clear()
+{
+  memset(this,0,sizeof(*this));
+}
+
+int8_t peer_table::find(const uint8_t * mac)
+{
+  for (uint8_t i=0;i<count && i<GROUP_MAX_FOLLOWERS;i++)
+  {
+    if (memcmp(macs[i],mac,6)==0) return i;
+  }
+  return -1;
+}
+
+int8_t peer_table::add(const uint8_t * mac)
+{
+  int8_t index=find(mac);
+  if (index>=0) return index;
+  if (count>=GROUP_MAX_FOLLOWERS) return -1;
+  memcpy(macs[count],mac,6);
+  return count++;
+}
+
+void buzz_window(uint8_t slot,uint8_t slots,int64_t & start_us,int64_t & end_us)
+{
+  if (!slots) slots=1;
+  int64_t width_us=BUZZ_PERIOD_MS*1000LL/slots;
+  start_us=slot*width_us;
+  end_us=start_us+width_us-BUZZ_GAP_MS*1000LL;
+}
+
+int64_t resync_grid_after(int64_t leader_us,int64_t epoch_us)
+{
+  int64_t step_us=RESYNC_MIN_INTERVAL_MS*1000LL;
+  int64_t since=leader_us-epoch_us;
+  int64_t steps=since/step_us;
+  if (since>0 && since%step_us) steps++;
+  return epoch_us+steps*step_us;
+}
+
+int64_t group_resync_after(int64_t window_us,int64_t interval_us,int64_t epoch_us)
+{
+  int64_t gap_us=RESYNC_MIN_INTERVAL_MS*1000LL;
+  while (gap_us*2<=interval_us) gap_us*=2;
+  int64_t since=window_us-epoch_us;
+  int64_t gaps=since/gap_us;
+  if (since<0 && since%gap_us) gaps--;
+  return epoch_us+(gaps+1)*gap_us;
+}
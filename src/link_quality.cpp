@@ -0,0 +1,173 @@
+// (c) Ed French 2021
+
+#include <stdio.h>
+#include <string.h>
+#include "link_quality.h"
+
+static const uint8_t link_broadcast[]={0xFF,0xFF,0xFF,0xFF,0xFF,0xFF};
+
+
+link_peer * link_quality::peer(const uint8_t * mac_addr)
+{
+  for (uint8_t i=0;i<peer_count;i++)
+  {
+    if (memcmp(peers[i].mac,mac_addr,6)==0) return &peers[i];
+  }
+  if (peer_count>=LINK_PEERS) return NULL;
+  link_peer & added=peers[peer_count++];
+  memcpy(added.mac,mac_addr,6);
+  return &added;
+}
+
+void link_quality::sending(const uint8_t * mac_addr)
+{
+  last_sent_ms=hal.millis();
+  link_peer * to=peer(mac_addr);
+  if (to) to->sent++;
+  else untracked++;
+  if (in_flight_count>=LINK_IN_FLIGHT)
+  {
+    // Callbacks that never came, forget the oldest
+    in_flight_first=(in_flight_first+1)%LINK_IN_FLIGHT;
+    in_flight_count--;
+  }
+  send & waiting=in_flight[(in_flight_first+in_flight_count)%LINK_IN_FLIGHT];
+  memcpy(waiting.mac,mac_addr,6);
+  waiting.at_us=hal.micros();
+  in_flight_count++;
+}
+
+void link_quality::heard(const uint8_t * mac_addr,int8_t rssi)
+{
+  last_heard_ms=hal.millis();
+  link_peer * from=peer(mac_addr);
+  if (!from) return;
+  from->heard_ms=last_heard_ms|1;
+  if (!rssi) return;
+  if (!from->rssi_count || rssi<from->rssi_min) from->rssi_min=rssi;
+  if (!from->rssi_count || rssi>from->rssi_max) from->rssi_max=rssi;
+  from->rssi_last=rssi;
+  from->rssi_total+=rssi;
+  from->rssi_count++;
+}
+
+void link_quality::radio_started()
+{
+  in_flight_count=0;
+  last_heard_ms=hal.millis();
+  last_sent_ms=0;
+}
+
+void link_quality::delivered(const uint8_t * mac_addr,bool success)
+{
+  // WiFi task: queue it and go, nothing in here may block or log
+  uint32_t at=head.load(std::memory_order_relaxed);
+  if (at-tail.load(std::memory_order_acquire)>=LINK_RESULTS)
+  {
+    lost_results.fetch_add(1,std::memory_order_relaxed);
+    return;
+  }
+  result & slot=results[at%LINK_RESULTS];
+  memcpy(slot.mac,mac_addr,6);
+  slot.success=success;
+  slot.at_us=hal.micros();
+  head.store(at+1,std::memory_order_release);
+}
+
+bool link_quality::poll()
+{
+  uint8_t was=power;
+  uint32_t at=tail.load(std::memory_order_relaxed);
+  while (at!=head.load(std::memory_order_acquire))
+  {
+    take(results[at%LINK_RESULTS]);
+    at++;
+    tail.store(at,std::memory_order_release);
+  }
+  uint32_t now=hal.millis();
+  if (floor>LINK_POWER_MIN && now-floor_set_ms>=LINK_FLOOR_HOLD_MS) floor=LINK_POWER_MIN;
+  if (last_sent_ms && now-last_sent_ms<LINK_SILENT_MS && now-last_heard_ms>=LINK_SILENT_MS && power<LINK_POWER_MAX)
+  {
+    LOG_DEBUG("Nothing heard for %u ms, transmit power up\n",(unsigned)(now-last_heard_ms));
+    raise(1);
+    last_heard_ms=now; // Another step if it's still quiet after as long again
+  }
+  return power!=was;
+}
+
+void link_quality::take(const result & sent)
+{
+  // Callbacks come in the order the frames went, so it's the oldest
+  // waiting for one to that peer
+  while (in_flight_count && memcmp(in_flight[in_flight_first].mac,sent.mac,6)!=0)
+  {
+    in_flight_first=(in_flight_first+1)%LINK_IN_FLIGHT;
+    in_flight_count--;
+  }
+  link_peer * to=peer(sent.mac);
+  if (in_flight_count)
+  {
+    int64_t took_us=sent.at_us-in_flight[in_flight_first].at_us;
+    in_flight_first=(in_flight_first+1)%LINK_IN_FLIGHT;
+    in_flight_count--;
+    uint8_t bucket=0;
+    for (int64_t limit=LINK_LATENCY_FIRST_US;took_us>=limit && bucket<LINK_LATENCY_BUCKETS-1;limit*=2) bucket++;
+    if (to) to->latency[bucket]++;
+  } else {
+    unmatched++;
+  }
+  if (memcmp(sent.mac,link_broadcast,6)==0) return;
+  if (!sent.success)
+  {
+    if (!to) return;
+    to->failed++;
+    if (!to->heard_ms || hal.millis()-to->heard_ms>=LINK_SILENT_MS) return; // Not listening, the silent rule has it
+    LOG_DEBUG("Unicast not acked at %u/4 dBm\n",(unsigned)power);
+    floor=power+LINK_POWER_STEP>LINK_POWER_MAX?LINK_POWER_MAX:power+LINK_POWER_STEP;
+    floor_set_ms=hal.millis();
+    raise(LINK_UP_STEPS);
+    return;
+  }
+  if (to) to->delivered++;
+  if (++run<LINK_DOWN_AFTER) return;
+  run=0;
+  if (power<floor+LINK_POWER_STEP) return; // Would go under the floor
+  if (to && to->rssi_last && to->rssi_last<LINK_RSSI_FLOOR_DBM) return;
+  power-=LINK_POWER_STEP;
+  lowered++;
+  LOG_DEBUG("Transmit power down to %u/4 dBm\n",(unsigned)power);
+}
+
+void link_quality::raise(uint8_t steps)
+{
+  run=0;
+  uint32_t to=power+steps*LINK_POWER_STEP;
+  power=to>LINK_POWER_MAX?LINK_POWER_MAX:to;
+  raised++;
+}
+
+void link_quality::report()
+{
+  char line[192];
+  for (uint8_t i=0;i<peer_count;i++)
+  {
+    const link_peer & p=peers[i];
+    char rssi[48]="";
+    if (p.rssi_count) snprintf(rssi,sizeof(rssi)," rssi_mean=%d rssi_min=%d rssi_max=%d", \
+                               (int)(p.rssi_total/(int32_t)p.rssi_count),p.rssi_min,p.rssi_max);
+    char latency[LINK_LATENCY_BUCKETS*11]="";
+    size_t used=0;
+    for (uint8_t b=0;b<LINK_LATENCY_BUCKETS;b++)
+    {
+      used+=snprintf(latency+used,sizeof(latency)-used,"%s%lu",b?"/":"",(unsigned long)p.latency[b]);
+    }
+    snprintf(line,sizeof(line),"LINK %02x:%02x:%02x:%02x:%02x:%02x sent=%lu delivered=%lu failed=%lu%s latency_us=%s\n", \
+             p.mac[0],p.mac[1],p.mac[2],p.mac[3],p.mac[4],p.mac[5], \
+             (unsigned long)p.sent,(unsigned long)p.delivered,(unsigned long)p.failed,rssi,latency);
+    hal.log_write(hal.micros(),line);
+  }
+  snprintf(line,sizeof(line),"LINK power_qdbm=%u raised=%lu lowered=%lu untracked=%lu unmatched=%lu lost=%lu\n", \
+           (unsigned)power,(unsigned long)raised,(unsigned long)lowered,(unsigned long)untracked, \
+           (unsigned long)unmatched,(unsigned long)lost_results.load(std::memory_order_relaxed));
+  hal.log_write(hal.micros(),line);
+}
@@ -0,0 +1,147 @@
+// (c) Ed French 2021
+
+#include <stdio.h>
+#include "log_ring.h"
+
+
+/*
+  Bounded queue after Dmitry Vyukov's. Each slot's sequence says what it's
+  waiting for: equal to a writer's position it's free for that writer,
+  one more than the reader's position it holds a record. Writers claim a
+  position by moving head on with a compare and swap, fill the slot, then
+  publish it by bumping its sequence. The reader hands the slot back a
+  whole lap on.
+*/
+
+log_ring::log_ring() : dropped(0),head(0),tail(0)
+{
+  for (uint32_t i=0;i<LOG_RING_SLOTS;i++) slots[i].sequence.store(i,std::memory_order_relaxed);
+}
+
+bool log_ring::push(int64_t at_us,uint8_t level,const char * format,const int64_t * args,uint8_t argc)
+{
+  uint32_t position=head.load(std::memory_order_relaxed);
+  slot * s;
+  while (true)
+  {
+    s=&slots[position&(LOG_RING_SLOTS-1)];
+    uint32_t sequence=s->sequence.load(std::memory_order_acquire);
+    int32_t lag=(int32_t)(sequence-position);
+    if (lag==0)
+    {
+      if (head.compare_exchange_weak(position,position+1,std::memory_order_relaxed)) break;
+    } else if (lag<0)
+    {
+      dropped.fetch_add(1,std::memory_order_relaxed);
+      return false;
+    } else {
+      position=head.load(std::memory_order_relaxed);
+    }
+  }
+  if (argc>LOG_MAX_ARGS) argc=LOG_MAX_ARGS;
+  s->record.at_us=at_us;
+  s->record.format=format;
+  s->record.level=level;
+  s->record.argc=argc;
+  for (uint8_t i=0;i<argc;i++) s->record.args[i]=args[i];
+  s->sequence.store(position+1,std::memory_order_release);
+  return true;
+}
+
+bool log_ring::pop(log_record & record)
+{
+  uint32_t position=tail.load(std::memory_order_relaxed);
+  slot & s=slots[position&(LOG_RING_SLOTS-1)];
+  if (s.sequence.load(std::memory_order_acquire)!=position+1) return false;
+  record=s.record;
+  s.sequence.store(position+LOG_RING_SLOTS,std::memory_order_release);
+  tail.store(position+1,std::memory_order_release);
+  return true;
+}
+
+bool log_ring::empty()
+{
+  uint32_t position=tail.load(std::memory_order_acquire);
+  return slots[position&(LOG_RING_SLOTS-1)].sequence.load(std::memory_order_acquire)!=position+1;
+}
+
+size_t log_format(const log_record & record,char * out,size_t size)
+{
+  // Walks the format and hands each conversion to snprintf with its
+  // argument cast back to the right type
+  size_t len=0;
+  uint8_t arg=0;
+  const char * p=record.format;
+  while (*p && len+1<size)
+  {
+    if (*p!='%')
+    {
+      out[len++]=*p++;
+      continue;
+    }
+    if (p[1]=='%')
+    {
+      out[len++]='%';
+      p+=2;
+      continue;
+    }
+    char spec[16];
+    size_t n=0;
+    spec[n++]=*p++;
+    while (*p && strchr("-+ #0123456789.",*p) && n<sizeof(spec)-4) spec[n++]=*p++;
+    while (*p && strchr("hlLqjzt",*p)) p++; // Length modifiers, see log_ring.h
+    char conversion=*p;
+    if (!conversion) break;
+    p++;
+    int64_t value=arg<record.argc?record.args[arg]:0;
+    arg++;
+    int written;
+    size_t room=size-len;
+    switch (conversion)
+    {
+      case 'd':
+      case 'i':
+        spec[n++]='l'; spec[n++]='l'; spec[n++]=conversion; spec[n]=0;
+        written=snprintf(out+len,room,spec,(long long)value);
+        break;
+      case 'u':
+      case 'x':
+      case 'X':
+      case 'o':
+        spec[n++]='l'; spec[n++]='l'; spec[n++]=conversion; spec[n]=0;
+        written=snprintf(out+len,room,spec,(unsigned long long)value);
+        break;
+      case 'c':
+        spec[n++]=conversion; spec[n]=0;
+        written=snprintf(out+len,room,spec,(int)value);
+        break;
+      case 's':
+        spec[n++]=conversion; spec[n]=0;
+        written=snprintf(out+len,room,spec,value?(const char *)(intptr_t)value:"(null)");
+        break;
+      case 'p':
+        spec[n++]=conversion; spec[n]=0;
+        written=snprintf(out+len,room,spec,(void *)(intptr_t)value);
+        break;
+      case 'f':
+      case 'e':
+      case 'g':
+      case 'E':
+      case 'G':
+      {
+        double d;
+        memcpy(&d,&value,sizeof(d));
+        spec[n++]=conversion; spec[n]=0;
+        written=snprintf(out+len,room,spec,d);
+        break;
+      }
+      default:
+        written=snprintf(out+len,room,"%%%c",conversion);
+        break;
+    }
+    if (written<0) break;
+    len+=(size_t)written<room?(size_t)written:room-1;
+  }
+  out[len]=0;
+  return len;
+}
@@ -0,0 +1,151 @@
+// (c) Ed French 2021
+
+#include "motor_scheduler.h"
+#include "altanx.h"
+#include "trace.h"
+
+
+static int64_t phase_of(int64_t t_us,int64_t epoch_us,int64_t period_us)
+{
+  // Always 0..period, even before the epoch
+  int64_t phase=(t_us-epoch_us)%period_us;
+  if (phase<0) phase+=period_us;
+  return phase;
+}
+
+bool motor_window_on(int64_t t_us,int64_t epoch_us,int64_t start_us,int64_t end_us,int64_t period_us)
+{
+  int64_t phase=phase_of(t_us,epoch_us,period_us);
+  return phase>=start_us && phase<end_us;
+}
+
+int64_t motor_next_edge(int64_t t_us,int64_t epoch_us,int64_t start_us,int64_t end_us,int64_t period_us)
+{
+  // First window edge strictly after t_us
+  int64_t phase=phase_of(t_us,epoch_us,period_us);
+  int64_t period_start=t_us-phase;
+  if (phase<start_us) return period_start+start_us;
+  if (phase<end_us) return period_start+end_us;
+  return period_start+period_us+start_us;
+}
+
+
+int64_t motor_next_step(int64_t t_us,int64_t epoch_us,int64_t start_us,int64_t end_us,int64_t period_us,const waveform & wave)
+{
+  int64_t phase=phase_of(t_us,epoch_us,period_us);
+  waveform_point point;
+  if (phase<start_us || phase>=end_us || !waveform_at(wave,phase-start_us,end_us-start_us,point))
+  {
+    return motor_next_edge(t_us,epoch_us,start_us,end_us,period_us);
+  }
+  return t_us-phase+start_us+point.end_us;
+}
+
+
+void motor_scheduler::start(int64_t epoch_us,uint8_t slot,uint8_t slots,waveform_ids wave)
+{
+  motor_command command;
+  command.run=true;
+  command.epoch_us=epoch_us;
+  buzz_window(slot,slots,command.window_start_us,command.window_end_us);
+  command.wave=&waveforms[wave];
+  if (!send(command)) return;
+  running=true;
+  this->epoch_us=epoch_us;
+  this->slot=slot;
+  this->slots=slots;
+  mean_duty=waveform_mean_duty(*command.wave,command.window_end_us-command.window_start_us,BUZZ_PERIOD_MS*1000LL);
+}
+
+void motor_scheduler::stop()
+{
+  motor_command command={false,0,0,0,&waveforms[WAVEFORM_SQUARE]};
+  if (send(command)) running=false;
+}
+
+bool motor_scheduler::send(const motor_command & command)
+{
+  uint32_t at=head.load(std::memory_order_relaxed);
+  if (at-tail.load(std::memory_order_acquire)>=MOTOR_COMMANDS) return false;
+  commands[at%MOTOR_COMMANDS]=command;
+  head.store(at+1,std::memory_order_release);
+  hal.timer_post(TIMER_MOTOR,this);
+  return true;
+}
+
+bool motor_scheduler::take()
+{
+  // Only the newest matters, it replaces whatever was running
+  uint32_t from=tail.load(std::memory_order_relaxed);
+  uint32_t to=head.load(std::memory_order_acquire);
+  if (from==to) return false;
+  active=commands[(to-1)%MOTOR_COMMANDS];
+  tail.store(to,std::memory_order_release);
+  return true;
+}
+
+void motor_scheduler::apply(int64_t t_us)
+{
+  // Whatever the waveform says for t_us. Started part way into a ramp (a
+  // late timer, or start() mid window) it fades over what's left of it
+  int64_t phase=phase_of(t_us,active.epoch_us,BUZZ_PERIOD_MS*1000LL);
+  int64_t window_us=active.window_end_us-active.window_start_us;
+  waveform_point point;
+  on=phase>=active.window_start_us && phase<active.window_end_us && \
+     waveform_at(*active.wave,phase-active.window_start_us,window_us,point);
+  if (!on)
+  {
+    drive(0);
+    return;
+  }
+  int64_t ramp_left_us=point.start_us+point.ramp_ms*1000LL-(phase-active.window_start_us);
+  drive(point.duty,ramp_left_us>0?(uint32_t)((ramp_left_us+999)/1000):0);
+}
+
+void motor_scheduler::arm_after(int64_t t_us)
+{
+  next_edge_us=motor_next_step(t_us,active.epoch_us,active.window_start_us,active.window_end_us,BUZZ_PERIOD_MS*1000LL,*active.wave);
+  hal.timer_arm(TIMER_MOTOR,next_edge_us,this);
+}
+
+void motor_scheduler::on_timer(hal_timer timer)
+{
+  int64_t now=hal.micros();
+  if (take())
+  {
+    // A new schedule from now, or none
+    if (!active.run)
+    {
+      hal.timer_cancel(TIMER_MOTOR);
+      on=false;
+      drive(0);
+      return;
+    }
+    apply(now);
+    arm_after(now);
+    return;
+  }
+  // Posted for a command an earlier call already took
+  if (!active.run || now<next_edge_us) return;
+
+  int64_t edge=next_edge_us;
+  edge_late.record(now-edge>UINT32_MAX?UINT32_MAX:(uint32_t)(now-edge));
+  int64_t following=motor_next_step(edge,active.epoch_us,active.window_start_us,active.window_end_us,BUZZ_PERIOD_MS*1000LL,*active.wave);
+  if (now>=following)
+  {
+    // Badly late, skip to wherever we should be now
+    late_edges++;
+    edge=now;
+  }
+  apply(edge);
+  edges++;
+  arm_after(edge);
+}
+
+void motor_scheduler::drive(uint8_t duty,uint32_t ramp_ms)
+{
+  if (ramp_ms && duty!=driven) hal.motor_fade(duty,ramp_ms);
+  else hal.motor_write(duty);
+  if (duty!=driven && trace) trace->record(TRACE_MOTOR,duty,0,ramp_ms);
+  driven=duty;
+}
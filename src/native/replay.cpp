@@ -0,0 +1,391 @@
+// (c) Ed French 2021
+
+/*
+          Trace replay
+          ============
+
+  sim --replay FILE runs one device against a trace dumped from a real one
+  (or saved from the simulator with --trace-out). The node boots with the
+  store as the trace's boot record found it, random32() and battery_mv()
+  give back the recorded values, and the recorded button edges, received
+  frames and send results are put back at the micros() they happened.
+  Nothing the node sends goes anywhere.
+
+  What the node does (frames sent, state changes, motor edges) is then
+  lined up against what the trace says the device did. The first place
+  they part is reported, along with how long each pairing state lasted in
+  the recording and in the replay.
+
+  Replay can only be faithful from boot. If the ring had wrapped before
+  the dump the early inputs are gone, which is reported, and the replay
+  will usually part from the recording early on.
+  A boot that carried on from a ULP sleep (ulp_stim.h) isn't replayed at
+  all, its clock and sync come from before the trace.
+
+*/
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+
+#define REPLAY_TAIL_US (5*1000000LL) // Keeps going this long after the last recorded event
+#define REPLAY_STEP_US 100000 // How often the node's trace is collected, well inside a ring's worth
+#define REPLAY_SLACK_US 2000 // Outputs this close to the recorded time count as on time
+#define REPLAY_LINE_CHARS 512
+
+static bool is_output(uint8_t kind)
+{
+  return kind==TRACE_TX || kind==TRACE_STATE || kind==TRACE_MOTOR;
+}
+
+static bool earlier(const trace_event * a,const trace_event * b)
+{
+  return a->at_us<b->at_us;
+}
+
+static bool close_enough(int64_t a,int64_t b)
+{
+  return a-b<=REPLAY_SLACK_US && b-a<=REPLAY_SLACK_US;
+}
+
+static bool same_output(const trace_event & a,const trace_event & b)
+{
+  if (a.kind!=b.kind || a.a!=b.a) return false;
+  if (a.kind==TRACE_STATE) return a.b==b.b;
+  if (a.kind!=TRACE_TX) return true;
+  if (memcmp(a.mac,b.mac,6)!=0) return false;
+  // Timestamps are never going to be to the microsecond
+  wire_message x,y;
+  if (wire_decode(a.data,a.len,x)!=WIRE_OK || wire_decode(b.data,b.len,y)!=WIRE_OK)
+  {
+    return a.len==b.len && memcmp(a.data,b.data,a.len)==0;
+  }
+  return x.type==y.type && x.seq==y.seq && x.session==y.session && \
+         close_enough(x.t1,y.t1) && close_enough(x.t2,y.t2) && \
+         close_enough(x.t3,y.t3) && close_enough(x.epoch,y.epoch);
+}
+
+// Runs the node and keeps what it does. The partner's frames echo this
+// node's timestamps back (t1 in a time reply or a group reply entry) and
+// the node checks them to the microsecond, so once the replay has sent a
+// timestamp a little off the recorded one, the recorded frames get the
+// replayed value instead
+class replay_outputs
+{
+  public:
+    replay_outputs(sim_node * node,const std::vector<const trace_event *> & recorded)
+      : node(node),recorded(recorded),buffer(TRACE_EVENTS+1) {}
+
+    void run_until(int64_t end_us)
+    {
+      // In steps, a long quiet spell could wrap the node's ring
+      while (node->world.now_us<end_us)
+      {
+        int64_t step_us=node->world.now_us+REPLAY_STEP_US;
+        node->world.run_until(step_us<end_us?step_us:end_us);
+        collect();
+      }
+    }
+
+    void echo(const trace_event & event,std::vector<uint8_t> & data)
+    {
+      data.assign(event.data,event.data+event.len);
+      wire_message message;
+      if (echoes.empty() || wire_decode(event.data,event.len,message)!=WIRE_OK) return;
+      bool changed=swap(message.t1) | swap(message.t2) | swap(message.t3) | swap(message.epoch);
+      for (uint8_t i=0;i<message.entry_count;i++) changed|=swap_low(message.entries[i].t1);
+      uint8_t frame[WIRE_MAX_FRAME];
+      size_t len=changed?wire_encode(message,frame,sizeof(frame)):0;
+      if (len) data.assign(frame,frame+len);
+    }
+
+    std::vector<trace_event> replayed;
+
+  private:
+    sim_node * node;
+    const std::vector<const trace_event *> & recorded;
+    std::vector<trace_event> buffer;
+    std::map<int64_t,int64_t> echoes; // Recorded timestamp to replayed
+    uint32_t seen=0;
+
+    void collect()
+    {
+      trace_recorder & trace=node->device->trace;
+      size_t n=trace.copy(buffer.data(),buffer.size(),seen);
+      seen=trace.recorded();
+      for (size_t i=0;i<n;i++)
+      {
+        if (!is_output(buffer[i].kind)) continue;
+        size_t index=replayed.size();
+        replayed.push_back(buffer[i]);
+        if (buffer[i].kind==TRACE_TX && index<recorded.size() && same_output(*recorded[index],buffer[i])) learn(*recorded[index],buffer[i]);
+      }
+    }
+
+    void learn(const trace_event & was,const trace_event & now)
+    {
+      wire_message x,y;
+      if (wire_decode(was.data,was.len,x)!=WIRE_OK || wire_decode(now.data,now.len,y)!=WIRE_OK) return;
+      if (x.t1!=y.t1) echoes[x.t1]=y.t1;
+      if (x.t2!=y.t2) echoes[x.t2]=y.t2;
+      if (x.t3!=y.t3) echoes[x.t3]=y.t3;
+      if (x.epoch!=y.epoch) echoes[x.epoch]=y.epoch;
+    }
+
+    bool swap(int64_t & value)
+    {
+      std::map<int64_t,int64_t>::iterator found=echoes.find(value);
+      if (!value || found==echoes.end()) return false;
+      value=found->second;
+      return true;
+    }
+
+    // A group reply entry only carries the bottom 32 bits of t1
+    bool swap_low(uint32_t & value)
+    {
+      for (std::map<int64_t,int64_t>::iterator i=echoes.begin();i!=echoes.end();++i)
+      {
+        if ((uint32_t)i->first!=value) continue;
+        value=(uint32_t)i->second;
+        return true;
+      }
+      return false;
+    }
+};
+
+static const char * state_name(uint8_t state)
+{
+  return state<DUMMY?state_names[state]:"?";
+}
+
+static void describe(const trace_event * event,char * out,size_t size)
+{
+  if (!event)
+  {
+    snprintf(out,size,"nothing");
+    return;
+  }
+  switch (event->kind)
+  {
+    case TRACE_TX:
+      snprintf(out,size,"TX %s at %.3f ms",wire_type_name(event->a),event->at_us/1000.0);
+      break;
+    case TRACE_STATE:
+      snprintf(out,size,"STATE %s->%s at %.3f ms",state_name(event->a),state_name(event->b),event->at_us/1000.0);
+      break;
+    default:
+      snprintf(out,size,"%s %u at %.3f ms",trace_kind_name(event->kind),(unsigned)event->a,event->at_us/1000.0);
+      break;
+  }
+}
+
+bool save_trace(sim_node * node,const char * path)
+{
+  FILE * file=fopen(path,"w");
+  if (!file) return false;
+  std::vector<trace_event> events(TRACE_EVENTS+1);
+  trace_recorder & trace=node->device->trace;
+  size_t n=trace.copy(events.data(),events.size());
+  fprintf(file,"TRACE_BEGIN events=%zu lost=%u\n",n,(unsigned)trace.lost);
+  char line[TRACE_LINE_CHARS];
+  for (size_t i=0;i<n;i++)
+  {
+    trace_format(events[i],line,sizeof(line));
+    fputs(line,file);
+  }
+  fputs("TRACE_END\n",file);
+  fclose(file);
+  return true;
+}
+
+static bool load_trace(const char * path,std::vector<trace_event> & events,uint32_t & lost)
+{
+  FILE * file=fopen(path,"r");
+  if (!file) return false;
+  char line[REPLAY_LINE_CHARS];
+  trace_event event;
+  while (fgets(line,sizeof(line),file))
+  {
+    const char * begin=strstr(line,"TRACE_BEGIN");
+    const char * count=begin?strstr(begin,"lost="):NULL;
+    if (count)
+    {
+      // A capture may hold several dumps, the last one wins
+      events.clear();
+      lost=(uint32_t)strtoul(count+5,NULL,10);
+    } else if (trace_parse(line,event)) {
+      events.push_back(event);
+    }
+  }
+  fclose(file);
+  return true;
+}
+
+int replay_trace(const char * path,bool verbose)
+{
+  std::vector<trace_event> recorded;
+  uint32_t lost=0;
+  if (!load_trace(path,recorded,lost))
+  {
+    fprintf(stderr,"Can't read %s\n",path);
+    return 1;
+  }
+  if (recorded.empty() || recorded[0].kind!=TRACE_BOOT)
+  {
+    fprintf(stderr,"No boot record in %s\n",path);
+    return 1;
+  }
+  const trace_event & boot=recorded[0];
+  if (boot.b && (boot.data[1]&TRACE_BOOT_ULP))
+  {
+    // Its clock didn't start at 0 and what it was synced to isn't in the trace
+    fprintf(stderr,"%s starts from a ULP sleep, only a boot from off or a fast wake replays\n",path);
+    return 1;
+  }
+
+  sim_world world(1);
+  world.verbose=verbose;
+  world.replaying=true;
+  sim_node * node=world.nodes[world.add_node(boot.a,0)];
+
+  if (boot.b)
+  {
+    // Put back what was in flash
+    t_sync_state state;
+    memset(&state,0,sizeof(state));
+    state.pairing_state=(pairing_states)boot.data[0];
+    memcpy(state.partner,boot.mac,6);
+    state.is_leader=boot.data[1]&TRACE_BOOT_LEADER;
+    state.buzz_enabled=boot.data[1]&TRACE_BOOT_BUZZ;
+    state.led_enabled=boot.data[1]&TRACE_BOOT_LED;
+    if (boot.len>=4+sizeof(state.group.macs))
+    {
+      state.group.count=boot.data[3];
+      memcpy(state.group.macs,boot.data+4,sizeof(state.group.macs));
+    }
+    state_store seed(*node);
+    seed.save(state);
+    // And RTC memory, if it woke from that
+    if (boot.data[1]&TRACE_BOOT_WAKE)
+    {
+      wake_cache cache(*node);
+      cache.save(state,seed,(int32_t)boot.value);
+    }
+  }
+
+  world.boot(node->index,0,boot.b && (boot.data[1]&TRACE_BOOT_WAKE));
+  if (boot.len>2) node->device->pair_expected=boot.data[2];
+  node->reset_metrics();
+
+  // Inputs go back in at the recorded time on the node's clock, which runs
+  // true here so it's the world time too
+  uint32_t inputs=0;
+  int64_t last_us=0;
+  std::vector<const trace_event *> recorded_outputs;
+  std::vector<const trace_event *> pending;
+  for (size_t i=1;i<recorded.size();i++)
+  {
+    const trace_event & event=recorded[i];
+    if (event.at_us>last_us) last_us=event.at_us;
+    if (is_output(event.kind)) recorded_outputs.push_back(&event);
+    else if (event.kind==TRACE_RANDOM) node->random_script.push_back(event.value);
+    else if (event.kind==TRACE_BATTERY) node->battery_script.push_back(event.value);
+    else pending.push_back(&event);
+    if (!is_output(event.kind)) inputs++;
+  }
+  std::stable_sort(pending.begin(),pending.end(),earlier);
+
+  replay_outputs outputs(node,recorded_outputs);
+  for (size_t i=0;i<pending.size();i++)
+  {
+    const trace_event & event=*pending[i];
+    // Up to just before it, so it goes in ahead of anything else at that time
+    outputs.run_until(node->world_time_for(event.at_us)-1);
+    sim_event input;
+    input.at_us=node->world_time_for(event.at_us);
+    input.node=node->index;
+    memcpy(input.mac,event.mac,6);
+    switch (event.kind)
+    {
+      case TRACE_BUTTON:
+        input.kind=EVENT_BUTTON;
+        input.button=(hal_button)event.a;
+        input.pressed=event.b;
+        break;
+      case TRACE_RX:
+        input.kind=EVENT_RX;
+        input.success=true;
+        input.rssi=(int8_t)event.a;
+        outputs.echo(event,input.data);
+        break;
+      case TRACE_SENT:
+        input.kind=EVENT_SEND_STATUS;
+        input.success=event.b;
+        break;
+      default:
+        continue;
+    }
+    world.schedule(input);
+  }
+  outputs.run_until(last_us+REPLAY_TAIL_US);
+  std::vector<trace_event> & replayed=outputs.replayed;
+
+  printf("replay file=%s leader=%u loaded=%u events=%zu lost=%u inputs=%u outputs=%zu replayed_outputs=%zu\n", \
+         path,(unsigned)boot.a,(unsigned)boot.b,recorded.size(),(unsigned)lost,(unsigned)inputs, \
+         recorded_outputs.size(),replayed.size());
+  if (lost) printf("replay incomplete=1 the first %u events were overwritten before the dump\n",(unsigned)lost);
+
+  // Output by output. The replay runs on past the end of the recording, so
+  // anything it does after that isn't held against it
+  size_t matched=0;
+  int64_t worst_skew_us=0;
+  bool diverged=false;
+  const trace_event * expected=NULL;
+  const trace_event * actual=NULL;
+  for (size_t i=0;!diverged;i++)
+  {
+    expected=i<recorded_outputs.size()?recorded_outputs[i]:NULL;
+    actual=i<replayed.size()?&replayed[i]:NULL;
+    if (!expected && (!actual || actual->at_us>last_us)) break;
+    int64_t skew_us=(expected && actual)?actual->at_us-expected->at_us:0;
+    if (skew_us<0) skew_us=-skew_us;
+    if (!expected || !actual || !same_output(*expected,*actual) || skew_us>REPLAY_SLACK_US)
+    {
+      diverged=true;
+      char want[64],got[64];
+      describe(expected,want,sizeof(want));
+      describe(actual,got,sizeof(got));
+      printf("divergence output=%zu recorded=\"%s\" replayed=\"%s\"\n",i,want,got);
+      break;
+    }
+    if (skew_us>worst_skew_us) worst_skew_us=skew_us;
+    matched++;
+  }
+  printf("replay matched=%zu worst_skew_us=%lld diverged=%u\n",matched,(long long)worst_skew_us,(unsigned)diverged);
+
+  // Where the time went, state by state
+  size_t k=0;
+  int64_t recorded_since=0;
+  int64_t replayed_since=0;
+  for (size_t i=0;i<recorded_outputs.size();i++)
+  {
+    const trace_event & event=*recorded_outputs[i];
+    if (event.kind!=TRACE_STATE) continue;
+    while (k<replayed.size() && replayed[k].kind!=TRACE_STATE) k++;
+    const trace_event * replay_event=k<replayed.size()?&replayed[k++]:NULL;
+    printf("state from=%s to=%s recorded_ms=%.3f in_state_ms=%.3f", \
+           state_name(event.a),state_name(event.b),event.at_us/1000.0,(event.at_us-recorded_since)/1000.0);
+    if (replay_event && same_output(event,*replay_event))
+    {
+      printf(" replayed_ms=%.3f replayed_in_state_ms=%.3f\n",replay_event->at_us/1000.0,(replay_event->at_us-replayed_since)/1000.0);
+      replayed_since=replay_event->at_us;
+    } else {
+      printf(" replayed_ms=none\n");
+    }
+    recorded_since=event.at_us;
+  }
+  return diverged?2:0;
+}
@@ -0,0 +1,796 @@
+// (c) Ed French 2021
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "sim.h"
+
+
+// The node being resumed, makecontext() can't portably pass a pointer
+static sim_node * running_node=NULL;
+
+static void sim_node_entry()
+{
+  // First time a node is resumed after boot it starts here, exactly like
+  // setup() followed by loop() forever
+  sim_node * node=running_node;
+  node->device->begin();
+  while (true)
+  {
+    node->device->loop_once();
+  }
+}
+
+
+sim_node::sim_node(sim_world & world,int index,bool is_leader,double ppm)
+  : world(world),index(index),is_leader(is_leader),ppm(ppm),stack(SIM_STACK_BYTES)
+{
+  // Espressif OUI then the node number
+  uint8_t base[]={0x24,0x0A,0xC4,0x00,0x00,0x00};
+  memcpy(mac,base,6);
+  mac[5]=(uint8_t)index;
+  log_enabled=world.verbose;
+  for (int i=0;i<HAL_TIMER_COUNT;i++)
+  {
+    timer_listeners[i]=NULL;
+    timer_generation[i]=0;
+  }
+  for (int i=0;i<HAL_BUTTON_COUNT;i++) button_down[i]=false;
+  adc_noise_state=0x9E3779B9u+index;
+  fade_state=0x85EBCA6Bu+index;
+  rc_state=0x27D4EB2Fu+index;
+}
+
+sim_node::~sim_node()
+{
+  delete device;
+}
+
+void sim_node::reset_metrics()
+{
+  metrics_since_us=world.now_us;
+  wakeups=0;
+  radio_on_since=world.now_us;
+  radio_on_us=0;
+  synced_at_us=-1;
+  asleep_at_us=-1;
+  packets_sent=0;
+  display_bytes=0;
+  store_writes=0;
+  motor_on_edges.clear();
+  account();
+  motor_duty_us=0;
+  ulp_asleep_us=0;
+}
+
+int64_t sim_node::radio_total_us()
+{
+  return radio_on_us+(radio_is_on?world.now_us-radio_on_since:0);
+}
+
+int64_t sim_node::ulp_asleep_total_us()
+{
+  return ulp_asleep_us+(state==NODE_ASLEEP && ulp_running?world.now_us-ulp_slept_at_us:0);
+}
+
+void sim_node::press(int64_t start_us,int64_t length_us)
+{
+  sim_press p={start_us,length_us};
+  presses.push_back(p);
+  // Both edges are interrupts on the device, and each one bounces a bit
+  sim_event edge;
+  edge.kind=EVENT_BUTTON;
+  edge.node=index;
+  edge.button=BUTTON_FRONT;
+  for (int bounce=0;bounce<3;bounce++)
+  {
+    edge.at_us=start_us+bounce*SIM_BOUNCE_US;
+    edge.pressed=(bounce%2)==0;
+    world.schedule(edge);
+    edge.at_us=start_us+length_us+bounce*SIM_BOUNCE_US;
+    edge.pressed=(bounce%2)!=0;
+    world.schedule(edge);
+  }
+}
+
+void sim_node::wake()
+{
+  // Kept until the next wait, as a task notification is on the device
+  if (state==NODE_WAITING && in_wait_event)
+  {
+    if (wake_us>world.now_us) wake_us=world.now_us;
+  } else {
+    wake_pending=true;
+  }
+}
+
+int64_t sim_node::local_us()
+{
+  return clock_at_us+(int64_t)((world.now_us-clock_from_us)*(1.0+ppm*1e-6));
+}
+
+int64_t sim_node::world_time_for(int64_t local)
+{
+  return clock_from_us+(int64_t)ceil((local-clock_at_us)/(1.0+ppm*1e-6));
+}
+
+void sim_node::park_until(int64_t world_wake_us)
+{
+  log_drain(); // Where the log task would get to run
+  wake_us=world_wake_us+busy_us;
+  busy_us=0;
+  state=NODE_WAITING;
+  swapcontext(&context,&world.scheduler_context);
+}
+
+void sim_node::busy(int64_t us)
+{
+  // Small costs are saved up rather than parking for every one of them
+  busy_us+=us;
+  if (busy_us>=1000) park_until(world.now_us);
+}
+
+uint32_t sim_node::millis()
+{
+  return (uint32_t)(local_us()/1000);
+}
+
+int64_t sim_node::micros()
+{
+  return local_us();
+}
+
+uint32_t sim_node::cpu_cycles()
+{
+  // The host's, the virtual clock only moves when the node parks
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  return (uint32_t)((uint64_t)now.tv_sec*1000000000ULL+now.tv_nsec);
+}
+
+uint32_t sim_node::cpu_mhz()
+{
+  return 1000; // Counting ns
+}
+
+void sim_node::delay_ms(uint32_t ms)
+{
+  park_until(world_time_for(local_us()+(int64_t)ms*1000));
+  wakeups++;
+}
+
+void sim_node::wait_event(uint32_t timeout_ms)
+{
+  if (wake_pending)
+  {
+    wake_pending=false;
+    park_until(world.now_us);
+    wakeups++;
+    return;
+  }
+  in_wait_event=true;
+  park_until(world_time_for(local_us()+(int64_t)timeout_ms*1000));
+  in_wait_event=false;
+  wakeups++;
+}
+
+void sim_node::timer_arm(hal_timer timer,int64_t at_us,timer_listener * listener)
+{
+  timer_listeners[timer]=listener;
+  sim_event event;
+  event.at_us=world_time_for(at_us);
+  if (event.at_us<world.now_us) event.at_us=world.now_us;
+  event.kind=EVENT_TIMER;
+  event.node=index;
+  event.timer=timer;
+  event.generation=++timer_generation[timer];
+  world.schedule(event);
+}
+
+void sim_node::timer_cancel(hal_timer timer)
+{
+  timer_generation[timer]++;
+}
+
+void sim_node::timer_post(hal_timer timer,timer_listener * listener)
+{
+  // Runs once this node parks, as the world only delivers between them.
+  // The same generation, so it doesn't knock out an expiry that's armed
+  timer_listeners[timer]=listener;
+  sim_event event;
+  event.at_us=world.now_us;
+  event.kind=EVENT_TIMER;
+  event.node=index;
+  event.timer=timer;
+  event.generation=timer_generation[timer];
+  world.schedule(event);
+}
+
+double sim_node::motor_level_at(int64_t t_us)
+{
+  if (t_us>=motor_ramp_start_us+motor_ramp_us) return motor_duty;
+  double done=(double)(t_us-motor_ramp_start_us)/motor_ramp_us;
+  return motor_from+(motor_duty-motor_from)*done;
+}
+
+double sim_node::load_ma()
+{
+  double motor_ma=SIM_MOTOR_MA*motor_level_at(world.now_us)/255;
+  if (state==NODE_ASLEEP || state==NODE_OFF) return SIM_SLEEP_MA+(ulp_running?SIM_ULP_MA:0)+motor_ma;
+  return SIM_AWAKE_MA+(radio_is_on?SIM_RADIO_MA:0)+motor_ma;
+}
+
+void sim_node::account()
+{
+  // Motor: trapezium along the ramp, rectangle after it
+  int64_t from=counted_to_us;
+  int64_t to=world.now_us;
+  if (to<=from) return;
+  double motor_us=0;
+  int64_t ramp_end=motor_ramp_start_us+motor_ramp_us;
+  if (from<ramp_end)
+  {
+    int64_t split=to<ramp_end?to:ramp_end;
+    motor_us+=(motor_level_at(from)+motor_level_at(split))/2/255*(split-from);
+    from=split;
+  }
+  if (to>from) motor_us+=motor_duty/255.0*(to-from);
+  motor_duty_us+=motor_us;
+
+  // Everything else is steady between calls
+  bool awake=state!=NODE_ASLEEP && state!=NODE_OFF;
+  double steady_ma=awake?SIM_AWAKE_MA+(radio_is_on?SIM_RADIO_MA:0):SIM_SLEEP_MA+(ulp_running?SIM_ULP_MA:0);
+  if (!on_usb) battery_mah-=(steady_ma*(to-counted_to_us)+SIM_MOTOR_MA*motor_us)/3.6e9;
+  if (battery_mah<0) battery_mah=0;
+  counted_to_us=to;
+}
+
+void sim_node::motor_write(uint8_t duty)
+{
+  take_motor();
+  set_motor(duty);
+}
+
+void sim_node::take_motor()
+{
+  // The ULP stops with the first motor write after its sleep
+  if (!ulp_running) return;
+  account();
+  ulp_running=false;
+  ulp_generation++;
+}
+
+void sim_node::set_motor(uint8_t duty)
+{
+  account();
+  if (duty && motor_level_at(world.now_us)==0) motor_on_edges.push_back(world.now_us);
+  motor_duty=duty;
+  motor_from=duty;
+  motor_ramp_us=0;
+}
+
+void sim_node::motor_fade(uint8_t duty,uint32_t ramp_ms)
+{
+  take_motor();
+  account();
+  double level=motor_level_at(world.now_us);
+  if (duty && level==0) motor_on_edges.push_back(world.now_us);
+  motor_from=(uint8_t)level;
+  motor_duty=duty;
+  motor_ramp_start_us=world.now_us;
+  motor_ramp_us=(int64_t)ramp_ms*1000;
+}
+
+void sim_node::led_write(bool level)
+{
+}
+
+bool sim_node::button_pressed(hal_button button)
+{
+  if (world.replaying) return button_down[button];
+  if (button!=BUTTON_FRONT) return false;
+  for (size_t i=0;i<presses.size();i++)
+  {
+    if (world.now_us>=presses[i].start_us && world.now_us<presses[i].start_us+presses[i].length_us) return true;
+  }
+  return false;
+}
+
+bool sim_node::button_next_edge(hal_button_edge & edge)
+{
+  if (button_edges.empty()) return false;
+  edge=button_edges.front();
+  button_edges.pop_front();
+  return true;
+}
+
+void sim_node::radio_set_listener(radio_listener * listener)
+{
+  this->listener=listener;
+}
+
+bool sim_node::radio_start()
+{
+  if (!radio_is_on)
+  {
+    radio_on_since=world.now_us;
+    tx_power_qdbm=LINK_POWER_MAX;
+    park_until(world.now_us+world.radio_start_us);
+    account();
+    radio_is_on=true;
+  }
+  return true;
+}
+
+void sim_node::radio_stop()
+{
+  if (radio_is_on)
+  {
+    account();
+    radio_on_us+=world.now_us-radio_on_since;
+    radio_is_on=false;
+  }
+}
+
+bool sim_node::radio_add_peer(const uint8_t * mac_addr)
+{
+  return true;
+}
+
+bool sim_node::radio_send(const uint8_t * mac_addr,const uint8_t * data,size_t len)
+{
+  if (!radio_is_on) return false;
+  packets_sent++;
+  world.transmit(this,mac_addr,data,len);
+  return true;
+}
+
+void sim_node::radio_set_tx_power(uint8_t quarter_dbm)
+{
+  tx_power_qdbm=quarter_dbm;
+}
+
+uint32_t sim_node::fade_random()
+{
+  fade_state^=fade_state<<13;
+  fade_state^=fade_state>>17;
+  fade_state^=fade_state<<5;
+  return fade_state;
+}
+
+uint32_t sim_node::random32()
+{
+  if (!random_script.empty())
+  {
+    uint32_t value=random_script.front();
+    random_script.pop_front();
+    return value;
+  }
+  return world.random();
+}
+
+bool sim_node::store_has(const char * key)
+{
+  return store.count(key)>0;
+}
+
+size_t sim_node::store_read(const char * key,void * buffer,size_t len)
+{
+  if (!store.count(key)) return 0;
+  std::vector<uint8_t> & value=store[key];
+  size_t n=value.size()<len?value.size():len;
+  memcpy(buffer,value.data(),n);
+  return n;
+}
+
+void sim_node::store_write(const char * key,const void * buffer,size_t len)
+{
+  const uint8_t * bytes=(const uint8_t *)buffer;
+  store_writes++;
+  store[key]=std::vector<uint8_t>(bytes,bytes+len);
+}
+
+size_t sim_node::rtc_read(void * buffer,size_t len)
+{
+  size_t n=rtc.size()<len?rtc.size():len;
+  memcpy(buffer,rtc.data(),n);
+  return n;
+}
+
+void sim_node::rtc_write(const void * buffer,size_t len)
+{
+  const uint8_t * bytes=(const uint8_t *)buffer;
+  rtc.assign(bytes,bytes+len);
+}
+
+void sim_node::display_init()
+{
+}
+
+// Display calls cost what the pixels would take to go over the SPI bus
+void sim_node::display_fill(uint16_t colour)
+{
+  uint32_t bytes=DISPLAY_WIDTH*DISPLAY_HEIGHT*2;
+  display_bytes+=bytes;
+  busy((int64_t)bytes*8*1000000/SIM_SPI_HZ);
+}
+
+void sim_node::display_rect(int16_t x,int16_t y,int16_t w,int16_t h,uint16_t colour)
+{
+  uint32_t bytes=(2*w+2*h)*2;
+  display_bytes+=bytes;
+  busy((int64_t)bytes*8*1000000/SIM_SPI_HZ);
+}
+
+void sim_node::display_text(int16_t x,int16_t y,uint8_t size,uint16_t colour,const char * text)
+{
+  uint32_t bytes=strlen(text)*6*8*size*size*2;
+  display_bytes+=bytes;
+  busy((int64_t)bytes*8*1000000/SIM_SPI_HZ);
+}
+
+uint32_t sim_node::display_line(int16_t y,int16_t h,uint8_t size,uint16_t colour,uint16_t background,const char * text)
+{
+  // The whole band goes over as one sprite push, the text is free
+  uint32_t bytes=DISPLAY_WIDTH*h*2;
+  display_bytes+=bytes;
+  busy((int64_t)bytes*8*1000000/SIM_SPI_HZ);
+  return bytes;
+}
+
+void sim_node::display_sleep()
+{
+}
+
+void sim_node::deep_sleep()
+{
+  radio_stop();
+  motor_write(0);
+  asleep_at_us=world.now_us;
+  account();
+  state=NODE_ASLEEP;
+  log_drain();
+  // Never resumed, a reboot starts a fresh context
+  swapcontext(&context,&world.scheduler_context);
+}
+
+bool sim_node::ulp_sleep(const ulp_schedule & schedule)
+{
+  if (!ulp_capable) return false;
+  // Calibrated exactly against the crystal, then the slow clock wanders
+  // off it for the length of the sleep
+  uint32_t cal=(uint32_t)(1e6/SIM_SLOW_CLOCK_HZ*(1UL<<ULP_CAL_FRAC_BITS)+0.5);
+  int64_t now_local=local_us();
+  ulp_plan plan;
+  if (!ulp_plan_for(schedule,now_local,cal,plan)) return false;
+  rc_state^=rc_state<<13;
+  rc_state^=rc_state>>17;
+  rc_state^=rc_state<<5;
+  double rc_error=((rc_state>>8)*(2.0/16777216.0)-1)*rc_ppm*1e-6;
+  log(LOG_LEVEL_DEBUG,"ULP: %u windows, worst start %lld us, slow clock off by %.1f ppm\n",(unsigned)plan.windows, \
+      (long long)ulp_plan_error_us(plan,schedule,now_local,cal),rc_error*1e6);
+
+  display_sleep();
+  radio_stop();
+  set_motor(0);
+  ulp=plan;
+  ulp_cal_tick_us=cal/(double)(1UL<<ULP_CAL_FRAC_BITS);
+  ulp_tick_us=ulp_cal_tick_us/(1.0+ppm*1e-6)*(1.0+rc_error);
+  ulp_started_us=world.now_us;
+  ulp_slept_at_us=world.now_us;
+  ulp_slept_local_us=now_local;
+  ulp_running=true;
+  ulp_generation++;
+  schedule_ulp_edge(0);
+  // The wake timer counts the same clock, in ticks as calibrated
+  sim_event wake;
+  int64_t ticks=(int64_t)((schedule.wake_us-now_local)/ulp_cal_tick_us);
+  wake.at_us=world.now_us+(int64_t)(ticks*ulp_tick_us);
+  wake.kind=EVENT_WAKE;
+  wake.node=index;
+  wake.generation=ulp_generation;
+  world.schedule(wake);
+
+  state=NODE_ASLEEP;
+  log_drain();
+  // Never resumed, the wake boots a fresh context
+  swapcontext(&context,&world.scheduler_context);
+  return false;
+}
+
+bool sim_node::ulp_available()
+{
+  return ulp_capable;
+}
+
+void sim_node::schedule_ulp_edge(uint32_t edge)
+{
+  int64_t start_us,end_us;
+  ulp_window_us(ulp,edge/2,ulp_tick_us,ULP_WAKE_US,start_us,end_us);
+  sim_event event;
+  event.at_us=ulp_started_us+(edge%2?end_us:start_us);
+  event.kind=EVENT_ULP;
+  event.node=index;
+  event.generation=ulp_generation;
+  event.edge=edge;
+  world.schedule(event);
+}
+
+void sim_node::ulp_edge(uint32_t edge)
+{
+  // A window's pulses as their mean, the motor can't tell at ULP_PWM_US
+  set_motor(edge%2?0:ulp_window_duty(ulp,ulp_tick_us,ULP_WAKE_US));
+  int64_t start_us,end_us;
+  if (ulp_window_us(ulp,(edge+1)/2,ulp_tick_us,ULP_WAKE_US,start_us,end_us))
+  {
+    schedule_ulp_edge(edge+1);
+    return;
+  }
+  // Played them all, it wakes the main cores if they're still asleep and stops
+  ulp_running=false;
+  ulp_generation++;
+  if (state==NODE_ASLEEP) world.ulp_wake(this,WAKE_TIMER);
+}
+
+hal_wakes sim_node::wake_cause()
+{
+  return woke_by;
+}
+
+uint32_t sim_node::battery_mv()
+{
+  account();
+  if (!battery_script.empty())
+  {
+    uint32_t mv=battery_script.front();
+    battery_script.pop_front();
+    return mv;
+  }
+  adc_noise_state^=adc_noise_state<<13;
+  adc_noise_state^=adc_noise_state>>17;
+  adc_noise_state^=adc_noise_state<<5;
+  int32_t noise=(int32_t)(adc_noise_state%(2*SIM_ADC_NOISE_MV+1))-SIM_ADC_NOISE_MV;
+  if (on_usb) return SIM_USB_MV+noise;
+  uint32_t mv=battery_curve_mv((uint16_t)(battery_mah*1000/SIM_BATTERY_MAH));
+  return mv-(uint32_t)(load_ma()*SIM_BATTERY_OHMS)+noise;
+}
+
+void sim_node::log_write(int64_t at_us,const char * text)
+{
+  printf("%10.3f %s %s",world_time_for(at_us)/1e6,is_leader?"L":"F",text);
+  if (text[0] && text[strlen(text)-1]!='\n') printf("\n");
+}
+
+int sim_node::serial_read()
+{
+  if (serial_input.empty()) return -1;
+  char c=serial_input.front();
+  serial_input.pop_front();
+  return c;
+}
+
+
+
+sim_world::sim_world(uint32_t seed)
+{
+  rng_state=seed?seed:1;
+}
+
+sim_world::~sim_world()
+{
+  for (size_t i=0;i<nodes.size();i++) delete nodes[i];
+}
+
+uint32_t sim_world::random()
+{
+  // xorshift32, deterministic for a given seed
+  rng_state^=rng_state<<13;
+  rng_state^=rng_state>>17;
+  rng_state^=rng_state<<5;
+  return rng_state;
+}
+
+double sim_world::random_unit()
+{
+  return random()/4294967296.0;
+}
+
+int sim_world::add_node(bool is_leader,double ppm)
+{
+  sim_node * node=new sim_node(*this,(int)nodes.size(),is_leader,ppm);
+  nodes.push_back(node);
+  return node->index;
+}
+
+void sim_world::boot(int index,int64_t at_us,bool from_sleep)
+{
+  sim_node * node=nodes[index];
+  node->radio_stop();
+  if (!from_sleep) node->rtc.clear();
+  delete node->device;
+  node->device=new altanx_device(*node,node->is_leader);
+  node->log_enabled=verbose;
+  node->listener=NULL;
+  for (int i=0;i<HAL_TIMER_COUNT;i++)
+  {
+    node->timer_listeners[i]=NULL;
+    node->timer_generation[i]++;
+  }
+  if (!from_sleep || !node->ulp_running) node->motor_write(0); // Else the ULP has it until the device takes over
+  node->busy_us=0;
+  node->in_wait_event=false;
+  node->wake_pending=false;
+  node->button_edges.clear();
+  for (int i=0;i<HAL_BUTTON_COUNT;i++) node->button_down[i]=false;
+  node->boot_us=at_us;
+  node->clock_from_us=at_us;
+  node->clock_at_us=0;
+  node->woke_by=WAKE_POWER_ON;
+  node->wake_us=at_us;
+  node->state=NODE_WAITING;
+
+  getcontext(&node->context);
+  node->context.uc_stack.ss_sp=node->stack.data();
+  node->context.uc_stack.ss_size=node->stack.size();
+  node->context.uc_link=&scheduler_context;
+  makecontext(&node->context,sim_node_entry,0);
+}
+
+void sim_world::ulp_wake(sim_node * node,hal_wakes cause)
+{
+  // micros() carries on by what the slow clock counted, as calibrated
+  int64_t ticks=(int64_t)((now_us-node->ulp_slept_at_us)/node->ulp_tick_us);
+  int64_t local=node->ulp_slept_local_us+(int64_t)(ticks*node->ulp_cal_tick_us);
+  int64_t boot_us=node->boot_us;
+  node->account();
+  node->ulp_asleep_us+=now_us-node->ulp_slept_at_us;
+  boot(node->index,now_us,true);
+  node->boot_us=boot_us;
+  node->clock_at_us=local;
+  node->woke_by=cause;
+}
+
+void sim_world::resume(sim_node * node)
+{
+  current=node;
+  running_node=node;
+  node->state=NODE_RUNNING;
+  swapcontext(&scheduler_context,&node->context);
+  current=NULL;
+  if (node->device && node->synced_at_us<0 && node->device->main_state.pairing_state==PAIRED_SYNCED)
+  {
+    node->synced_at_us=now_us;
+  }
+}
+
+void sim_world::run_until(int64_t end_us)
+{
+  while (true)
+  {
+    sim_node * next=NULL;
+    int64_t next_us=end_us;
+    for (size_t i=0;i<nodes.size();i++)
+    {
+      if (nodes[i]->state==NODE_WAITING && nodes[i]->wake_us<=next_us && (!next || nodes[i]->wake_us<next->wake_us))
+      {
+        next=nodes[i];
+        next_us=nodes[i]->wake_us;
+      }
+    }
+    if (!events.empty() && events.top().at_us<=next_us)
+    {
+      sim_event event=events.top();
+      events.pop();
+      now_us=event.at_us;
+      deliver(event);
+      continue;
+    }
+    if (!next)
+    {
+      now_us=end_us;
+      return;
+    }
+    now_us=next_us;
+    resume(next);
+  }
+}
+
+void sim_world::transmit(sim_node * from,const uint8_t * mac_addr,const uint8_t * data,size_t len)
+{
+  static const uint8_t broadcast[]={0xFF,0xFF,0xFF,0xFF,0xFF,0xFF};
+  bool is_broadcast=memcmp(mac_addr,broadcast,6)==0;
+  // 1 Mbit/s so a bit is a microsecond, plus the fixed MAC/PHY overhead
+  int64_t airtime_us=radio_base_latency_us+(int64_t)len*8;
+  int64_t arrive_us=now_us+airtime_us+(int64_t)(random_unit()*radio_jitter_us);
+  bool acked=false;
+  if (replaying) return; // The trace has what happened to it
+
+  for (size_t i=0;i<nodes.size();i++)
+  {
+    sim_node * to=nodes[i];
+    if (to==from) continue;
+    if (!is_broadcast && memcmp(mac_addr,to->mac,6)!=0) continue;
+    if (random_unit()<radio_loss) continue;
+    // Fade and the loss near the sensitivity come off the sender's own
+    // generator, so the world's sequence is the same at any power
+    int fade_db=(int)(from->fade_random()%(2*SIM_FADE_DB+1))-SIM_FADE_DB;
+    double rssi=from->tx_power_qdbm/4.0-path_loss_db+fade_db;
+    double lost=1.0/(1.0+exp((rssi-SIM_SENSITIVITY_DBM)/SIM_SENSITIVITY_SLOPE_DB));
+    if ((from->fade_random()>>8)*(1.0/16777216.0)<lost) continue;
+    if (to->state==NODE_OFF || to->state==NODE_ASLEEP || !to->radio_is_on) continue;
+    acked=true;
+    sim_event rx;
+    rx.at_us=arrive_us;
+    rx.kind=EVENT_RX;
+    rx.node=to->index;
+    memcpy(rx.mac,from->mac,6);
+    rx.success=true;
+    rx.rssi=(int8_t)(rssi<-127?-127:rssi);
+    rx.data.assign(data,data+len);
+    schedule(rx);
+  }
+
+  sim_event status;
+  status.at_us=arrive_us;
+  status.kind=EVENT_SEND_STATUS;
+  status.node=from->index;
+  memcpy(status.mac,mac_addr,6);
+  status.success=is_broadcast || acked;
+  schedule(status);
+}
+
+void sim_world::schedule(sim_event & event)
+{
+  event.sequence=event_sequence++;
+  events.push(event);
+}
+
+void sim_world::deliver(const sim_event & event)
+{
+  // Runs outside any node's context, like the ESP32 WiFi and esp_timer tasks
+  sim_node * node=nodes[event.node];
+  bool ulp_asleep=node->state==NODE_ASLEEP && node->ulp_running;
+  if (event.kind==EVENT_ULP)
+  {
+    if (node->ulp_running && event.generation==node->ulp_generation) node->ulp_edge(event.edge);
+    return;
+  }
+  if (event.kind==EVENT_WAKE)
+  {
+    if (ulp_asleep && event.generation==node->ulp_generation) ulp_wake(node,WAKE_TIMER);
+    return;
+  }
+  if (event.kind==EVENT_BUTTON && event.pressed && ulp_asleep)
+  {
+    ulp_wake(node,WAKE_BUTTON); // The new boot finds it held
+    return;
+  }
+  if (node->state==NODE_OFF || node->state==NODE_ASLEEP) return;
+  if (event.kind==EVENT_TIMER)
+  {
+    if (event.generation==node->timer_generation[event.timer] && node->timer_listeners[event.timer])
+    {
+      node->timer_listeners[event.timer]->on_timer(event.timer);
+      node->wake();
+    }
+    return;
+  }
+  if (event.kind==EVENT_BUTTON)
+  {
+    hal_button_edge edge={event.button,event.pressed,node->local_us()};
+    node->button_edges.push_back(edge);
+    node->button_down[event.button]=event.pressed;
+    node->wake();
+    return;
+  }
+  if (!node->radio_is_on || !node->listener) return;
+  if (event.kind==EVENT_RX)
+  {
+    node->listener->on_recv(event.mac,event.data.data(),(int)event.data.size(),event.rssi);
+  } else {
+    node->listener->on_sent(event.mac,event.success);
+  }
+  node->wake();
+}
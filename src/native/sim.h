@@ -0,0 +1,296 @@
+// (c) Ed French 2021
+
+/*
+          Host simulator
+          ==============
+
+  Runs one or more altanx_device state engines on a PC against a virtual
+  clock. Each simulated node gets its own green thread (ucontext) so the
+  blocking delays in the state engine just park that node until its wake
+  time, and a simple ESP-NOW medium carries packets between nodes with
+  airtime, jitter and loss.
+
+  Time only moves when every node is parked, so a 20 minute treatment runs
+  in well under a second and the results are repeatable for a given seed.
+
+*/
+
+#ifndef ALTANX_SIM_H
+#define ALTANX_SIM_H
+
+#include <stdint.h>
+#include <ucontext.h>
+#include <deque>
+#include <map>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "altanx.h"
+
+#define SIM_STACK_BYTES (256*1024)
+
+#define SIM_SPI_HZ 40000000 // TFT SPI clock on the T-Display
+#define SIM_BOUNCE_US 2000 // Contact bounce on each button edge
+
+// Battery model. The capacity is what gives BATTERY_FULL_MINUTES of
+// treatment at these currents
+#define SIM_BATTERY_MAH 270.0
+#define SIM_AWAKE_MA 45.0 // Light sleeping between loops, backlight on
+#define SIM_RADIO_MA 80.0
+#define SIM_MOTOR_MA 120.0 // At full duty
+#define SIM_SLEEP_MA 0.01
+#define SIM_ULP_MA 0.15 // On top, deep sleep with the RTC peripherals up and the ULP playing
+#define SIM_BATTERY_OHMS 0.3 // Internal resistance, the load pulls the reading down
+#define SIM_ADC_NOISE_MV 30 // Either way
+#define SIM_USB_MV 4700
+
+// Radio link. Two wrists under a metre apart lose about this much, so even
+// the lowest transmit power lands well above the sensitivity. A frame
+// comes in at the power it went at less the path loss, give or take the
+// fade, and goes missing on a logistic curve as that nears the sensitivity
+#define SIM_PATH_LOSS_DB 45.0
+#define SIM_SENSITIVITY_DBM -90.0 // ESP-NOW at 1 Mbit/s
+#define SIM_SENSITIVITY_SLOPE_DB 1.5 // Half lost at the sensitivity, 1 in 20 another 4.4 dB up
+#define SIM_FADE_DB 4 // Either way
+
+// ULP sleeps (ulp_stim.h). The slow clock is measured against the crystal
+// going in, then wanders off that by up to SIM_RC_PPM either way
+#define SIM_SLOW_CLOCK_HZ 150000
+#define SIM_RC_PPM 100
+
+class sim_world;
+
+enum sim_node_states
+{
+  NODE_OFF=0,
+  NODE_WAITING=1, // Parked in a delay until wake_us
+  NODE_RUNNING=2,
+  NODE_ASLEEP=3   // Deep sleep, only a reboot brings it back, or the ULP's wakes
+};
+
+struct sim_press
+{
+  int64_t start_us; // World time
+  int64_t length_us;
+};
+
+class sim_node : public altanx_hal
+{
+  public:
+    sim_node(sim_world & world,int index,bool is_leader,double ppm);
+    ~sim_node();
+
+    sim_world & world;
+    int index;
+    bool is_leader;
+    double ppm; // Crystal error, +ve runs fast
+    uint8_t mac[6];
+
+    altanx_device * device=NULL;
+
+    // Green thread
+    ucontext_t context;
+    std::vector<char> stack;
+    sim_node_states state=NODE_OFF;
+    int64_t boot_us=0; // Switched on, or woken by the session. Not by a ULP wake
+    int64_t clock_from_us=0; // local_us() is clock_at_us here, both from the boot
+    int64_t clock_at_us=0; // or carried through a ULP sleep
+    int64_t wake_us=0;
+    int64_t busy_us=0; // Time owed to SPI transfers etc, paid at the next park
+    bool in_wait_event=false; // Parked in wait_event(), any event wakes it
+    bool wake_pending=false; // An event while it wasn't, the next wait_event() returns at once
+
+    // Hardware models
+    std::map<std::string,std::vector<uint8_t> > store;
+    std::vector<uint8_t> rtc; // Kept when a boot is a wake from deep sleep
+    std::vector<sim_press> presses;
+    std::deque<hal_button_edge> button_edges;
+    bool button_down[HAL_BUTTON_COUNT]; // Follows the edges, only used in replay
+    std::deque<uint32_t> random_script; // random32() answers these first
+    std::deque<uint32_t> battery_script; // And battery_mv() these
+    std::deque<char> serial_input; // Typed at it, serial_read() gives these
+    radio_listener * listener=NULL;
+    timer_listener * timer_listeners[HAL_TIMER_COUNT];
+    uint32_t timer_generation[HAL_TIMER_COUNT]; // Bumped on cancel/re-arm so stale expiries are dropped
+    bool radio_is_on=false;
+    uint8_t motor_duty=0; // Where it's going, motor_fade() gets there over a ramp
+    uint8_t motor_from=0;
+    int64_t motor_ramp_start_us=0;
+    int64_t motor_ramp_us=0;
+
+    // Measurements, reset by reset_metrics()
+    int64_t metrics_since_us=0;
+    uint32_t wakeups=0; // Times the node came out of a delay or wait
+    int64_t radio_on_since=0;
+    int64_t radio_on_us=0;
+    int64_t synced_at_us=-1;
+    int64_t asleep_at_us=-1;
+    uint32_t packets_sent=0;
+    uint32_t display_bytes=0;
+    uint32_t store_writes=0; // Flash writes, each one wears the NVS sector
+    std::vector<int64_t> motor_on_edges; // World time of each off->on
+    double motor_duty_us=0; // Integral of duty/255 over time, what the motor drew
+    int64_t counted_to_us=0; // motor_duty_us and battery_mah are up to here
+
+    double battery_mah=SIM_BATTERY_MAH; // Left, not reset by a reboot
+    bool on_usb=false;
+    uint32_t adc_noise_state; // Own generator so noise doesn't move the world's
+    uint32_t fade_state; // Likewise for the radio's fade
+    uint8_t tx_power_qdbm=LINK_POWER_MAX; // radio_set_tx_power(), full again at each radio_start()
+
+    // ULP sleeps, see ulp_stim.h
+    bool ulp_capable=false; // sim --ulp, ulp_sleep() says no without it
+    double rc_ppm=SIM_RC_PPM; // Slow clock against its calibration, each sleep up to this either way
+    bool ulp_running=false; // Has the motor until the first motor_write() or motor_fade()
+    ulp_plan ulp;
+    int64_t ulp_started_us=0; // World time
+    double ulp_tick_us=0; // What its slow clock really ticks at, world us
+    double ulp_cal_tick_us=0; // And what it was calibrated at, local us
+    uint32_t ulp_generation=0; // Bumped each sleep and handover, so stale edges and wakes are dropped
+    int64_t ulp_slept_at_us=0; // World time
+    int64_t ulp_slept_local_us=0;
+    hal_wakes woke_by=WAKE_POWER_ON;
+    uint32_t rc_state; // Own generator, so the slow clock doesn't move the world's
+    int64_t ulp_asleep_us=0; // Measured, reset by reset_metrics()
+
+    void reset_metrics();
+    int64_t radio_total_us(); // radio_on_us including any stretch still running
+    int64_t ulp_asleep_total_us(); // Likewise ulp_asleep_us
+    void press(int64_t start_us,int64_t length_us); // World time
+    void wake(); // An event arrived, end wait_event() now
+    int64_t local_us(); // This node's idea of the time since boot
+    int64_t world_time_for(int64_t local); // Inverse of local_us()
+    void park_until(int64_t world_wake_us);
+    void busy(int64_t us);
+    double motor_level_at(int64_t t_us); // 0..255 along any ramp
+    double load_ma(); // What it's drawing now
+    void account(); // motor_duty_us and battery_mah up to now
+    uint32_t fade_random();
+    void set_motor(uint8_t duty); // motor_write() without taking the pin off the ULP
+    void take_motor();
+    void ulp_edge(uint32_t edge); // The ULP's doing, from the world
+    void schedule_ulp_edge(uint32_t edge);
+
+    // altanx_hal
+    uint32_t millis();
+    int64_t micros();
+    uint32_t cpu_cycles();
+    uint32_t cpu_mhz();
+    void delay_ms(uint32_t ms);
+    void wait_event(uint32_t timeout_ms);
+    void timer_arm(hal_timer timer,int64_t at_us,timer_listener * listener);
+    void timer_cancel(hal_timer timer);
+    void timer_post(hal_timer timer,timer_listener * listener);
+    void motor_write(uint8_t duty);
+    void motor_fade(uint8_t duty,uint32_t ramp_ms);
+    void led_write(bool level);
+    bool button_pressed(hal_button button);
+    bool button_next_edge(hal_button_edge & edge);
+    void radio_set_listener(radio_listener * listener);
+    bool radio_start();
+    void radio_stop();
+    bool radio_add_peer(const uint8_t * mac_addr);
+    bool radio_send(const uint8_t * mac_addr,const uint8_t * data,size_t len);
+    void radio_set_tx_power(uint8_t quarter_dbm);
+    uint32_t random32();
+    bool store_has(const char * key);
+    size_t store_read(const char * key,void * buffer,size_t len);
+    void store_write(const char * key,const void * buffer,size_t len);
+    size_t rtc_read(void * buffer,size_t len);
+    void rtc_write(const void * buffer,size_t len);
+    void display_init();
+    void display_fill(uint16_t colour);
+    void display_rect(int16_t x,int16_t y,int16_t w,int16_t h,uint16_t colour);
+    void display_text(int16_t x,int16_t y,uint8_t size,uint16_t colour,const char * text);
+    uint32_t display_line(int16_t y,int16_t h,uint8_t size,uint16_t colour,uint16_t background,const char * text);
+    void display_sleep();
+    void deep_sleep();
+    bool ulp_sleep(const ulp_schedule & schedule);
+    bool ulp_available();
+    hal_wakes wake_cause();
+    uint32_t battery_mv();
+    void log_write(int64_t at_us,const char * text);
+    int serial_read();
+};
+
+enum sim_event_kinds
+{
+  EVENT_RX=0,
+  EVENT_SEND_STATUS=1,
+  EVENT_TIMER=2,
+  EVENT_BUTTON=3,
+  EVENT_ULP=4, // A window starts or ends on the motor pin, generation is ulp_generation
+  EVENT_WAKE=5 // The wake timer of a ULP sleep, likewise
+};
+
+// Anything that happens to a node from outside its own thread
+struct sim_event
+{
+  int64_t at_us;
+  uint32_t sequence; // Keeps same-time events in the order they were made
+  sim_event_kinds kind;
+  int node;
+  uint8_t mac[6]; // Sender for rx, destination for send status
+  bool success;
+  int8_t rssi=0; // dBm for rx
+  hal_button button;
+  bool pressed;
+  hal_timer timer;
+  uint32_t generation;
+  uint32_t edge; // ULP
+  std::vector<uint8_t> data;
+
+  bool operator>(const sim_event & other) const
+  {
+    if (at_us!=other.at_us) return at_us>other.at_us;
+    return sequence>other.sequence;
+  }
+};
+
+class sim_world
+{
+  public:
+    sim_world(uint32_t seed);
+    ~sim_world();
+
+    int64_t now_us=0;
+    bool verbose=false;
+    bool replaying=false; // Frames sent go nowhere, the trace supplies what comes back
+
+    // Radio medium
+    int64_t radio_base_latency_us=500;
+    int64_t radio_jitter_us=500;
+    int64_t radio_start_us=60000; // WiFi.mode + esp_now_init
+    double radio_loss=0.0;
+    double path_loss_db=SIM_PATH_LOSS_DB;
+
+    std::vector<sim_node *> nodes;
+
+    int add_node(bool is_leader,double ppm);
+    void boot(int node,int64_t at_us,bool from_sleep=false); // Power on (or reset) a node, or wake it
+    void ulp_wake(sim_node * node,hal_wakes cause); // Now, out of a ULP sleep
+    void run_until(int64_t end_us);
+    void transmit(sim_node * from,const uint8_t * mac_addr,const uint8_t * data,size_t len);
+    void schedule(sim_event & event);
+
+    uint32_t random();
+    double random_unit(); // 0..1
+
+    ucontext_t scheduler_context;
+    sim_node * current=NULL;
+
+  private:
+    uint32_t rng_state;
+    uint32_t event_sequence=0;
+    std::priority_queue<sim_event,std::vector<sim_event>,std::greater<sim_event> > events;
+
+    void resume(sim_node * node);
+    void deliver(const sim_event & event);
+};
+
+// replay.cpp
+int replay_trace(const char * path,bool verbose);
+bool save_trace(sim_node * node,const char * path);
+
+#endif
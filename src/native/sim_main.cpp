@@ -0,0 +1,404 @@
+// (c) Ed French 2021
+
+/*
+          Session runner for the host simulator
+          =====================================
+
+  pio run -e native && .pio/build/native/program [options]
+
+    --mode pair|sync|treatment   What each session does (default pair)
+                                   pair:      two blank devices boot and pair
+                                   sync:      a paired couple is power cycled and resyncs
+                                   treatment: sync then run a treatment, measuring phase error
+    --sessions N                 Number of sessions (default 1000)
+    --seed N                     First seed, session i uses seed+i (default 1)
+    --loss P                     Packet loss probability 0..1 (default 0)
+    --path-loss DB               Radio path loss, the farther apart the more (default 45, under
+                                 a metre). Around 100 they start losing frames at full power
+    --ppm N                      Crystal error range +/-N ppm (default 20)
+    --minutes N                  Treatment length for --mode treatment (default 20)
+    --battery PCT                Charge left in each battery at the start (default 100)
+    --followers N                Followers in the group, 1 to GROUP_MAX_FOLLOWERS (default 1)
+    --wake                       sync and treatment: wake them from deep sleep, keeping RTC
+                                 memory (wake_cache.h), rather than power cycling them
+    --follower-lead S            Switch the followers on up to S seconds before the leader,
+                                 rather than up to 3 s after, so they wait in listen windows
+                                 (rendezvous.h)
+    --verbose                    Print the devices' serial output (use with --sessions 1)
+    --trace-out PREFIX           Save each device's trace (see trace.h) from the last session
+                                 to PREFIX-leader.trace and PREFIX-follower.trace (-follower2...
+                                 for a bigger group)
+    --replay FILE                Replay a trace instead, see replay.cpp
+    --bench                      Type 'b' at every device still on at the end of the last
+                                 session, for its BENCH lines (bench.h)
+    --ulp                        Let them sleep through a treatment with the ULP playing the
+                                 windows (ulp_stim.h). The energy meter starts again at each
+                                 wake, so energy_full_charge_min isn't given
+    --rc-ppm N                   With --ulp, the slow clock wanders up to +/-N ppm from its
+                                 calibration each sleep (default 100)
+
+  Output is one line per measurement as key=value pairs so it can be
+  diffed or scraped between builds. Follower figures cover every follower
+  in the group.
+
+*/
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sim.h"
+
+#define SESSION_TIMEOUT_US (180*1000000LL)
+#define MAX_BOOT_STAGGER_US (3*1000000LL)
+#define SETTLE_US (10*1000000LL) // Lets saves and show_message() finish after syncing
+#define BENCH_WAIT_US (30*1000000LL) // For an idle loop to come round to the serial input
+
+enum sim_modes
+{
+  MODE_PAIR,
+  MODE_SYNC,
+  MODE_TREATMENT
+};
+
+struct sim_options
+{
+  sim_modes mode=MODE_PAIR;
+  uint32_t sessions=1000;
+  uint32_t seed=1;
+  double loss=0.0;
+  double path_loss=SIM_PATH_LOSS_DB;
+  double ppm=20.0;
+  uint32_t minutes=20;
+  double battery=100.0;
+  uint32_t followers=1;
+  bool wake=false;
+  double follower_lead=0;
+  bool verbose=false;
+  const char * trace_out=NULL;
+  const char * replay=NULL;
+  bool bench=false;
+  bool ulp=false;
+  double rc_ppm=SIM_RC_PPM;
+};
+
+struct sim_stat
+{
+  sim_stat(const char * name) : name(name) {}
+  const char * name;
+  std::vector<double> samples;
+};
+
+static void print_stat(const char * role,sim_stat & stat)
+{
+  std::vector<double> & s=stat.samples;
+  if (s.empty())
+  {
+    printf("%s %s n=0\n",role,stat.name);
+    return;
+  }
+  std::sort(s.begin(),s.end());
+  double total=0;
+  for (size_t i=0;i<s.size();i++) total+=s[i];
+  printf("%s %s n=%zu mean=%.3f p50=%.3f p95=%.3f max=%.3f\n", \
+         role,stat.name,s.size(),total/s.size(), \
+         s[s.size()/2],s[(s.size()*95)/100],s.back());
+}
+
+static bool both_synced(sim_world & world)
+{
+  for (size_t i=0;i<world.nodes.size();i++)
+  {
+    if (world.nodes[i]->synced_at_us<0) return false;
+  }
+  return true;
+}
+
+static bool run_until_synced(sim_world & world,int64_t deadline_us)
+{
+  while (world.now_us<deadline_us)
+  {
+    world.run_until(world.now_us+10000);
+    if (both_synced(world)) return true;
+  }
+  return false;
+}
+
+static void boot_pair(sim_world & world,int64_t at_us,bool from_sleep=false,int64_t lead_us=0)
+{
+  // The followers are switched on a little after the leader, or up to
+  // lead_us before it
+  world.boot(0,at_us+lead_us,from_sleep);
+  world.nodes[0]->device->pair_expected=(uint8_t)(world.nodes.size()-1);
+  for (size_t i=1;i<world.nodes.size();i++)
+  {
+    int64_t stagger=(int64_t)(world.random_unit()*(lead_us?lead_us:MAX_BOOT_STAGGER_US));
+    world.boot(i,at_us+stagger,from_sleep);
+  }
+  for (size_t i=0;i<world.nodes.size();i++) world.nodes[i]->reset_metrics();
+}
+
+// Difference between where the leader and a follower think they are in
+// the buzz period, straight after syncing. Only the simulator can see both
+// clocks
+static double sync_error_us(sim_world & world,sim_node * follower)
+{
+  sim_node * leader=world.nodes[0];
+  int64_t leader_phase=leader->local_us()-leader->device->time_offset_us;
+  int64_t follower_phase=follower->local_us()-follower->device->time_offset_us;
+  // The follower moves its epoch on a whole period at a time as it tracks
+  // the leader, only the phase matters
+  int64_t period_us=BUZZ_PERIOD_MS*1000LL;
+  int64_t error=(follower_phase-leader_phase)%period_us;
+  if (error>period_us/2) error-=period_us;
+  if (error<-period_us/2) error+=period_us;
+  return error<0?-error:error;
+}
+
+// Phase error is how far each follower buzz starts from where it should
+// relative to the leader's, in ms
+static void collect_phase_error(sim_node * leader,sim_node * follower,int64_t from_us,sim_stat & stat)
+{
+  std::vector<int64_t> & l=leader->motor_on_edges;
+  std::vector<int64_t> & f=follower->motor_on_edges;
+  const t_sync_state & state=follower->device->main_state;
+  int64_t leader_start,follower_start,end;
+  buzz_window(0,state.slots,leader_start,end);
+  buzz_window(state.slot,state.slots,follower_start,end);
+  size_t j=0;
+  for (size_t i=0;i<l.size();i++)
+  {
+    if (l[i]<from_us) continue;
+    int64_t expected=l[i]+follower_start-leader_start;
+    while (j<f.size() && f[j]<expected-BUZZ_PERIOD_MS*250) j++;
+    if (j>=f.size()) break;
+    int64_t error=f[j]-expected;
+    stat.samples.push_back((error<0?-error:error)/1000.0);
+  }
+}
+
+#ifndef PIO_UNIT_TESTING // pio test brings its own
+int main(int argc,char ** argv)
+{
+  sim_options options;
+  for (int i=1;i<argc;i++)
+  {
+    const char * arg=argv[i];
+    const char * value=(i+1<argc)?argv[i+1]:"";
+    if (strcmp(arg,"--mode")==0)
+    {
+      if (strcmp(value,"pair")==0) options.mode=MODE_PAIR;
+      else if (strcmp(value,"sync")==0) options.mode=MODE_SYNC;
+      else if (strcmp(value,"treatment")==0) options.mode=MODE_TREATMENT;
+      else { fprintf(stderr,"Unknown mode: %s\n",value); return 1; }
+      i++;
+    }
+    else if (strcmp(arg,"--sessions")==0) { options.sessions=atoi(value); i++; }
+    else if (strcmp(arg,"--seed")==0) { options.seed=atoi(value); i++; }
+    else if (strcmp(arg,"--loss")==0) { options.loss=atof(value); i++; }
+    else if (strcmp(arg,"--path-loss")==0) { options.path_loss=atof(value); i++; }
+    else if (strcmp(arg,"--ppm")==0) { options.ppm=atof(value); i++; }
+    else if (strcmp(arg,"--minutes")==0) { options.minutes=atoi(value); i++; }
+    else if (strcmp(arg,"--battery")==0) { options.battery=atof(value); i++; }
+    else if (strcmp(arg,"--followers")==0) { options.followers=atoi(value); i++; }
+    else if (strcmp(arg,"--wake")==0) options.wake=true;
+    else if (strcmp(arg,"--follower-lead")==0) { options.follower_lead=atof(value); i++; }
+    else if (strcmp(arg,"--verbose")==0) options.verbose=true;
+    else if (strcmp(arg,"--trace-out")==0) { options.trace_out=value; i++; }
+    else if (strcmp(arg,"--replay")==0) { options.replay=value; i++; }
+    else if (strcmp(arg,"--bench")==0) options.bench=true;
+    else if (strcmp(arg,"--ulp")==0) options.ulp=true;
+    else if (strcmp(arg,"--rc-ppm")==0) { options.rc_ppm=atof(value); i++; }
+    else { fprintf(stderr,"Unknown option: %s\n",arg); return 1; }
+  }
+  if (options.replay) return replay_trace(options.replay,options.verbose);
+  if (options.followers<1 || options.followers>GROUP_MAX_FOLLOWERS)
+  {
+    fprintf(stderr,"--followers must be 1 to %d\n",GROUP_MAX_FOLLOWERS);
+    return 1;
+  }
+
+  sim_stat wake_to_synced[2]={{"wake_to_synced_ms"},{"wake_to_synced_ms"}};
+  sim_stat radio_on[2]={{"radio_on_ms"},{"radio_on_ms"}};
+  sim_stat packets[2]={{"packets_sent"},{"packets_sent"}};
+  sim_stat tx_power[2]={{"tx_power_qdbm"},{"tx_power_qdbm"}}; // Where link_quality left it
+  sim_stat display[2]={{"display_kbytes"},{"display_kbytes"}};
+  sim_stat wakeups[2]={{"wakeups_per_s"},{"wakeups_per_s"}};
+  sim_stat store_writes[2]={{"store_writes"},{"store_writes"}};
+  sim_stat pair_attempts[2]={{"pair_attempts"},{"pair_attempts"}}; // Frames it took, see retry.h
+  sim_stat sync_attempts[2]={{"sync_attempts"},{"sync_attempts"}};
+  sim_stat radio_duty[2]={{"treatment_radio_pct"},{"treatment_radio_pct"}};
+  sim_stat motor_duty[2]={{"treatment_motor_duty_pct"},{"treatment_motor_duty_pct"}};
+  sim_stat current[2]={{"treatment_ma"},{"treatment_ma"}}; // Mean, off the battery
+  sim_stat ulp_asleep[2]={{"treatment_ulp_asleep_pct"},{"treatment_ulp_asleep_pct"}};
+  sim_stat battery_estimate[2]={{"battery_estimate_min"},{"battery_estimate_min"}}; // What the device said at the start
+  sim_stat battery_flat[2]={{"battery_flat_min"},{"battery_flat_min"}}; // When it shut itself down
+  sim_stat energy_estimate[2]={{"energy_full_charge_min"},{"energy_full_charge_min"}}; // The energy meter's guess
+  sim_stat first_buzz[2]={{"wake_to_first_buzz_ms"},{"wake_to_first_buzz_ms"}};
+  sim_stat pair_first_buzz("wake_to_first_buzz_ms"); // From the last one on to the first buzz anywhere
+  sim_stat phase_error("phase_error_ms");
+  sim_stat sync_error("sync_error_us");
+  sim_stat last_on_to_synced("last_on_to_synced_ms"); // From the last one on until they're all synced
+  uint32_t successes=0;
+
+  clock_t started=clock();
+  for (uint32_t session=0;session<options.sessions;session++)
+  {
+    sim_world world(options.seed+session);
+    world.verbose=options.verbose;
+    world.radio_loss=options.loss;
+    world.path_loss_db=options.path_loss;
+    world.add_node(true,(world.random_unit()*2-1)*options.ppm);
+    for (uint32_t i=0;i<options.followers;i++) world.add_node(false,(world.random_unit()*2-1)*options.ppm);
+    size_t count=world.nodes.size();
+    for (size_t i=0;i<count;i++)
+    {
+      world.nodes[i]->battery_mah=SIM_BATTERY_MAH*options.battery/100;
+      world.nodes[i]->ulp_capable=options.ulp;
+      world.nodes[i]->rc_ppm=options.rc_ppm;
+    }
+
+    int64_t lead_us=(int64_t)(options.follower_lead*1000000);
+    boot_pair(world,0,false,lead_us);
+    bool ok=run_until_synced(world,SESSION_TIMEOUT_US);
+
+    if (ok && options.mode!=MODE_PAIR)
+    {
+      // Let the pairing finish saving, then power cycle (or sleep and wake)
+      // them all and time the resync
+      world.run_until(world.now_us+SETTLE_US);
+      boot_pair(world,world.now_us,options.wake,lead_us);
+      ok=run_until_synced(world,world.now_us+SESSION_TIMEOUT_US);
+    }
+    if (ok)
+    {
+      int64_t last_on=0,all_synced=0;
+      for (size_t i=0;i<count;i++)
+      {
+        last_on=std::max(last_on,world.nodes[i]->boot_us);
+        all_synced=std::max(all_synced,world.nodes[i]->synced_at_us);
+      }
+      last_on_to_synced.samples.push_back((all_synced-last_on)/1000.0);
+    }
+    for (size_t i=1;ok && i<count;i++) sync_error.samples.push_back(sync_error_us(world,world.nodes[i]));
+
+    if (ok && options.mode==MODE_TREATMENT)
+    {
+      int64_t treatment_start=world.now_us;
+      std::vector<int64_t> radio_before(count);
+      std::vector<double> motor_before(count);
+      std::vector<double> mah_before(count);
+      std::vector<int64_t> ulp_before(count);
+      for (size_t i=0;i<count;i++)
+      {
+        sim_node * node=world.nodes[i];
+        radio_before[i]=node->radio_total_us();
+        node->account();
+        motor_before[i]=node->motor_duty_us;
+        mah_before[i]=node->battery_mah;
+        ulp_before[i]=node->ulp_asleep_total_us();
+        if (node->device->battery.known()) battery_estimate[i?1:0].samples.push_back(node->device->battery.minutes_left);
+      }
+      world.run_until(treatment_start+(int64_t)options.minutes*60*1000000LL);
+      for (size_t i=1;i<count;i++) collect_phase_error(world.nodes[0],world.nodes[i],treatment_start+SETTLE_US,phase_error);
+      int64_t last_on=0;
+      int64_t first_edge=-1;
+      for (size_t i=0;i<count;i++)
+      {
+        sim_node * node=world.nodes[i];
+        if (node->boot_us>last_on) last_on=node->boot_us;
+        if (!node->motor_on_edges.empty() && (first_edge<0 || node->motor_on_edges[0]<first_edge)) first_edge=node->motor_on_edges[0];
+      }
+      if (first_edge>=0) pair_first_buzz.samples.push_back((first_edge-last_on)/1000.0);
+      for (size_t i=0;i<count;i++)
+      {
+        sim_node * node=world.nodes[i];
+        int role=i?1:0;
+        int64_t on_us=node->radio_total_us()-radio_before[i];
+        radio_duty[role].samples.push_back(on_us*100.0/(world.now_us-treatment_start));
+        node->account();
+        motor_duty[role].samples.push_back((node->motor_duty_us-motor_before[i])*100.0/(world.now_us-treatment_start));
+        current[role].samples.push_back((mah_before[i]-node->battery_mah)*3.6e9/(world.now_us-treatment_start));
+        if (options.ulp) ulp_asleep[role].samples.push_back((node->ulp_asleep_total_us()-ulp_before[i])*100.0/(world.now_us-treatment_start));
+        if (!node->motor_on_edges.empty()) first_buzz[role].samples.push_back((node->motor_on_edges[0]-node->boot_us)/1000.0);
+        if (node->state==NODE_ASLEEP && node->asleep_at_us>treatment_start) battery_flat[role].samples.push_back((node->asleep_at_us-treatment_start)/60e6);
+        else if (!options.ulp) energy_estimate[role].samples.push_back(node->device->energy.minutes_from(ENERGY_BATTERY_MAH));
+      }
+    }
+
+    if (ok) successes++;
+    if (options.trace_out && session+1==options.sessions)
+    {
+      for (size_t i=0;i<count;i++)
+      {
+        char name[16];
+        if (i<2) snprintf(name,sizeof(name),"%s",i?"follower":"leader");
+        else snprintf(name,sizeof(name),"follower%u",(unsigned)i);
+        std::string path=std::string(options.trace_out)+"-"+name+".trace";
+        if (!save_trace(world.nodes[i],path.c_str())) fprintf(stderr,"Can't write %s\n",path.c_str());
+      }
+    }
+    for (size_t i=0;i<count;i++)
+    {
+      sim_node * node=world.nodes[i];
+      int role=i?1:0;
+      if (node->radio_is_on) node->radio_on_us+=world.now_us-node->radio_on_since;
+      node->radio_on_since=world.now_us;
+      if (ok) wake_to_synced[role].samples.push_back((node->synced_at_us-node->boot_us)/1000.0);
+      radio_on[role].samples.push_back(node->radio_on_us/1000.0);
+      packets[role].samples.push_back(node->packets_sent);
+      tx_power[role].samples.push_back(node->device->link.power);
+      display[role].samples.push_back(node->display_bytes/1024.0);
+      store_writes[role].samples.push_back(node->store_writes);
+      altanx_device * device=node->device;
+      if (device->pair_stats.succeeded) pair_attempts[role].samples.push_back(device->pair_stats.last_attempts);
+      if (device->sync_stats.succeeded) sync_attempts[role].samples.push_back(device->sync_stats.last_attempts);
+      if (world.now_us>node->metrics_since_us) wakeups[role].samples.push_back(node->wakeups*1e6/(world.now_us-node->metrics_since_us));
+    }
+    if (options.bench && session+1==options.sessions)
+    {
+      // After the figures above are taken, so it doesn't move them
+      for (size_t i=0;i<count;i++)
+      {
+        sim_node * node=world.nodes[i];
+        if (node->state!=NODE_OFF && node->state!=NODE_ASLEEP) node->serial_input.push_back('b');
+      }
+      world.run_until(world.now_us+BENCH_WAIT_US);
+    }
+  }
+  double wall_s=(double)(clock()-started)/CLOCKS_PER_SEC;
+
+  const char * mode_names[]={"pair","sync","treatment"};
+  printf("mode=%s sessions=%u followers=%u wake=%d synced=%u loss=%.3f ppm=%.1f wall_s=%.3f sessions_per_s=%.0f\n", \
+         mode_names[options.mode],options.sessions,options.followers,options.wake,successes,options.loss,options.ppm, \
+         wall_s,wall_s>0?options.sessions/wall_s:0.0);
+  const char * roles[]={"leader","follower"};
+  for (int role=0;role<2;role++)
+  {
+    print_stat(roles[role],wake_to_synced[role]);
+    print_stat(roles[role],radio_on[role]);
+    print_stat(roles[role],packets[role]);
+    print_stat(roles[role],tx_power[role]);
+    print_stat(roles[role],display[role]);
+    print_stat(roles[role],wakeups[role]);
+    print_stat(roles[role],store_writes[role]);
+    if (options.mode==MODE_PAIR) print_stat(roles[role],pair_attempts[role]);
+    print_stat(roles[role],sync_attempts[role]);
+    if (options.mode==MODE_TREATMENT) print_stat(roles[role],radio_duty[role]);
+    if (options.mode==MODE_TREATMENT) print_stat(roles[role],motor_duty[role]);
+    if (options.mode==MODE_TREATMENT) print_stat(roles[role],current[role]);
+    if (options.mode==MODE_TREATMENT && options.ulp) print_stat(roles[role],ulp_asleep[role]);
+    if (options.mode==MODE_TREATMENT) print_stat(roles[role],battery_estimate[role]);
+    if (options.mode==MODE_TREATMENT) print_stat(roles[role],battery_flat[role]);
+    if (options.mode==MODE_TREATMENT && !options.ulp) print_stat(roles[role],energy_estimate[role]);
+    if (options.mode==MODE_TREATMENT) print_stat(roles[role],first_buzz[role]);
+  }
+  print_stat("pair",sync_error);
+  print_stat("pair",last_on_to_synced);
+  if (options.mode==MODE_TREATMENT) print_stat("pair",phase_error);
+  if (options.mode==MODE_TREATMENT) print_stat("pair",pair_first_buzz);
+  return 0;
+}
+#endif
@@ -0,0 +1,44 @@
+// (c) Ed French 2021
+
+#include "rendezvous.h"
+
+
+void rendezvous::start(bool radio_up)
+{
+  started_ms=hal.millis();
+  next_ms=started_ms;
+  window_open=false;
+  found=false;
+  fallen_back=false;
+  windows=0;
+  if (radio_up) opened(); // Already listening, that's the first window
+}
+
+bool rendezvous::wanted()
+{
+  if (found || fallen_back) return true;
+  uint32_t now=hal.millis();
+  if (now-started_ms>=RENDEZVOUS_FALLBACK_MS)
+  {
+    LOG_INFO("Leader not heard in %u windows, listening all the time\n",(unsigned)windows);
+    fallen_back=true;
+    return true;
+  }
+  if (window_open && now-opened_ms<RENDEZVOUS_LISTEN_MS) return true;
+  window_open=false;
+  return (int32_t)(now-next_ms)>=0;
+}
+
+void rendezvous::opened()
+{
+  opened_ms=hal.millis();
+  next_ms=opened_ms+RENDEZVOUS_PERIOD_MS;
+  window_open=true;
+  windows++;
+}
+
+void rendezvous::heard()
+{
+  if (!found && !fallen_back) LOG_DEBUG("Leader heard in window %u\n",(unsigned)windows);
+  found=true;
+}
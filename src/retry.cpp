@@ -0,0 +1,79 @@
+// (c) Ed French 2021
+
+#include <stdio.h>
+#include "retry.h"
+
+
+void retry_timer::start(const retry_policy & policy,uint32_t seed)
+{
+  this->policy=policy;
+  started_ms=hal.millis();
+  next_ms=started_ms;
+  gap_ms=policy.first_ms;
+  attempts=0;
+  jitter_state=seed?seed:1;
+}
+
+bool retry_timer::due()
+{
+  return (int32_t)(hal.millis()-next_ms)>=0;
+}
+
+void retry_timer::sent()
+{
+  attempts++;
+  next_ms=hal.millis()+jittered(gap_ms);
+  uint32_t grown=(uint32_t)((uint64_t)gap_ms*policy.growth_pct/100);
+  gap_ms=grown>policy.max_ms?policy.max_ms:grown;
+}
+
+void retry_timer::heard()
+{
+  gap_ms=policy.first_ms;
+  next_ms=hal.millis()+jittered(gap_ms);
+}
+
+bool retry_timer::expired()
+{
+  return policy.deadline_ms && hal.millis()-started_ms>=policy.deadline_ms;
+}
+
+uint32_t retry_timer::elapsed_ms()
+{
+  return hal.millis()-started_ms;
+}
+
+uint32_t retry_timer::jittered(uint32_t ms)
+{
+  if (!policy.jitter_pct || !ms) return ms;
+  jitter_state^=jitter_state<<13;
+  jitter_state^=jitter_state>>17;
+  jitter_state^=jitter_state<<5;
+  uint32_t spread=ms*policy.jitter_pct/100;
+  return ms-spread+jitter_state%(2*spread+1);
+}
+
+
+void retry_stats::record(bool success,uint16_t attempts,uint32_t ms)
+{
+  if (!success)
+  {
+    failed++;
+    return;
+  }
+  succeeded++;
+  this->attempts+=attempts;
+  last_attempts=attempts;
+  if (attempts>max_attempts) max_attempts=attempts;
+  total_ms+=ms;
+}
+
+void retry_stats::report(altanx_hal & hal)
+{
+  char line[112];
+  snprintf(line,sizeof(line),"RETRY %s succeeded=%lu failed=%lu mean_attempts=%.1f max_attempts=%u mean_ms=%lu\n", \
+           name,(unsigned long)succeeded,(unsigned long)failed, \
+           succeeded?(double)attempts/succeeded:0.0,(unsigned)max_attempts, \
+           (unsigned long)(succeeded?total_ms/succeeded:0));
+  hal.log_write(hal.micros(),line);
+}
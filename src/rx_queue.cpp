@@ -0,0 +1,49 @@
+// (c) Ed French 2021
+
+#include <string.h>
+#include "rx_queue.h"
+
+
+bool rx_queue::push(const uint8_t * mac_addr,const uint8_t * data,int len,int8_t rssi,int64_t rx_time_us,uint32_t rx_time_ms)
+{
+  received.fetch_add(1,std::memory_order_relaxed);
+  uint32_t h=head.load(std::memory_order_relaxed);
+  uint32_t in_use=h-tail.load(std::memory_order_acquire);
+  if (in_use>=RX_QUEUE_SLOTS)
+  {
+    dropped.fetch_add(1,std::memory_order_relaxed);
+    return false;
+  }
+  if (len<0) len=0;
+  if (len>RX_FRAME_BYTES)
+  {
+    truncated.fetch_add(1,std::memory_order_relaxed);
+    len=RX_FRAME_BYTES;
+  }
+
+  rx_frame & frame=slots[h%RX_QUEUE_SLOTS];
+  memcpy(frame.mac_addr,mac_addr,6);
+  memcpy(frame.data,data,len);
+  frame.len=(uint8_t)len;
+  frame.rssi=rssi;
+  frame.rx_time_us=rx_time_us;
+  frame.rx_time_ms=rx_time_ms;
+  head.store(h+1,std::memory_order_release); // Publishes the slot
+
+  if (in_use+1>high_water.load(std::memory_order_relaxed)) high_water.store(in_use+1,std::memory_order_relaxed);
+  return true;
+}
+
+bool rx_queue::pop(rx_frame & frame)
+{
+  uint32_t t=tail.load(std::memory_order_relaxed);
+  if (t==head.load(std::memory_order_acquire)) return false;
+  frame=slots[t%RX_QUEUE_SLOTS];
+  tail.store(t+1,std::memory_order_release); // Hands the slot back
+  return true;
+}
+
+bool rx_queue::empty() const
+{
+  return tail.load(std::memory_order_relaxed)==head.load(std::memory_order_acquire);
+}
@@ -0,0 +1,202 @@
+// (c) Ed French 2021
+
+#include <string.h>
+#include "state_store.h"
+#include "wire_protocol.h"
+#include "altanx.h"
+
+
+static const char * slot_keys[STATE_SLOT_COUNT]={"state_a","state_b"};
+
+#define STATE_FLAG_LEADER 0x01
+#define STATE_FLAG_BUZZ 0x02
+#define STATE_FLAG_LED 0x04
+
+// t_sync_state as the original firmware laid it out in memory, which is
+// what it saved. Same on the ESP32 and the host
+struct legacy_sync_state
+{
+  uint32_t pairing_state;
+  uint8_t partner[6];
+  bool is_leader;
+  bool is_synced;
+  bool buzz_enabled;
+  bool led_enabled;
+  uint32_t time_offset;
+  uint32_t state_change_time;
+};
+
+static_assert(sizeof(legacy_sync_state)==24,"Legacy state layout has changed");
+
+static void put_u32(uint8_t * p,uint32_t value)
+{
+  p[0]=(uint8_t)value;
+  p[1]=(uint8_t)(value>>8);
+  p[2]=(uint8_t)(value>>16);
+  p[3]=(uint8_t)(value>>24);
+}
+
+static uint32_t get_u32(const uint8_t * p)
+{
+  return p[0] | (p[1]<<8) | ((uint32_t)p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+static bool newer(uint32_t a,uint32_t b)
+{
+  return (int32_t)(a-b)>0; // Survives the sequence wrapping, not that it will
+}
+
+// Version 1 payload (also kept in the wake cache, see wake_cache.h):
+//   0  pairing state, BLANK_WAITING_TO_START_PAIRING or PAIRED_NOT_SYNCED
+//   1  partner mac, 6 bytes. The leader's first follower
+//   7  flags: leader, buzz, LED
+// Version 2 adds, for a leader:
+//   8  number of followers
+//   9  the other followers' macs, 6 bytes each
+// A version 1 leader with a partner has one follower
+void state_encode_payload(const t_sync_state & state,uint8_t * payload)
+{
+  memset(payload,0,STATE_PAYLOAD_BYTES);
+  payload[0]=(uint8_t)state.pairing_state;
+  memcpy(payload+1,state.is_leader?state.group.macs[0]:state.partner,6);
+  payload[7]=(state.is_leader?STATE_FLAG_LEADER:0) | \
+             (state.buzz_enabled?STATE_FLAG_BUZZ:0) | \
+             (state.led_enabled?STATE_FLAG_LED:0);
+  if (!state.is_leader) return;
+  payload[8]=state.group.count;
+  for (uint8_t i=1;i<state.group.count && i<GROUP_MAX_FOLLOWERS;i++) memcpy(payload+9+6*(i-1),state.group.macs[i],6);
+}
+
+void state_decode_payload(const uint8_t * payload,t_sync_state & state)
+{
+  memset(&state,0,sizeof(state));
+  state.pairing_state=(pairing_states)payload[0];
+  state.is_leader=payload[7]&STATE_FLAG_LEADER;
+  state.buzz_enabled=payload[7]&STATE_FLAG_BUZZ;
+  state.led_enabled=payload[7]&STATE_FLAG_LED;
+  if (!state.is_leader)
+  {
+    memcpy(state.partner,payload+1,6);
+    return;
+  }
+  memcpy(state.group.macs[0],payload+1,6);
+  state.group.count=payload[8]>GROUP_MAX_FOLLOWERS?GROUP_MAX_FOLLOWERS:payload[8];
+  if (!state.group.count && memcmp(payload+1,"\0\0\0\0\0\0",6)!=0) state.group.count=1;
+  for (uint8_t i=1;i<state.group.count;i++) memcpy(state.group.macs[i],payload+9+6*(i-1),6);
+}
+
+bool state_store::read_slot(int8_t slot,uint8_t * payload,uint32_t & sequence)
+{
+  if (!hal.store_has(slot_keys[slot])) return false;
+  uint8_t record[STATE_MAX_RECORD];
+  size_t len=hal.store_read(slot_keys[slot],record,sizeof(record));
+  bool good=len>=8 && record[0]=='A' && record[1]=='S' && record[2]>=STATE_VERSION_MIN;
+  size_t n=good?record[3]:0;
+  good=good && n>=STATE_PAYLOAD_MIN_BYTES && len==8+n+2;
+  good=good && wire_crc16(record,8+n)==(uint16_t)(record[8+n] | (record[8+n+1]<<8));
+  good=good && record[8]<DUMMY;
+  if (!good)
+  {
+    bad_records++;
+    LOG_WARN("State slot %s is no good, %u bytes\n",slot_keys[slot],(unsigned)len);
+    return false;
+  }
+  sequence=get_u32(record+4);
+  // Any newer fields are ignored, any a version 1 record doesn't have are 0
+  memset(payload,0,STATE_PAYLOAD_BYTES);
+  memcpy(payload,record+8,n<STATE_PAYLOAD_BYTES?n:STATE_PAYLOAD_BYTES);
+  return true;
+}
+
+bool state_store::load_legacy(t_sync_state & state)
+{
+  legacy_sync_state legacy;
+  if (hal.store_read(STATE_LEGACY_KEY,&legacy,sizeof(legacy))!=sizeof(legacy)) return false;
+  if (legacy.pairing_state>=DUMMY) return false;
+  memset(&state,0,sizeof(state));
+  state.pairing_state=(pairing_states)legacy.pairing_state;
+  state.is_leader=legacy.is_leader;
+  if (state.is_leader)
+  {
+    memcpy(state.group.macs[0],legacy.partner,6);
+    state.group.count=memcmp(legacy.partner,"\0\0\0\0\0\0",6)!=0;
+  } else {
+    memcpy(state.partner,legacy.partner,6);
+  }
+  state.buzz_enabled=legacy.buzz_enabled;
+  state.led_enabled=legacy.led_enabled;
+  return true;
+}
+
+bool state_store::load(t_sync_state & state)
+{
+  slot=-1;
+  uint8_t payload[STATE_PAYLOAD_BYTES];
+  for (int8_t i=0;i<STATE_SLOT_COUNT;i++)
+  {
+    uint32_t slot_sequence;
+    if (!read_slot(i,payload,slot_sequence)) continue;
+    if (slot<0 || newer(slot_sequence,sequence))
+    {
+      slot=i;
+      sequence=slot_sequence;
+      memcpy(stored,payload,sizeof(stored));
+    }
+  }
+  if (slot>=0)
+  {
+    have_stored=true;
+    state_decode_payload(stored,state);
+    LOG_INFO("Loaded state from %s, write %u\n",slot_keys[slot],(unsigned)sequence);
+    return true;
+  }
+
+  if (hal.store_has(STATE_LEGACY_KEY) && load_legacy(state))
+  {
+    // Leave have_stored clear so the first save() writes the new format
+    migrated=true;
+    LOG_INFO("Migrated state from the old %s record\n",STATE_LEGACY_KEY);
+    return true;
+  }
+  return false;
+}
+
+void state_store::resume(const uint8_t * payload,int8_t slot,uint32_t sequence)
+{
+  this->slot=slot;
+  this->sequence=sequence;
+  memcpy(stored,payload,sizeof(stored));
+  have_stored=slot>=0;
+}
+
+bool state_store::save(const t_sync_state & state)
+{
+  uint8_t payload[STATE_PAYLOAD_BYTES];
+  state_encode_payload(state,payload);
+  if (have_stored && memcmp(payload,stored,sizeof(payload))==0)
+  {
+    skipped++;
+    return false;
+  }
+
+  uint8_t record[8+STATE_PAYLOAD_BYTES+2];
+  record[0]='A';
+  record[1]='S';
+  record[2]=STATE_VERSION;
+  record[3]=STATE_PAYLOAD_BYTES;
+  put_u32(record+4,sequence+1);
+  memcpy(record+8,payload,STATE_PAYLOAD_BYTES);
+  uint16_t crc=wire_crc16(record,8+STATE_PAYLOAD_BYTES);
+  record[8+STATE_PAYLOAD_BYTES]=(uint8_t)crc;
+  record[8+STATE_PAYLOAD_BYTES+1]=(uint8_t)(crc>>8);
+
+  // Never over the newest good copy
+  int8_t target=(slot==0)?1:0;
+  hal.store_write(slot_keys[target],record,sizeof(record));
+  slot=target;
+  sequence++;
+  writes++;
+  memcpy(stored,payload,sizeof(stored));
+  have_stored=true;
+  return true;
+}
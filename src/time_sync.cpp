@@ -0,0 +1,137 @@
+// (c) Ed French 2021
+
+#include "time_sync.h"
+
+
+static int64_t median(int64_t * values,uint8_t count)
+{
+  // Insertion sort, there are only ever a handful
+  for (uint8_t i=1;i<count;i++)
+  {
+    int64_t v=values[i];
+    int8_t j=i-1;
+    while (j>=0 && values[j]>v)
+    {
+      values[j+1]=values[j];
+      j--;
+    }
+    values[j+1]=v;
+  }
+  if (count==0) return 0;
+  if (count & 1) return values[count/2];
+  return (values[count/2-1]+values[count/2])/2;
+}
+
+void time_sync_estimator::reset()
+{
+  count=0;
+}
+
+void time_sync_estimator::add(int64_t t1,int64_t t2,int64_t t3,int64_t t4)
+{
+  if (count>=SYNC_EXCHANGES) return;
+  samples[count].offset_us=((t2-t1)+(t3-t4))/2;
+  samples[count].delay_us=(t4-t1)-(t3-t2);
+  count++;
+}
+
+int64_t time_sync_estimator::median_offset_us()
+{
+  int64_t values[SYNC_EXCHANGES];
+  for (uint8_t i=0;i<count;i++) values[i]=samples[i].offset_us;
+  return median(values,count);
+}
+
+int64_t time_sync_estimator::median_delay_us()
+{
+  int64_t values[SYNC_EXCHANGES];
+  for (uint8_t i=0;i<count;i++) values[i]=samples[i].delay_us;
+  return median(values,count);
+}
+
+int64_t time_sync_estimator::offset_spread_us()
+{
+  if (count==0) return 0;
+  int64_t lowest=samples[0].offset_us;
+  int64_t highest=lowest;
+  for (uint8_t i=1;i<count;i++)
+  {
+    if (samples[i].offset_us<lowest) lowest=samples[i].offset_us;
+    if (samples[i].offset_us>highest) highest=samples[i].offset_us;
+  }
+  return highest-lowest;
+}
+
+
+void drift_estimator::reset()
+{
+  count=0;
+  next=0;
+  mean_local=0;
+  mean_offset=0;
+  skew=prior;
+}
+
+void drift_estimator::add(int64_t local_us,int64_t offset_us)
+{
+  local[next]=local_us;
+  offset[next]=offset_us;
+  next=(next+1)%DRIFT_POINTS;
+  if (count<DRIFT_POINTS) count++;
+  fit();
+}
+
+void drift_estimator::fit()
+{
+  // Centred on the means so the squares stay well inside a double
+  mean_local=0;
+  mean_offset=0;
+  for (uint8_t i=0;i<count;i++)
+  {
+    mean_local+=local[i];
+    mean_offset+=offset[i];
+  }
+  mean_local/=count;
+  mean_offset/=count;
+  double sxx=0;
+  double sxy=0;
+  for (uint8_t i=0;i<count;i++)
+  {
+    double dx=local[i]-mean_local;
+    sxx+=dx*dx;
+    sxy+=dx*(offset[i]-mean_offset);
+  }
+  skew=(count>=2 && sxx>0)?sxy/sxx:prior;
+}
+
+int64_t drift_estimator::offset_at(int64_t local_us)
+{
+  return (int64_t)(mean_offset+skew*(local_us-mean_local));
+}
+
+int64_t drift_estimator::local_for(int64_t leader_us)
+{
+  // leader = local + offset_at(local), one substitution is plenty at ppm skews
+  int64_t local_us=leader_us-offset_at(leader_us);
+  return leader_us-offset_at(local_us);
+}
+
+int64_t resync_next_interval_us(int64_t last_interval_us,int64_t prediction_error_us)
+{
+  int64_t error=prediction_error_us<0?-prediction_error_us:prediction_error_us;
+  int64_t interval;
+  if (error>RESYNC_ERROR_BUDGET_US)
+  {
+    interval=last_interval_us/2;
+  } else {
+    // Residual skew is about error/interval, so this is the gap that would
+    // use up the budget. Never more than double in one go
+    if (error<RESYNC_NOISE_US) error=RESYNC_NOISE_US;
+    interval=(int64_t)((double)last_interval_us*RESYNC_ERROR_BUDGET_US/error);
+    if (interval>2*last_interval_us) interval=2*last_interval_us;
+  }
+  if (interval<RESYNC_MIN_INTERVAL_MS*1000LL) interval=RESYNC_MIN_INTERVAL_MS*1000LL;
+  if (interval>RESYNC_MAX_INTERVAL_MS*1000LL) interval=RESYNC_MAX_INTERVAL_MS*1000LL;
+  // Keep to the retry grid, see the top of time_sync.h
+  return interval-interval%(RESYNC_MIN_INTERVAL_MS*1000LL);
+}
@@ -0,0 +1,151 @@
+// (c) Ed French 2021
+
+#include <stdio.h>
+#include <string.h>
+#include "trace.h"
+
+
+static const char * kind_names[TRACE_KIND_COUNT]={"NONE","BOOT","RANDOM","BUTTON","RX","TX","SENT","STATE","MOTOR","BATTERY"};
+
+const char * trace_kind_name(uint8_t kind)
+{
+  return kind<TRACE_KIND_COUNT?kind_names[kind]:"?";
+}
+
+trace_recorder::trace_recorder(altanx_hal & hal) : hal(hal),enabled(true),next(0)
+{
+  memset(&boot,0,sizeof(boot));
+  for (uint32_t i=0;i<TRACE_EVENTS;i++) slots[i].sequence.store(0,std::memory_order_relaxed);
+}
+
+void trace_recorder::record(trace_kinds kind,uint8_t a,uint8_t b,uint32_t value, \
+                            const uint8_t * mac,const uint8_t * data,size_t len,int64_t at_us)
+{
+  if (!enabled.load(std::memory_order_relaxed)) return;
+  uint32_t position=next.fetch_add(1,std::memory_order_relaxed);
+  slot & s=slots[position&(TRACE_EVENTS-1)];
+  s.sequence.store(0,std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  trace_event & event=s.event;
+  event.at_us=at_us<0?hal.micros():at_us;
+  event.kind=kind;
+  event.a=a;
+  event.b=b;
+  event.value=value;
+  if (mac) memcpy(event.mac,mac,6);
+  else memset(event.mac,0,6);
+  if (len>TRACE_DATA_BYTES) len=TRACE_DATA_BYTES;
+  event.len=(uint8_t)len;
+  if (len) memcpy(event.data,data,len);
+  s.sequence.store(position+1,std::memory_order_release);
+}
+
+size_t trace_recorder::copy(trace_event * out,size_t max,uint32_t since)
+{
+  size_t n=0;
+  if (since==0 && boot.kind==TRACE_BOOT && n<max) out[n++]=boot;
+  uint32_t end=next.load(std::memory_order_acquire);
+  uint32_t start=end>TRACE_EVENTS?end-TRACE_EVENTS:0;
+  lost=start>since?start-since:0;
+  if (start<since) start=since;
+  for (uint32_t position=start;position!=end && n<max;position++)
+  {
+    // Read, then check nobody started on the slot meanwhile
+    slot & s=slots[position&(TRACE_EVENTS-1)];
+    if (s.sequence.load(std::memory_order_acquire)!=position+1) continue;
+    out[n]=s.event;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (s.sequence.load(std::memory_order_relaxed)!=position+1) continue;
+    n++;
+  }
+  return n;
+}
+
+void trace_recorder::dump()
+{
+  // One event at a time out of the ring rather than a copy, there isn't the
+  // stack for one
+  bool was_enabled=enabled.exchange(false);
+  char line[TRACE_LINE_CHARS];
+  uint32_t end=next.load(std::memory_order_acquire);
+  uint32_t start=end>TRACE_EVENTS?end-TRACE_EVENTS:0;
+  snprintf(line,sizeof(line),"TRACE_BEGIN events=%u lost=%u\n",(unsigned)(end-start),(unsigned)start);
+  hal.log_write(hal.micros(),line);
+  if (boot.kind==TRACE_BOOT)
+  {
+    trace_format(boot,line,sizeof(line));
+    hal.log_write(hal.micros(),line);
+  }
+  for (uint32_t position=start;position!=end;position++)
+  {
+    slot & s=slots[position&(TRACE_EVENTS-1)];
+    if (s.sequence.load(std::memory_order_acquire)!=position+1) continue;
+    trace_format(s.event,line,sizeof(line));
+    hal.log_write(hal.micros(),line);
+  }
+  hal.log_write(hal.micros(),"TRACE_END\n");
+  enabled.store(was_enabled);
+}
+
+static void put_hex(char * out,const uint8_t * bytes,size_t len)
+{
+  static const char digits[]="0123456789abcdef";
+  for (size_t i=0;i<len;i++)
+  {
+    out[2*i]=digits[bytes[i]>>4];
+    out[2*i+1]=digits[bytes[i]&0x0f];
+  }
+  out[2*len]=0;
+}
+
+static size_t get_hex(const char * text,uint8_t * bytes,size_t max)
+{
+  size_t n=0;
+  while (n<max && text[0] && text[1])
+  {
+    unsigned value;
+    if (sscanf(text,"%2x",&value)!=1) break;
+    bytes[n++]=(uint8_t)value;
+    text+=2;
+  }
+  return n;
+}
+
+size_t trace_format(const trace_event & event,char * out,size_t size)
+{
+  static const uint8_t no_mac[6]={0,0,0,0,0,0};
+  char mac[13];
+  char data[2*TRACE_DATA_BYTES+1];
+  if (memcmp(event.mac,no_mac,6)==0) strcpy(mac,"-");
+  else put_hex(mac,event.mac,6);
+  if (event.len==0) strcpy(data,"-");
+  else put_hex(data,event.data,event.len<=TRACE_DATA_BYTES?event.len:TRACE_DATA_BYTES);
+  int len=snprintf(out,size,"TRACE %lld %s %u %u %lu %s %s\n",(long long)event.at_us,trace_kind_name(event.kind), \
+                   (unsigned)event.a,(unsigned)event.b,(unsigned long)event.value,mac,data);
+  if (len<0) return 0;
+  return (size_t)len<size?(size_t)len:size-1;
+}
+
+bool trace_parse(const char * line,trace_event & event)
+{
+  const char * p=strstr(line,"TRACE ");
+  if (!p) return false;
+  long long at_us;
+  char kind[16];
+  unsigned a,b;
+  unsigned long value;
+  char mac[16];
+  char data[2*TRACE_DATA_BYTES+4];
+  if (sscanf(p+6,"%lld %15s %u %u %lu %15s %131s",&at_us,kind,&a,&b,&value,mac,data)!=7) return false;
+  memset(&event,0,sizeof(event));
+  for (uint8_t i=1;i<TRACE_KIND_COUNT;i++)
+    if (strcmp(kind,kind_names[i])==0) event.kind=i;
+  if (event.kind==TRACE_NONE) return false;
+  event.at_us=at_us;
+  event.a=(uint8_t)a;
+  event.b=(uint8_t)b;
+  event.value=(uint32_t)value;
+  if (mac[0]!='-' && get_hex(mac,event.mac,6)!=6) return false;
+  if (data[0]!='-') event.len=(uint8_t)get_hex(data,event.data,TRACE_DATA_BYTES);
+  return true;
+}
@@ -0,0 +1,105 @@
+// (c) Ed French 2021
+
+#include <math.h>
+#include "ulp_stim.h"
+
+static double ulp_tick_us(uint32_t cal)
+{
+  return cal/(double)(1UL<<ULP_CAL_FRAC_BITS);
+}
+
+// Leader's clock onto ours
+static double ulp_local(int64_t leader_us,int32_t skew_ppb)
+{
+  return leader_us/(1.0+skew_ppb*1e-9);
+}
+
+
+bool ulp_plan_for(const ulp_schedule & schedule,int64_t now_us,uint32_t cal,ulp_plan & plan)
+{
+  if (!cal || schedule.period_us<=0 || schedule.window_end_us<=schedule.window_start_us) return false;
+  double tick_us=ulp_tick_us(cal);
+  double period=ulp_local(schedule.period_us,schedule.skew_ppb);
+  double start=ulp_local(schedule.window_start_us,schedule.skew_ppb);
+  double length=ulp_local(schedule.window_end_us,schedule.skew_ppb)-start;
+
+  // First window that starts far enough ahead to get the ULP going
+  double first=schedule.epoch_us+start+ \
+               ceil((now_us+ULP_LEAD_US-schedule.epoch_us-start)/period)*period;
+  if (first>=schedule.wake_us) return false;
+  double windows=floor((schedule.wake_us-first)/period)+1+ULP_SPARE_WINDOWS;
+  if (windows>UINT16_MAX) return false;
+
+  // Whole pulses to the window, so the last one ends with it
+  double pulses=floor(length/ULP_PWM_US+0.5);
+  if (pulses<1) pulses=1;
+  if (pulses>UINT16_MAX) return false;
+  double pwm=length/pulses;
+  double high=pwm*schedule.duty/255;
+
+  double first_ticks=floor((first-now_us-ULP_WAKE_US)/tick_us+0.5);
+  double on_ticks=floor((high-ULP_WAKE_US)/tick_us+0.5);
+  double off_ticks=floor((pwm-high-ULP_WAKE_US)/tick_us+0.5);
+  double gap=(period-2*pulses*ULP_WAKE_US)/tick_us-pulses*on_ticks-(pulses-1)*off_ticks;
+  double gap_ticks=floor(gap);
+  double gap_frac=floor((gap-gap_ticks)*65536+0.5);
+  if (gap_frac>=65536)
+  {
+    gap_ticks++;
+    gap_frac=0;
+  }
+  if (first_ticks<1 || on_ticks<1 || off_ticks<1 || gap_ticks<1 || first_ticks>UINT32_MAX) return false;
+  plan.first_ticks=(uint32_t)first_ticks;
+  plan.on_ticks=(uint32_t)on_ticks;
+  plan.off_ticks=(uint32_t)off_ticks;
+  plan.gap_ticks=(uint32_t)gap_ticks;
+  plan.gap_frac=(uint16_t)gap_frac;
+  plan.pulses=(uint16_t)pulses;
+  plan.windows=(uint16_t)windows;
+  plan.first_us=(int64_t)floor(first+0.5);
+  return true;
+}
+
+// A pulse's start to the next one's, two wakes and all
+static double ulp_pulse_us(const ulp_plan & plan,double tick_us,double wake_us)
+{
+  return (plan.on_ticks+(double)plan.off_ticks)*tick_us+2*wake_us;
+}
+
+// A window's start to its last pulse's end
+static double ulp_length_us(const ulp_plan & plan,double tick_us,double wake_us)
+{
+  return (plan.pulses-1)*ulp_pulse_us(plan,tick_us,wake_us)+wake_us+plan.on_ticks*tick_us;
+}
+
+bool ulp_window_us(const ulp_plan & plan,uint32_t window,double tick_us,double wake_us,int64_t & start_us,int64_t & end_us)
+{
+  if (window>=plan.windows) return false;
+  // The gaps before this window went over that many times
+  double carries=floor((window*(double)plan.gap_frac+ULP_ACC_START)/65536);
+  double ticks=plan.pulses*(double)plan.on_ticks+(plan.pulses-1)*(double)plan.off_ticks+plan.gap_ticks;
+  double at=wake_us+plan.first_ticks*tick_us+window*(ticks*tick_us+2*plan.pulses*wake_us)+carries*tick_us;
+  start_us=(int64_t)floor(at+0.5);
+  end_us=(int64_t)floor(at+ulp_length_us(plan,tick_us,wake_us)+0.5);
+  return true;
+}
+
+uint8_t ulp_window_duty(const ulp_plan & plan,double tick_us,double wake_us)
+{
+  double high=plan.pulses*(plan.on_ticks*tick_us+wake_us);
+  return (uint8_t)floor(255*high/ulp_length_us(plan,tick_us,wake_us)+0.5);
+}
+
+int64_t ulp_plan_error_us(const ulp_plan & plan,const ulp_schedule & schedule,int64_t started_us,uint32_t cal)
+{
+  double tick_us=ulp_tick_us(cal);
+  double period=ulp_local(schedule.period_us,schedule.skew_ppb);
+  double worst=0;
+  int64_t start_us,end_us;
+  for (uint32_t window=0;ulp_window_us(plan,window,tick_us,ULP_WAKE_US,start_us,end_us);window++)
+  {
+    double error=fabs(started_us+start_us-(plan.first_us+window*period));
+    if (error>worst) worst=error;
+  }
+  return (int64_t)worst;
+}
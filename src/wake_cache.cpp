@@ -0,0 +1,71 @@
+// (c) Ed French 2021
+
+#include <string.h>
+#include "wake_cache.h"
+#include "wire_protocol.h"
+#include "altanx.h"
+
+
+static void put_u32(uint8_t * p,uint32_t value)
+{
+  p[0]=(uint8_t)value;
+  p[1]=(uint8_t)(value>>8);
+  p[2]=(uint8_t)(value>>16);
+  p[3]=(uint8_t)(value>>24);
+}
+
+static uint32_t get_u32(const uint8_t * p)
+{
+  return p[0] | (p[1]<<8) | ((uint32_t)p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+bool wake_cache::load(t_sync_state & state,state_store & store,int32_t & skew_ppb)
+{
+  uint8_t record[WAKE_CACHE_BYTES];
+  size_t len=hal.rtc_read(record,sizeof(record));
+  if (!len) return false;
+  bool good=len==sizeof(record) && record[0]=='A' && record[1]=='W';
+  good=good && record[2]==WAKE_CACHE_VERSION && record[3]==STATE_PAYLOAD_BYTES;
+  good=good && wire_crc16(record,13+STATE_PAYLOAD_BYTES)== \
+              (uint16_t)(record[13+STATE_PAYLOAD_BYTES] | (record[13+STATE_PAYLOAD_BYTES+1]<<8));
+  good=good && record[13]<DUMMY && (int8_t)record[8]<STATE_SLOT_COUNT;
+  if (!good)
+  {
+    LOG_WARN("Wake cache is no good, %u bytes\n",(unsigned)len);
+    return false;
+  }
+  state_decode_payload(record+13,state);
+  store.resume(record+13,(int8_t)record[8],get_u32(record+4));
+  skew_ppb=(int32_t)get_u32(record+9);
+  return true;
+}
+
+size_t wake_cache::load_extra(void * extra,size_t len)
+{
+  uint8_t record[WAKE_CACHE_BYTES+WAKE_CACHE_EXTRA_BYTES];
+  if (len>WAKE_CACHE_EXTRA_BYTES) len=WAKE_CACHE_EXTRA_BYTES;
+  size_t got=hal.rtc_read(record,WAKE_CACHE_BYTES+len);
+  if (got<=WAKE_CACHE_BYTES) return 0;
+  memcpy(extra,record+WAKE_CACHE_BYTES,got-WAKE_CACHE_BYTES);
+  return got-WAKE_CACHE_BYTES;
+}
+
+void wake_cache::save(const t_sync_state & state,const state_store & store,int32_t skew_ppb, \
+                      const void * extra,size_t extra_len)
+{
+  uint8_t record[WAKE_CACHE_BYTES+WAKE_CACHE_EXTRA_BYTES];
+  record[0]='A';
+  record[1]='W';
+  record[2]=WAKE_CACHE_VERSION;
+  record[3]=STATE_PAYLOAD_BYTES;
+  put_u32(record+4,store.sequence);
+  record[8]=(uint8_t)store.slot;
+  put_u32(record+9,(uint32_t)skew_ppb);
+  state_encode_payload(state,record+13);
+  uint16_t crc=wire_crc16(record,13+STATE_PAYLOAD_BYTES);
+  record[13+STATE_PAYLOAD_BYTES]=(uint8_t)crc;
+  record[13+STATE_PAYLOAD_BYTES+1]=(uint8_t)(crc>>8);
+  if (extra_len>WAKE_CACHE_EXTRA_BYTES) extra_len=0; // Too big to keep whole
+  if (extra_len) memcpy(record+WAKE_CACHE_BYTES,extra,extra_len);
+  hal.rtc_write(record,WAKE_CACHE_BYTES+extra_len);
+}
@@ -0,0 +1,118 @@
+// (c) Ed French 2021
+
+#include "waveform.h"
+#include "altanx.h"
+
+
+#define KICK_DUTY 255
+#define KICK_MS 40 // Long enough to get the rotor turning
+#define SUSTAIN_DUTY 96 // Keeps it spinning at about the old PWM_LEVEL feel
+
+static const waveform_step square_steps[]=
+{
+  {PWM_LEVEL,0,WAVEFORM_SUSTAIN}
+};
+
+static const waveform_step soft_steps[]=
+{
+  {KICK_DUTY,0,KICK_MS},
+  {SUSTAIN_DUTY,30,WAVEFORM_SUSTAIN},
+  {0,120,0}
+};
+
+static const waveform_step pulse_steps[]=
+{
+  {KICK_DUTY,0,KICK_MS},
+  {SUSTAIN_DUTY,20,120},
+  {0,40,80},
+  {KICK_DUTY,0,KICK_MS},
+  {SUSTAIN_DUTY,20,120},
+  {0,40,80},
+  {KICK_DUTY,0,KICK_MS},
+  {SUSTAIN_DUTY,20,120},
+  {0,40,0}
+};
+
+#define STEPS(table) table,(uint8_t)(sizeof(table)/sizeof(table[0]))
+
+const waveform waveforms[WAVEFORM_COUNT]=
+{
+  {"square",STEPS(square_steps)},
+  {"soft",STEPS(soft_steps)},
+  {"pulses",STEPS(pulse_steps)}
+};
+
+bool waveform_at(const waveform & wave,int64_t t_us,int64_t window_us,waveform_point & point)
+{
+  point.step=-1;
+  point.duty=0;
+  point.ramp_ms=0;
+  point.start_us=window_us;
+  point.end_us=window_us;
+  if (t_us<0 || t_us>=window_us) return false;
+
+  // The sustain step gets whatever the others leave
+  int64_t fixed_us=0;
+  for (uint8_t i=0;i<wave.count;i++)
+  {
+    const waveform_step & step=wave.steps[i];
+    fixed_us+=(int64_t)step.ramp_ms*1000;
+    if (step.hold_ms!=WAVEFORM_SUSTAIN) fixed_us+=(int64_t)step.hold_ms*1000;
+  }
+  int64_t sustain_us=window_us>fixed_us?window_us-fixed_us:0;
+
+  int64_t start_us=0;
+  for (uint8_t i=0;i<wave.count;i++)
+  {
+    const waveform_step & step=wave.steps[i];
+    int64_t length_us=(int64_t)step.ramp_ms*1000+ \
+                      (step.hold_ms==WAVEFORM_SUSTAIN?sustain_us:(int64_t)step.hold_ms*1000);
+    if (t_us<start_us+length_us || i==wave.count-1)
+    {
+      point.step=i;
+      point.duty=step.duty;
+      point.ramp_ms=step.ramp_ms;
+      point.start_us=start_us;
+      point.end_us=start_us+length_us;
+      if (point.end_us>window_us || i==wave.count-1) point.end_us=window_us;
+      if (t_us>=start_us+length_us)
+      {
+        // Past the end of the table, it stays where the last step left it
+        point.ramp_ms=0;
+        point.start_us=start_us+length_us;
+      }
+      return true;
+    }
+    start_us+=length_us;
+  }
+  return true;
+}
+
+uint8_t waveform_mean_duty(const waveform & wave,int64_t window_us,int64_t period_us)
+{
+  if (period_us<=0 || window_us<=0) return 0;
+  // Area under the steps, ramps being straight lines, cut off at the end of the window
+  uint64_t area=0;
+  int64_t t_us=0;
+  uint8_t duty=0;
+  waveform_point point;
+  while (t_us<window_us && waveform_at(wave,t_us,window_us,point))
+  {
+    int64_t ramp_us=(int64_t)point.ramp_ms*1000;
+    int64_t ramp_end_us=point.start_us+ramp_us;
+    if (ramp_end_us>point.end_us) ramp_end_us=point.end_us;
+    if (ramp_end_us>t_us)
+    {
+      // Only part of the ramp fits if the window's short, average over what does
+      int64_t length_us=ramp_end_us-t_us;
+      uint8_t reached=duty+(int32_t)(point.duty-duty)*length_us/ramp_us;
+      area+=(uint64_t)(duty+reached)*length_us/2;
+      t_us=ramp_end_us;
+    }
+    duty=point.duty;
+    area+=(uint64_t)duty*(point.end_us-t_us);
+    t_us=point.end_us;
+  }
+  uint64_t mean=area/period_us;
+  return mean>255?255:(uint8_t)mean;
+}
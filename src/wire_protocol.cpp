@@ -0,0 +1,189 @@
+// (c) Ed French 2021
+
+#include <string.h>
+#include "wire_protocol.h"
+
+static_assert(WIRE_MAX_FRAME>=WIRE_HEADER_BYTES+8*WIRE_MAX_TIMESTAMPS+WIRE_CRC_BYTES,"WIRE_MAX_FRAME must fit a time reply");
+
+
+static int timestamps_for(uint8_t type)
+{
+  switch (type)
+  {
+    case WIRE_PAIR_REQUEST:
+    case WIRE_PAIR_ECHO:
+    case WIRE_SYNC_REQUEST:
+      return 0;
+    case WIRE_SYNC_DONE:
+      return 1;
+    case WIRE_TIME_REQUEST: // Padded to match the reply, see wire_protocol.h
+    case WIRE_TIME_REPLY:
+      return 4;
+    case WIRE_GROUP_REPLY: // t3 epoch, then the entries
+      return 2;
+    default:
+      return -1;
+  }
+}
+
+static void put_u16(uint8_t * p,uint16_t value)
+{
+  p[0]=(uint8_t)value;
+  p[1]=(uint8_t)(value>>8);
+}
+
+static uint16_t get_u16(const uint8_t * p)
+{
+  return (uint16_t)(p[0] | (p[1]<<8));
+}
+
+static void put_u32(uint8_t * p,uint32_t value)
+{
+  put_u16(p,(uint16_t)value);
+  put_u16(p+2,(uint16_t)(value>>16));
+}
+
+static uint32_t get_u32(const uint8_t * p)
+{
+  return get_u16(p) | ((uint32_t)get_u16(p+2)<<16);
+}
+
+static void put_i64(uint8_t * p,int64_t value)
+{
+  put_u32(p,(uint32_t)value);
+  put_u32(p+4,(uint32_t)((uint64_t)value>>32));
+}
+
+static int64_t get_i64(const uint8_t * p)
+{
+  return (int64_t)(get_u32(p) | ((uint64_t)get_u32(p+4)<<32));
+}
+
+
+uint16_t wire_crc16(const uint8_t * data,size_t len)
+{
+  // CRC-16/CCITT-FALSE, bit at a time is plenty for 57 bytes
+  uint16_t crc=0xFFFF;
+  for (size_t i=0;i<len;i++)
+  {
+    crc^=(uint16_t)data[i]<<8;
+    for (int bit=0;bit<8;bit++)
+    {
+      crc=(crc&0x8000)?(uint16_t)((crc<<1)^0x1021):(uint16_t)(crc<<1);
+    }
+  }
+  return crc;
+}
+
+static size_t extra_bytes(const wire_message & message)
+{
+  if (message.type!=WIRE_GROUP_REPLY) return 0;
+  return 2+WIRE_ENTRY_BYTES*(size_t)message.entry_count;
+}
+
+size_t wire_encode(const wire_message & message,uint8_t * buffer,size_t size)
+{
+  int count=timestamps_for(message.type);
+  if (count<0 || message.entry_count>WIRE_MAX_ENTRIES) return 0;
+  size_t len=WIRE_HEADER_BYTES+8*count+extra_bytes(message)+WIRE_CRC_BYTES;
+  if (size<len) return 0;
+
+  buffer[0]=WIRE_MAGIC_0;
+  buffer[1]=WIRE_MAGIC_1;
+  buffer[2]=WIRE_VERSION;
+  buffer[3]=message.type;
+  put_u16(buffer+4,message.seq);
+  put_u32(buffer+6,message.session);
+  int64_t timestamps[WIRE_MAX_TIMESTAMPS]={message.t1,message.t2,message.t3,message.epoch};
+  if (message.type==WIRE_GROUP_REPLY)
+  {
+    timestamps[0]=message.t3;
+    timestamps[1]=message.epoch;
+  }
+  for (int i=0;i<count;i++) put_i64(buffer+WIRE_HEADER_BYTES+8*i,timestamps[i]);
+  if (message.type==WIRE_GROUP_REPLY)
+  {
+    uint8_t * p=buffer+WIRE_HEADER_BYTES+8*count;
+    *p++=message.slots;
+    *p++=message.entry_count;
+    for (uint8_t i=0;i<message.entry_count;i++,p+=WIRE_ENTRY_BYTES)
+    {
+      p[0]=message.entries[i].slot;
+      put_u32(p+1,message.entries[i].t1);
+      put_u32(p+5,message.entries[i].held_us);
+    }
+  }
+  put_u16(buffer+len-WIRE_CRC_BYTES,wire_crc16(buffer,len-WIRE_CRC_BYTES));
+  return len;
+}
+
+wire_results wire_decode(const uint8_t * data,size_t len,wire_message & message)
+{
+  memset(&message,0,sizeof(message));
+  if (len<WIRE_HEADER_BYTES+WIRE_CRC_BYTES) return WIRE_TOO_SHORT;
+  if (data[0]!=WIRE_MAGIC_0 || data[1]!=WIRE_MAGIC_1) return WIRE_BAD_MAGIC;
+  if (wire_crc16(data,len-WIRE_CRC_BYTES)!=get_u16(data+len-WIRE_CRC_BYTES)) return WIRE_BAD_CRC;
+  if (data[2]<WIRE_MIN_VERSION) return WIRE_BAD_VERSION;
+  int count=timestamps_for(data[3]);
+  if (count<0) return WIRE_BAD_TYPE;
+  // Newer versions may carry more after our fields, never less
+  if (len<WIRE_HEADER_BYTES+8*(size_t)count+WIRE_CRC_BYTES) return WIRE_TOO_SHORT;
+
+  message.version=data[2];
+  message.type=data[3];
+  message.seq=get_u16(data+4);
+  message.session=get_u32(data+6);
+  int64_t timestamps[WIRE_MAX_TIMESTAMPS]={0,0,0,0};
+  for (int i=0;i<count;i++) timestamps[i]=get_i64(data+WIRE_HEADER_BYTES+8*i);
+  if (message.type==WIRE_GROUP_REPLY)
+  {
+    message.t3=timestamps[0];
+    message.epoch=timestamps[1];
+    const uint8_t * p=data+WIRE_HEADER_BYTES+8*count;
+    size_t left=len-WIRE_CRC_BYTES-(WIRE_HEADER_BYTES+8*count);
+    if (left<2 || p[1]>WIRE_MAX_ENTRIES || left<2+WIRE_ENTRY_BYTES*(size_t)p[1]) return WIRE_TOO_SHORT;
+    message.slots=*p++;
+    message.entry_count=*p++;
+    for (uint8_t i=0;i<message.entry_count;i++,p+=WIRE_ENTRY_BYTES)
+    {
+      message.entries[i].slot=p[0];
+      message.entries[i].t1=get_u32(p+1);
+      message.entries[i].held_us=get_u32(p+5);
+    }
+    return WIRE_OK;
+  }
+  message.t1=timestamps[0];
+  message.t2=timestamps[1];
+  message.t3=timestamps[2];
+  message.epoch=timestamps[3];
+  return WIRE_OK;
+}
+
+const char * wire_type_name(uint8_t type)
+{
+  switch (type)
+  {
+    case WIRE_PAIR_REQUEST: return "pair request";
+    case WIRE_PAIR_ECHO: return "pair echo";
+    case WIRE_SYNC_REQUEST: return "sync request";
+    case WIRE_TIME_REQUEST: return "time request";
+    case WIRE_TIME_REPLY: return "time reply";
+    case WIRE_SYNC_DONE: return "sync done";
+    case WIRE_GROUP_REPLY: return "group reply";
+    default: return "unknown";
+  }
+}
+
+const char * wire_result_name(wire_results result)
+{
+  switch (result)
+  {
+    case WIRE_OK: return "ok";
+    case WIRE_TOO_SHORT: return "too short";
+    case WIRE_BAD_MAGIC: return "bad magic";
+    case WIRE_BAD_VERSION: return "bad version";
+    case WIRE_BAD_TYPE: return "bad type";
+    case WIRE_BAD_CRC: return "bad CRC";
+    default: return "?";
+  }
+}
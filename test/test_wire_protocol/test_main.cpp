@@ -0,0 +1,217 @@
+// (c) Ed French 2021
+
+// Host tests for wire_protocol.h: pio test -e native
+
+#include <string.h>
+#include <unity.h>
+#include "wire_protocol.h"
+
+void setUp() {}
+void tearDown() {}
+
+static wire_message message_of(uint8_t type)
+{
+  wire_message message;
+  memset(&message,0,sizeof(message));
+  message.version=WIRE_VERSION;
+  message.type=type;
+  message.seq=0xBEEF;
+  message.session=0xA5C3F00D;
+  switch (type)
+  {
+    case WIRE_SYNC_DONE:
+      message.t1=0x0123456789ABLL;
+      break;
+    case WIRE_TIME_REQUEST:
+    case WIRE_TIME_REPLY:
+      message.t1=123456789;
+      message.t2=-987654321; // Sign survives the packing
+      message.t3=0x7FFFFFFFFFFFFFFFLL;
+      message.epoch=100000000;
+      break;
+    case WIRE_GROUP_REPLY:
+      message.t3=123460150;
+      message.epoch=100000000;
+      message.slots=WIRE_MAX_ENTRIES+1;
+      message.entry_count=WIRE_MAX_ENTRIES;
+      for (uint8_t i=0;i<WIRE_MAX_ENTRIES;i++)
+      {
+        message.entries[i].slot=i+1;
+        message.entries[i].t1=0xFFFFFF00u+i;
+        message.entries[i].held_us=150+i;
+      }
+      break;
+  }
+  return message;
+}
+
+// New CRC after a frame's been changed on purpose
+static void reseal(uint8_t * frame,size_t len)
+{
+  uint16_t crc=wire_crc16(frame,len-WIRE_CRC_BYTES);
+  frame[len-2]=(uint8_t)crc;
+  frame[len-1]=(uint8_t)(crc>>8);
+}
+
+static void check_same(const wire_message & sent,const wire_message & got)
+{
+  TEST_ASSERT_EQUAL_UINT8(sent.type,got.type);
+  TEST_ASSERT_EQUAL_UINT16(sent.seq,got.seq);
+  TEST_ASSERT_EQUAL_UINT32(sent.session,got.session);
+  TEST_ASSERT_TRUE(sent.t1==got.t1);
+  TEST_ASSERT_TRUE(sent.t2==got.t2);
+  TEST_ASSERT_TRUE(sent.t3==got.t3);
+  TEST_ASSERT_TRUE(sent.epoch==got.epoch);
+  TEST_ASSERT_EQUAL_UINT8(sent.slots,got.slots);
+  TEST_ASSERT_EQUAL_UINT8(sent.entry_count,got.entry_count);
+  for (uint8_t i=0;i<sent.entry_count;i++)
+  {
+    TEST_ASSERT_EQUAL_UINT8(sent.entries[i].slot,got.entries[i].slot);
+    TEST_ASSERT_EQUAL_UINT32(sent.entries[i].t1,got.entries[i].t1);
+    TEST_ASSERT_EQUAL_UINT32(sent.entries[i].held_us,got.entries[i].held_us);
+  }
+}
+
+static void test_round_trip()
+{
+  static const uint8_t types[]={WIRE_PAIR_REQUEST,WIRE_PAIR_ECHO,WIRE_SYNC_REQUEST,WIRE_TIME_REQUEST, \
+                                WIRE_TIME_REPLY,WIRE_SYNC_DONE,WIRE_GROUP_REPLY};
+  for (size_t i=0;i<sizeof(types);i++)
+  {
+    wire_message sent=message_of(types[i]);
+    uint8_t frame[WIRE_MAX_FRAME];
+    size_t len=wire_encode(sent,frame,sizeof(frame));
+    TEST_ASSERT_NOT_EQUAL(0,len);
+    wire_message got;
+    TEST_ASSERT_EQUAL(WIRE_OK,wire_decode(frame,len,got));
+    TEST_ASSERT_EQUAL_UINT8(WIRE_VERSION,got.version);
+    check_same(sent,got);
+  }
+}
+
+static void test_group_reply_fewer_entries()
+{
+  wire_message sent=message_of(WIRE_GROUP_REPLY);
+  sent.entry_count=1;
+  uint8_t frame[WIRE_MAX_FRAME];
+  size_t len=wire_encode(sent,frame,sizeof(frame));
+  TEST_ASSERT_EQUAL(WIRE_GROUP_BYTES-WIRE_ENTRY_BYTES*(WIRE_MAX_ENTRIES-1),len);
+  wire_message got;
+  TEST_ASSERT_EQUAL(WIRE_OK,wire_decode(frame,len,got));
+  check_same(sent,got);
+}
+
+static void test_flipped_bit()
+{
+  // The magic's checked first, every other bit is down to the CRC
+  wire_message sent=message_of(WIRE_TIME_REPLY);
+  uint8_t frame[WIRE_MAX_FRAME];
+  size_t len=wire_encode(sent,frame,sizeof(frame));
+  for (size_t bit=16;bit<len*8;bit++)
+  {
+    frame[bit/8]^=1<<(bit%8);
+    wire_message got;
+    TEST_ASSERT_EQUAL(WIRE_BAD_CRC,wire_decode(frame,len,got));
+    frame[bit/8]^=1<<(bit%8);
+  }
+}
+
+static void test_bad_magic()
+{
+  wire_message sent=message_of(WIRE_PAIR_REQUEST);
+  uint8_t frame[WIRE_MAX_FRAME];
+  size_t len=wire_encode(sent,frame,sizeof(frame));
+  frame[1]='Y';
+  reseal(frame,len);
+  wire_message got;
+  TEST_ASSERT_EQUAL(WIRE_BAD_MAGIC,wire_decode(frame,len,got));
+}
+
+static void test_old_version()
+{
+  wire_message sent=message_of(WIRE_TIME_REPLY);
+  uint8_t frame[WIRE_MAX_FRAME];
+  size_t len=wire_encode(sent,frame,sizeof(frame));
+  frame[2]=WIRE_MIN_VERSION-1;
+  reseal(frame,len);
+  wire_message got;
+  TEST_ASSERT_EQUAL(WIRE_BAD_VERSION,wire_decode(frame,len,got));
+}
+
+static void test_truncated()
+{
+  // A time reply with only three of its four timestamps, CRC and all
+  wire_message sent=message_of(WIRE_TIME_REPLY);
+  uint8_t frame[WIRE_MAX_FRAME];
+  wire_encode(sent,frame,sizeof(frame));
+  size_t len=WIRE_HEADER_BYTES+8*3+WIRE_CRC_BYTES;
+  reseal(frame,len);
+  wire_message got;
+  TEST_ASSERT_EQUAL(WIRE_TOO_SHORT,wire_decode(frame,len,got));
+  TEST_ASSERT_EQUAL(WIRE_TOO_SHORT,wire_decode(frame,WIRE_HEADER_BYTES+WIRE_CRC_BYTES-1,got));
+}
+
+static void test_newer_with_trailing_bytes()
+{
+  // A later version's extra fields go between ours and the CRC
+  wire_message sent=message_of(WIRE_TIME_REPLY);
+  uint8_t frame[WIRE_MAX_FRAME+8];
+  size_t len=wire_encode(sent,frame,sizeof(frame));
+  size_t extra=5;
+  memset(frame+len-WIRE_CRC_BYTES,0x5A,extra);
+  len+=extra;
+  frame[2]=WIRE_VERSION+1;
+  reseal(frame,len);
+  wire_message got;
+  TEST_ASSERT_EQUAL(WIRE_OK,wire_decode(frame,len,got));
+  TEST_ASSERT_EQUAL_UINT8(WIRE_VERSION+1,got.version);
+  check_same(sent,got);
+}
+
+static void test_group_reply_too_many_entries()
+{
+  wire_message sent=message_of(WIRE_GROUP_REPLY);
+  uint8_t frame[WIRE_MAX_FRAME+WIRE_ENTRY_BYTES];
+  size_t len=wire_encode(sent,frame,sizeof(frame));
+  // Room for another entry, and a count that says there is one
+  memset(frame+len-WIRE_CRC_BYTES,0,WIRE_ENTRY_BYTES);
+  len+=WIRE_ENTRY_BYTES;
+  frame[WIRE_HEADER_BYTES+8*2+1]=WIRE_MAX_ENTRIES+1;
+  reseal(frame,len);
+  wire_message got;
+  TEST_ASSERT_EQUAL(WIRE_TOO_SHORT,wire_decode(frame,len,got));
+
+  sent.entry_count=WIRE_MAX_ENTRIES+1;
+  TEST_ASSERT_EQUAL(0,wire_encode(sent,frame,sizeof(frame)));
+}
+
+static void test_group_reply_short_of_entries()
+{
+  wire_message sent=message_of(WIRE_GROUP_REPLY);
+  uint8_t frame[WIRE_MAX_FRAME];
+  size_t len=wire_encode(sent,frame,sizeof(frame));
+  // Says three, carries two and a bit
+  len-=4;
+  reseal(frame,len);
+  wire_message got;
+  TEST_ASSERT_EQUAL(WIRE_TOO_SHORT,wire_decode(frame,len,got));
+  // No count at all
+  len=WIRE_HEADER_BYTES+8*2+1+WIRE_CRC_BYTES;
+  reseal(frame,len);
+  TEST_ASSERT_EQUAL(WIRE_TOO_SHORT,wire_decode(frame,len,got));
+}
+
+int main(int argc,char ** argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_round_trip);
+  RUN_TEST(test_group_reply_fewer_entries);
+  RUN_TEST(test_flipped_bit);
+  RUN_TEST(test_bad_magic);
+  RUN_TEST(test_old_version);
+  RUN_TEST(test_truncated);
+  RUN_TEST(test_newer_with_trailing_bytes);
+  RUN_TEST(test_group_reply_too_many_entries);
+  RUN_TEST(test_group_reply_short_of_entries);
+  return UNITY_END();
+}